@@ -0,0 +1,166 @@
+/* FPGA register access tracing, built with ./configure --enable-fpga-trace
+ * (FPGA_TRACE).  Included from fpga.c in place of the plain accessors.
+ *
+ * With FPGA_TRACE_FILE=<file> set, every fpga_peek*()/fpga_poke*() appends
+ * one struct fpga_trace (host byte order) with the CLOCK_MONOTONIC time,
+ * the access time, offset, width, direction and value.  Records collect in
+ * a buffer per thread, so the access path takes no lock, and go out with
+ * one O_APPEND write() per buffer, when it fills, at thread exit and at
+ * exit.  fpga_trace prints, summarizes and replays the file. */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+#define FPGA_TRACE_WRITE 0x80 /* In op, with the width in bytes */
+
+struct fpga_trace {
+	uint64_t t_ns;   /* CLOCK_MONOTONIC before the access */
+	uint64_t val;
+	uint32_t dur_ns; /* Of the load or store */
+	uint16_t offs;
+	uint8_t op;
+	uint8_t tid;     /* Low bits of the thread id */
+};
+
+#define FPGA_TRACE_BUF 512
+
+struct fpga_trace_buf {
+	int n;
+	uint8_t tid;
+	struct fpga_trace rec[FPGA_TRACE_BUF];
+};
+
+static int fpga_trace_fd = -1;
+static pthread_once_t fpga_trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t fpga_trace_key;
+static __thread struct fpga_trace_buf *fpga_trace_tls;
+
+static inline uint64_t fpga_trace_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void fpga_trace_write(struct fpga_trace_buf *b) {
+	if (b->n && write(fpga_trace_fd, b->rec, b->n * sizeof(b->rec[0])) < 0)
+		perror("FPGA_TRACE_FILE");
+	b->n = 0;
+}
+
+/* Thread exit */
+static void fpga_trace_release(void *p) {
+	fpga_trace_write(p);
+	free(p);
+}
+
+static void fpga_trace_exit(void) {
+	if (fpga_trace_tls)
+		fpga_trace_write(fpga_trace_tls);
+}
+
+/* Once, from the first traced access of any thread */
+static void fpga_trace_init(void) {
+	const char *path = getenv("FPGA_TRACE_FILE");
+
+	fpga_trace_fd = -1;
+	if (!path)
+		return;
+	fpga_trace_fd = open(path, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0666);
+	if (fpga_trace_fd < 0) {
+		perror(path);
+		return;
+	}
+	pthread_key_create(&fpga_trace_key, fpga_trace_release);
+	atexit(fpga_trace_exit);
+}
+
+static void fpga_trace_add(uint64_t t0, size_t offs, int op, uint64_t val) {
+	uint64_t t1 = fpga_trace_now();
+	struct fpga_trace_buf *b = fpga_trace_tls;
+	struct fpga_trace *r;
+
+	if (!b) {
+		pthread_once(&fpga_trace_once, fpga_trace_init);
+		if (fpga_trace_fd < 0)
+			return;
+		b = calloc(1, sizeof(*b));
+		if (!b)
+			return;
+		b->tid = syscall(SYS_gettid);
+		fpga_trace_tls = b;
+		pthread_setspecific(fpga_trace_key, b);
+	}
+
+	r = &b->rec[b->n++];
+	r->t_ns = t0;
+	r->val = val;
+	r->dur_ns = t1 - t0;
+	r->offs = offs;
+	r->op = op;
+	r->tid = b->tid;
+	if (b->n == FPGA_TRACE_BUF)
+		fpga_trace_write(b);
+}
+
+static inline uint8_t fpga_peek8(size_t offs) {
+	uint64_t t0 = fpga_trace_now();
+	uint8_t v = *(volatile uint8_t *)(fpga + offs);
+
+	fpga_trace_add(t0, offs, 1, v);
+	return v;
+}
+
+static inline uint16_t fpga_peek16(size_t offs) {
+	uint64_t t0 = fpga_trace_now();
+	uint16_t v = *(volatile uint16_t *)(fpga + offs);
+
+	fpga_trace_add(t0, offs, 2, v);
+	return v;
+}
+
+static inline uint32_t fpga_peek32(size_t offs) {
+	uint64_t t0 = fpga_trace_now();
+	uint32_t v = *(volatile uint32_t *)(fpga + offs);
+
+	fpga_trace_add(t0, offs, 4, v);
+	return v;
+}
+
+static inline uint64_t fpga_peek64(size_t offs) {
+	uint64_t t0 = fpga_trace_now();
+	uint64_t v = *(volatile uint64_t *)(fpga + offs);
+
+	fpga_trace_add(t0, offs, 8, v);
+	return v;
+}
+
+static inline void fpga_poke32(size_t offs, uint32_t val) {
+	uint64_t t0 = fpga_trace_now();
+
+	*(volatile uint32_t *)(fpga + offs) = val;
+	fpga_trace_add(t0, offs, FPGA_TRACE_WRITE | 4, val);
+}
+
+static inline void fpga_poke64(size_t offs, uint64_t val) {
+	uint64_t t0 = fpga_trace_now();
+
+	*(volatile uint64_t *)(fpga + offs) = val;
+	fpga_trace_add(t0, offs, FPGA_TRACE_WRITE | 8, val);
+}
+
+static inline void fpga_poke16(size_t offs, uint16_t val) {
+	uint64_t t0 = fpga_trace_now();
+
+	*(volatile uint16_t *)(fpga + offs) = val;
+	fpga_trace_add(t0, offs, FPGA_TRACE_WRITE | 2, val);
+}
+
+static inline void fpga_poke8(size_t offs, uint8_t val) {
+	uint64_t t0 = fpga_trace_now();
+
+	*(volatile uint8_t *)(fpga + offs) = val;
+	fpga_trace_add(t0, offs, FPGA_TRACE_WRITE | 1, val);
+}
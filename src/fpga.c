@@ -1,12 +1,19 @@
 #include <fcntl.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <assert.h>
 
+#include "tsprobes.h"
+
 static size_t fpga;
 
+#ifdef FPGA_TRACE
+#include "fpga-trace.c"
+#else
 static inline uint8_t fpga_peek8(size_t offs) {
 	return *(volatile uint8_t *)(fpga + offs);
 }
@@ -38,13 +45,31 @@ static inline void fpga_poke16(size_t offs, uint16_t val) {
 static inline void fpga_poke8(size_t offs, uint8_t val) {
 	*(volatile uint8_t *)(fpga + offs) = val;
 }
+#endif
 
-void fpga_init(void)
+/* FPGA_RESOURCE may name a plain file (created if missing) to stand in for
+ * the FPGA registers, which lets the register side of the tools run without
+ * a board. */
+static void fpga_init(void)
 {
 	int fd;
+	const char *res = getenv("FPGA_RESOURCE");
+	struct stat st;
+
+	if (fpga)
+		return;
 
-	fd = open("/sys/bus/pci/devices/0000:02:00.0/resource0", O_RDWR|O_SYNC);
+	if (res)
+		fd = open(res, O_RDWR|O_SYNC|O_CREAT, 0644);
+	else
+		fd = open(res = "/sys/bus/pci/devices/0000:02:00.0/resource0", O_RDWR|O_SYNC);
+	TS_PROBE2(fpga_open, res, fd);
 	assert(fd != -1);
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size < 4096) {
+		int r = ftruncate(fd, 4096);
+		assert(r == 0);
+	}
 	fpga = (size_t)mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	TS_PROBE2(fpga_mmap, fd, fpga);
 	assert ((void *)fpga != (void *)-1);
 }
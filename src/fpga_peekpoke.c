@@ -9,7 +9,7 @@
 
 #include "fpga.c"
 
-void usage(char *name)
+static void usage(char *name)
 {
 	fprintf(stderr, "Usage %s <bit width 8, 16, 32, 64> <address> [value]\n", name);
 	fprintf(stderr, "\tEg: %s 32 0x0\n", name);
@@ -18,7 +18,7 @@ void usage(char *name)
 int main(int argc, char **argv) {
 	int sz;
 	uint32_t off;
-	uint64_t val;
+	uint64_t val = 0;
 
 	if(argc != 3 && argc != 4) {
 		usage(argv[0]);
@@ -0,0 +1,229 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* The record format, and the replay goes through the traced accessors so
+ * FPGA_TRACE_FILE can capture the replay's own timing */
+#ifndef FPGA_TRACE
+#define FPGA_TRACE
+#endif
+#include "fpga.c"
+
+/* Mismatching reads printed during --replay */
+#define MAX_MISMATCH_PRINT 10
+
+static struct fpga_trace *load(const char *path, size_t *n)
+{
+	struct fpga_trace *t;
+	struct stat st;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f || fstat(fileno(f), &st) < 0) {
+		perror(path);
+		return NULL;
+	}
+	*n = st.st_size / sizeof(*t);
+	t = malloc(*n ? *n * sizeof(*t) : 1);
+	assert(t);
+	if (fread(t, sizeof(*t), *n, f) != *n) {
+		perror(path);
+		free(t);
+		t = NULL;
+	}
+	fclose(f);
+	return t;
+}
+
+static int cmp_time(const void *a, const void *b)
+{
+	const struct fpga_trace *x = a, *y = b;
+
+	return x->t_ns < y->t_ns ? -1 : x->t_ns > y->t_ns;
+}
+
+/* By register, then access time */
+static int cmp_reg(const void *a, const void *b)
+{
+	const struct fpga_trace *x = a, *y = b;
+
+	if (x->offs != y->offs)
+		return x->offs < y->offs ? -1 : 1;
+	if (x->op != y->op)
+		return x->op < y->op ? -1 : 1;
+	return x->dur_ns < y->dur_ns ? -1 : x->dur_ns > y->dur_ns;
+}
+
+static void print(const struct fpga_trace *t, size_t n)
+{
+	size_t i;
+
+	printf("%12s %5s %4s %6s %18s %8s\n", "t_us", "tid", "op", "offs",
+	       "value", "dur_ns");
+	for (i = 0; i < n; i++)
+		printf("%12.3f %5u %c%-3d 0x%04x 0x%016llx %8u\n",
+		       (t[i].t_ns - t[0].t_ns) / 1e3, t[i].tid,
+		       (t[i].op & FPGA_TRACE_WRITE) ? 'W' : 'R',
+		       (t[i].op & ~FPGA_TRACE_WRITE) * 8, t[i].offs,
+		       (unsigned long long)t[i].val, t[i].dur_ns);
+}
+
+/* Count and access time percentiles per register, width and direction */
+static void stats(struct fpga_trace *t, size_t n)
+{
+	size_t i, j;
+	uint64_t sum;
+
+	if (n)
+		printf("accesses=%zu span_us=%.1f\n", n,
+		       (t[n - 1].t_ns - t[0].t_ns) / 1e3);
+	qsort(t, n, sizeof(*t), cmp_reg);
+	printf("%6s %4s %8s %8s %8s %8s %8s\n", "offs", "op", "count",
+	       "min_ns", "p50_ns", "p99_ns", "max_ns");
+	for (i = 0; i < n; i = j) {
+		sum = 0;
+		for (j = i; j < n && t[j].offs == t[i].offs &&
+		     t[j].op == t[i].op; j++)
+			sum += t[j].dur_ns;
+		printf("0x%04x %c%-3d %8zu %8u %8u %8u %8u\n", t[i].offs,
+		       (t[i].op & FPGA_TRACE_WRITE) ? 'W' : 'R',
+		       (t[i].op & ~FPGA_TRACE_WRITE) * 8, j - i, t[i].dur_ns,
+		       t[i + (j - i - 1) * 50 / 100].dur_ns,
+		       t[i + (j - i - 1) * 99 / 100].dur_ns, t[j - 1].dur_ns);
+	}
+}
+
+static void sleep_until(uint64_t ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / 1000000000ULL;
+	ts.tv_nsec = ns % 1000000000ULL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/* Repeats the accesses in time order.  Writes store the recorded value,
+ * reads are compared with it. */
+static int replay(const struct fpga_trace *t, size_t n, int timing)
+{
+	uint64_t t0, v = 0;
+	size_t i, mismatch = 0;
+
+	fpga_init();
+	t0 = fpga_trace_now();
+	for (i = 0; i < n; i++) {
+		if (timing)
+			sleep_until(t0 + (t[i].t_ns - t[0].t_ns));
+		switch (t[i].op) {
+		case 1: v = fpga_peek8(t[i].offs); break;
+		case 2: v = fpga_peek16(t[i].offs); break;
+		case 4: v = fpga_peek32(t[i].offs); break;
+		case 8: v = fpga_peek64(t[i].offs); break;
+		case FPGA_TRACE_WRITE | 1: fpga_poke8(t[i].offs, t[i].val); continue;
+		case FPGA_TRACE_WRITE | 2: fpga_poke16(t[i].offs, t[i].val); continue;
+		case FPGA_TRACE_WRITE | 4: fpga_poke32(t[i].offs, t[i].val); continue;
+		case FPGA_TRACE_WRITE | 8: fpga_poke64(t[i].offs, t[i].val); continue;
+		default:
+			fprintf(stderr, "record %zu: bad op 0x%x\n", i, t[i].op);
+			return 1;
+		}
+		if (v != t[i].val && mismatch++ < MAX_MISMATCH_PRINT)
+			printf("mismatch offs=0x%04x read=0x%llx recorded=0x%llx\n",
+			       t[i].offs, (unsigned long long)v,
+			       (unsigned long long)t[i].val);
+	}
+
+	printf("accesses=%zu\n", n);
+	printf("read_mismatches=%zu\n", mismatch);
+	if (n) {
+		printf("recorded_us=%.1f\n", (t[n - 1].t_ns - t[0].t_ns) / 1e3);
+		printf("replay_us=%.1f\n", (fpga_trace_now() - t0) / 1e3);
+	}
+	return 0;
+}
+
+static void usage(char **argv) {
+	fprintf(stderr,
+		"Usage: %s [OPTIONS] <file>\n"
+		"embeddedTS FPGA access trace tool\n"
+		"\n"
+		"  -p, --print            Print each access in time order (default)\n"
+		"  -s, --stats            Access counts and times per register\n"
+		"  -r, --replay           Repeat the accesses against the FPGA, or the\n"
+		"                         FPGA_RESOURCE file\n"
+		"  -t, --timing           With --replay, keep the recorded spacing\n"
+		"  -h, --help             This message\n"
+		"\n"
+		"Traces come from tools built with ./configure --enable-fpga-trace and\n"
+		"run with FPGA_TRACE_FILE=<file>.\n",
+		argv[0]
+	);
+}
+
+int main(int argc, char **argv)
+{
+	int c, opt_print = 0, opt_stats = 0, opt_replay = 0, opt_timing = 0;
+	struct fpga_trace *t;
+	size_t n;
+	int ret = 0;
+
+	static struct option long_options[] = {
+		{ "print", 0, 0, 'p' },
+		{ "stats", 0, 0, 's' },
+		{ "replay", 0, 0, 'r' },
+		{ "timing", 0, 0, 't' },
+		{ "help", 0, 0, 'h' },
+		{ 0, 0, 0, 0 }
+	};
+
+	while((c = getopt_long(argc, argv, "psrth", long_options, NULL)) != -1) {
+		switch(c) {
+		case 'p':
+			opt_print = 1;
+			break;
+		case 's':
+			opt_stats = 1;
+			break;
+		case 'r':
+			opt_replay = 1;
+			break;
+		case 't':
+			opt_timing = 1;
+			break;
+		case 'h':
+		default:
+			usage(argv);
+			return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv);
+		return 1;
+	}
+
+	t = load(argv[optind], &n);
+	if (!t)
+		return 1;
+	qsort(t, n, sizeof(*t), cmp_time);
+
+	if (opt_print || !(opt_stats || opt_replay))
+		print(t, n);
+	if (opt_replay)
+		ret = replay(t, n, opt_timing);
+	if (opt_stats)
+		stats(t, n);
+
+	free(t);
+	return ret;
+}
@@ -2,17 +2,34 @@
 
 #define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <errno.h>
+#include <endian.h>
+#include <getopt.h>
+
+#include "fpga.c"
+#include "sha256.c"
 
 #define MIN(x, y)   (((x) < (y))?(x):(y))
 
+#define DEFAULT_DEVICE "/dev/mtdblock0"
+#define DEFAULT_ERASE_SIZE 65536
+#define MAX_ERASE_SIZE (16 << 20)
+#define RAW_CHUNK 65536
+#define DEFAULT_RECORD "/var/lib/load_fpga_flash.last"
+
+/* Exit status when the flash already holds the bitstream and the FPGA is
+ * running it */
+#define EXIT_CURRENT 2
+
 static const unsigned char reverse[] =
 {
   0x00, 0x80, 0x40, 0xC0, 0x20, 0xA0, 0x60, 0xE0, 0x10, 0x90, 0x50, 0xD0, 0x30, 0xB0, 0x70, 0xF0,
@@ -33,77 +50,552 @@ static const unsigned char reverse[] =
   0x0F, 0x8F, 0x4F, 0xCF, 0x2F, 0xAF, 0x6F, 0xEF, 0x1F, 0x9F, 0x5F, 0xDF, 0x3F, 0xBF, 0x7F, 0xFF
 };
 
-static unsigned char sector_buffer[512];
+/* A flash image from --build: this header, then the bitstream already bit
+ * reversed and padded with 0xff (erased flash) to whole erase blocks.  The
+ * padding lets mtdblock write each block without reading it first.  All
+ * fields are little endian. */
+#define IMAGE_MAGIC "TSFPGAIM"
+#define IMAGE_VERSION 1
+#define IMAGE_HDR_LEN 512
+#define IMAGE_HAS_ID (1 << 0) /* fpga_rev/fpga_hash are set */
+
+struct flash_image {
+	char magic[8];
+	uint32_t version;
+	uint32_t hdr_len;	/* Payload starts here */
+	uint32_t length;	/* Of the bitstream */
+	uint32_t padded_len;	/* Of the payload, whole erase blocks */
+	uint32_t erase_size;
+	uint32_t flags;		/* IMAGE_HAS_ID */
+	uint32_t fpga_rev;	/* As the FPGA reports it at 0x0 and 0x4 */
+	uint32_t fpga_hash;
+	uint8_t sha256[SHA256_LEN];	/* Payload, as it goes to flash */
+	uint8_t src_sha256[SHA256_LEN];	/* Bitstream it was built from */
+	uint8_t pad[IMAGE_HDR_LEN - 104 - SHA256_LEN];
+	uint8_t hdr_sha256[SHA256_LEN];	/* Of the bytes before it */
+};
+
+static void reverse_bits(unsigned char *buf, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		buf[i] = reverse[buf[i]];
+}
+
+/* Returns the bytes read, short only at end of file, or -1 */
+static ssize_t read_full(int fd, void *buf, size_t n)
+{
+	size_t done = 0;
+	ssize_t r;
+
+	while (done < n) {
+		r = read(fd, (char *)buf + done, n - done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return -1;
+		if (r == 0)
+			break;
+		done += r;
+	}
+	return done;
+}
+
+static int write_full(int fd, const void *buf, size_t n)
+{
+	ssize_t r;
+
+	while (n) {
+		r = write(fd, buf, n);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return -1;
+		buf = (const char *)buf + r;
+		n -= r;
+	}
+	return 0;
+}
+
+static void hdr_sum(const struct flash_image *h, uint8_t sum[SHA256_LEN])
+{
+	struct sha256 c;
+
+	sha256_init(&c);
+	sha256_update(&c, h, offsetof(struct flash_image, hdr_sha256));
+	sha256_final(&c, sum);
+}
+
+/* Build identity of a bitstream, what the FPGA running it reports */
+struct fpga_id {
+	int valid;
+	uint32_t rev;		/* Bit 31: built from a dirty tree */
+	uint32_t hash;
+};
+
+/* Parses "fpga_rev=N" and "fpga_hash=\"x[-dirty]\"" lines, as printed by
+ * tshwctl --info, from <bitstream>.info.  Returns 0 if both are there. */
+static int read_sidecar(const char *bitstream, struct fpga_id *id)
+{
+	char path[4096], line[256], *p;
+	int have = 0, dirty = 0;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s.info", bitstream);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, "fpga_rev=", 9) == 0) {
+			id->rev = strtoul(line + 9, NULL, 0) & 0x7fffffff;
+			have |= 1;
+		} else if (strncmp(line, "fpga_hash=", 10) == 0) {
+			p = line + 10 + (line[10] == '"');
+			id->hash = strtoul(p, &p, 16);
+			dirty = strncmp(p, "-dirty", 6) == 0;
+			have |= 2;
+		}
+	}
+	fclose(f);
+	if (have != 3)
+		return -1;
+	if (dirty)
+		id->rev |= 1 << 31;
+	id->valid = 1;
+	return 0;
+}
+
+/* The last successful flash, key=value lines */
+struct flash_record {
+	char device[256];
+	char src_sha256[SHA256_LEN * 2 + 1];
+};
+
+static int read_record(const char *path, struct flash_record *r)
+{
+	char line[512];
+	FILE *f;
+
+	memset(r, 0, sizeof(*r));
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\n")] = 0;
+		if (strncmp(line, "device=", 7) == 0)
+			snprintf(r->device, sizeof(r->device), "%.*s",
+				 (int)sizeof(r->device) - 1, line + 7);
+		else if (strncmp(line, "src_sha256=", 11) == 0)
+			snprintf(r->src_sha256, sizeof(r->src_sha256), "%.*s",
+				 (int)sizeof(r->src_sha256) - 1, line + 11);
+	}
+	fclose(f);
+	return 0;
+}
+
+/* Replaces the record whole, a crash leaves the old one or none */
+static void write_record(const char *path, const char *device,
+			 const uint8_t src[SHA256_LEN],
+			 const uint8_t payload[SHA256_LEN],
+			 const struct fpga_id *id)
+{
+	char tmp[4096], hex[SHA256_LEN * 2 + 1];
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	f = fopen(tmp, "w");
+	if (!f) {
+		fprintf(stderr, "Cannot record the flash in '%s', '%s'\n",
+			tmp, strerror(errno));
+		return;
+	}
+	fprintf(f, "device=%s\n", device);
+	sha256_hex(src, hex);
+	fprintf(f, "src_sha256=%s\n", hex);
+	sha256_hex(payload, hex);
+	fprintf(f, "sha256=%s\n", hex);
+	if (id->valid) {
+		fprintf(f, "fpga_rev=%d\n", id->rev & 0x7fffffff);
+		fprintf(f, "fpga_hash=\"%x%s\"\n", id->hash,
+			(id->rev & (1 << 31)) ? "-dirty" : "");
+	}
+	if (fflush(f) != 0 || fsync(fileno(f)) < 0 || fclose(f) != 0 ||
+	    rename(tmp, path) < 0)
+		fprintf(stderr, "Cannot record the flash in '%s', '%s'\n",
+			path, strerror(errno));
+}
+
+/* Whether the running FPGA is id and the last flash of device was the
+ * bitstream hashing to src */
+static int flash_is_current(const struct fpga_id *id, const char *record,
+			    const char *device, const uint8_t src[SHA256_LEN])
+{
+	struct flash_record r;
+	char hex[SHA256_LEN * 2 + 1];
+	uint32_t rev, hash;
+
+	if (!id->valid || read_record(record, &r) < 0)
+		return 0;
+	sha256_hex(src, hex);
+	if (strcmp(r.device, device) != 0 || strcmp(r.src_sha256, hex) != 0)
+		return 0;
+
+	fpga_init();
+	rev = fpga_peek32(0x0);
+	hash = fpga_peek32(0x4);
+	return rev == id->rev && hash == id->hash;
+}
+
+/* --build: bitstream to flash image, on the build server */
+static int build_image(const char *in, const char *out, uint32_t erase_size,
+		       const struct fpga_id *id)
+{
+	struct flash_image h;
+	unsigned char *buf;
+	struct sha256 c;
+	char hex[SHA256_LEN * 2 + 1];
+	uint32_t length, padded;
+	struct stat s;
+	int fd;
+
+	if ((fd = open(in, O_RDONLY)) < 0 || fstat(fd, &s) < 0) {
+		fprintf(stderr, "Cannot open '%s', '%s'\n", in, strerror(errno));
+		return 1;
+	}
+	length = s.st_size;
+	padded = (length + erase_size - 1) / erase_size * erase_size;
+	buf = malloc(padded ? padded : 1);
+	if (!buf || read_full(fd, buf, length) != length) {
+		fprintf(stderr, "Cannot read '%s'\n", in);
+		return 1;
+	}
+	close(fd);
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, IMAGE_MAGIC, sizeof(h.magic));
+	h.version = htole32(IMAGE_VERSION);
+	h.hdr_len = htole32(sizeof(h));
+	h.length = htole32(length);
+	h.padded_len = htole32(padded);
+	h.erase_size = htole32(erase_size);
+	if (id->valid) {
+		h.flags = htole32(IMAGE_HAS_ID);
+		h.fpga_rev = htole32(id->rev);
+		h.fpga_hash = htole32(id->hash);
+	}
+	sha256_init(&c);
+	sha256_update(&c, buf, length);
+	sha256_final(&c, h.src_sha256);
+	reverse_bits(buf, length);
+	memset(buf + length, 0xff, padded - length);
+	sha256_init(&c);
+	sha256_update(&c, buf, padded);
+	sha256_final(&c, h.sha256);
+	hdr_sum(&h, h.hdr_sha256);
+
+	fd = open(out, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd < 0 || write_full(fd, &h, sizeof(h)) < 0 ||
+	    write_full(fd, buf, padded) < 0 || close(fd) < 0) {
+		fprintf(stderr, "Cannot write '%s', '%s'\n", out,
+			strerror(errno));
+		return 1;
+	}
+	free(buf);
+
+	printf("length=%u\n", length);
+	printf("padded_length=%u\n", padded);
+	printf("erase_size=%u\n", erase_size);
+	sha256_hex(h.sha256, hex);
+	printf("sha256=%s\n", hex);
+	sha256_hex(h.src_sha256, hex);
+	printf("src_sha256=%s\n", hex);
+	if (id->valid) {
+		printf("fpga_rev=%d\n", id->rev & 0x7fffffff);
+		printf("fpga_hash=\"%x%s\"\n", id->hash,
+		       (id->rev & (1 << 31)) ? "-dirty" : "");
+	}
+	return 0;
+}
+
+/* Reads a --build header from fd.  Returns 1 with h filled in, 0 for a
+ * raw bitstream (fd back at the start), -1 for a damaged image. */
+static int read_image_hdr(int fd, const char *path, struct flash_image *h)
+{
+	uint8_t sum[SHA256_LEN];
+
+	if (read_full(fd, h, sizeof(*h)) != sizeof(*h) ||
+	    memcmp(h->magic, IMAGE_MAGIC, sizeof(h->magic)) != 0) {
+		lseek(fd, 0, SEEK_SET);
+		return 0;
+	}
+	hdr_sum(h, sum);
+	if (memcmp(sum, h->hdr_sha256, sizeof(sum)) != 0 ||
+	    le32toh(h->version) != IMAGE_VERSION ||
+	    le32toh(h->hdr_len) != sizeof(*h) ||
+	    le32toh(h->length) > le32toh(h->padded_len) ||
+	    le32toh(h->erase_size) == 0 ||
+	    le32toh(h->erase_size) > MAX_ERASE_SIZE ||
+	    le32toh(h->padded_len) % le32toh(h->erase_size)) {
+		fprintf(stderr, "'%s' has a damaged or unknown image header\n",
+			path);
+		return -1;
+	}
+	h->length = le32toh(h->length);
+	h->padded_len = le32toh(h->padded_len);
+	h->erase_size = le32toh(h->erase_size);
+	h->flags = le32toh(h->flags);
+	h->fpga_rev = le32toh(h->fpga_rev);
+	h->fpga_hash = le32toh(h->fpga_hash);
+	return 1;
+}
+
+/* Hashes the payload of an image before anything is written */
+static int check_payload(int fd, const char *path, const struct flash_image *h,
+			 unsigned char *buf, size_t bufsz)
+{
+	uint8_t sum[SHA256_LEN];
+	struct sha256 c;
+	uint32_t left = h->padded_len;
+	ssize_t n;
+
+	sha256_init(&c);
+	while (left) {
+		n = read_full(fd, buf, MIN(left, bufsz));
+		if (n <= 0)
+			break;
+		sha256_update(&c, buf, n);
+		left -= n;
+	}
+	sha256_final(&c, sum);
+	if (left || memcmp(sum, h->sha256, sizeof(sum)) != 0) {
+		fprintf(stderr, "'%s' is truncated or corrupt, flash untouched\n",
+			path);
+		return -1;
+	}
+	lseek(fd, sizeof(*h), SEEK_SET);
+	return 0;
+}
+
+/* Reads back what was written and compares its hash */
+static int verify_flash(const char *dev, uint32_t length,
+			const uint8_t want[SHA256_LEN], unsigned char *buf,
+			size_t bufsz)
+{
+	uint8_t sum[SHA256_LEN];
+	struct sha256 c;
+	uint32_t left = length;
+	ssize_t n;
+	int fd;
+
+	fd = open(dev, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	/* Read the flash, not the pages just written */
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	sha256_init(&c);
+	while (left) {
+		n = read_full(fd, buf, MIN(left, bufsz));
+		if (n <= 0)
+			break;
+		sha256_update(&c, buf, n);
+		left -= n;
+	}
+	close(fd);
+	sha256_final(&c, sum);
+	return left || memcmp(sum, want, sizeof(sum)) != 0 ? -1 : 0;
+}
+
+static void usage(char **argv) {
+	fprintf(stderr,
+		"Usage: %s [OPTIONS] <file>\n"
+		"embeddedTS FPGA flash loader\n"
+		"\n"
+		"  -d, --device <dev>     Flash to write (default %s)\n"
+		"  -b, --build <out>      Write a flash image of the bitstream <file>\n"
+		"                         to <out> instead, e.g. on a build server\n"
+		"  -e, --erase-size <n>   With --build, pad to <n> byte blocks\n"
+		"                         (default %d)\n"
+		"  -f, --force            Write even if the flash is up to date\n"
+		"  -r, --record <file>    Record of the last flash (default\n"
+		"                         %s)\n"
+		"  -h, --help             This message\n"
+		"\n"
+		"<file> is a raw bitstream, bit reversed here on the way to flash, or\n"
+		"an image from --build, which is checked whole and then copied as is.\n"
+		"The flash is read back and compared after writing.\n"
+		"\n"
+		"The bitstream's fpga_rev and fpga_hash, as tshwctl --info prints\n"
+		"them, come from <bitstream>.info, which --build also stores in the\n"
+		"image.  When the running FPGA reports them and the record shows this\n"
+		"bitstream as the last flashed to <dev>, nothing is written and the\n"
+		"exit status is %d.\n",
+		argv[0], DEFAULT_DEVICE, DEFAULT_ERASE_SIZE, DEFAULT_RECORD,
+		EXIT_CURRENT
+	);
+}
 
 int main(int argc, char **argv)
 {
-	int input_handle, output_handle, cnt, file_length, n;
-	unsigned char input_byte;
+	int input_handle, output_handle, c, image, opt_force = 0;
+	const char *opt_device = DEFAULT_DEVICE, *opt_build = NULL;
+	const char *opt_record = DEFAULT_RECORD;
+	uint32_t opt_erase = DEFAULT_ERASE_SIZE, cnt, file_length;
+	unsigned char *buf;
+	size_t bufsz;
+	ssize_t n;
+	uint8_t sum[SHA256_LEN], src[SHA256_LEN];
+	struct fpga_id id = { 0 };
+	struct flash_image h;
+	struct sha256 hash;
 	struct stat s;
 
-	if (argc < 2) {
-		fprintf(stderr, "Usage: %s filename\n",
-			argv[0]);
+	static struct option long_options[] = {
+		{ "device", required_argument, 0, 'd' },
+		{ "build", required_argument, 0, 'b' },
+		{ "erase-size", required_argument, 0, 'e' },
+		{ "force", 0, 0, 'f' },
+		{ "record", required_argument, 0, 'r' },
+		{ "help", 0, 0, 'h' },
+		{ 0, 0, 0, 0 }
+	};
+
+	while((c = getopt_long(argc, argv, "d:b:e:fr:h", long_options, NULL)) != -1) {
+		switch(c) {
+		case 'd':
+			opt_device = optarg;
+			break;
+		case 'b':
+			opt_build = optarg;
+			break;
+		case 'e':
+			opt_erase = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			opt_force = 1;
+			break;
+		case 'r':
+			opt_record = optarg;
+			break;
+		case 'h':
+		default:
+			usage(argv);
+			return 1;
+		}
+	}
+	if (optind != argc - 1 || opt_erase == 0 ||
+	    opt_erase > MAX_ERASE_SIZE) {
+		usage(argv);
 		return 1;
 	}
 
-	if (stat(argv[1], &s) < 0) {
-		fprintf(stderr, "Cannot stat '%s', '%s'\n", argv[1],
+	read_sidecar(argv[optind], &id);
+	if (opt_build)
+		return build_image(argv[optind], opt_build, opt_erase, &id);
+
+	if (stat(argv[optind], &s) < 0) {
+		fprintf(stderr, "Cannot stat '%s', '%s'\n", argv[optind],
 			strerror(errno));
 		return 1;
 	}
 
-	if ((input_handle = open(argv[1], O_RDONLY)) < 0) {
-		fprintf(stderr, "Cannot open file '%s' for reading\n", argv[1]);
+	if ((input_handle = open(argv[optind], O_RDONLY)) < 0) {
+		fprintf(stderr, "Cannot open file '%s' for reading\n",
+			argv[optind]);
 		return 1;
 	}
 
-	file_length = s.st_size;
+	image = read_image_hdr(input_handle, argv[optind], &h);
+	if (image < 0)
+		return 1;
+	/* Images go out a whole erase block per write */
+	file_length = image ? h.padded_len : s.st_size;
+	bufsz = image ? h.erase_size : RAW_CHUNK;
+	buf = malloc(bufsz);
+	if (!buf) {
+		perror("malloc");
+		return 1;
+	}
+
+	if (image) {
+		memcpy(src, h.src_sha256, sizeof(src));
+		if (h.flags & IMAGE_HAS_ID) {
+			id.valid = 1;
+			id.rev = h.fpga_rev;
+			id.hash = h.fpga_hash;
+		}
+	} else {
+		sha256_init(&hash);
+		while ((n = read_full(input_handle, buf, bufsz)) > 0)
+			sha256_update(&hash, buf, n);
+		sha256_final(&hash, src);
+		lseek(input_handle, 0, SEEK_SET);
+	}
+	if (!opt_force &&
+	    flash_is_current(&id, opt_record, opt_device, src)) {
+		printf("FPGA rev %d hash %x is running and flashed, "
+		       "nothing to do\n", id.rev & 0x7fffffff, id.hash);
+		return EXIT_CURRENT;
+	}
 
-	if (stat("/dev/mtdblock0", &s) < 0) {
-		fprintf(stderr, "Cannot stat '/dev/mtdblock0', '%s'\n",
+	if (image && check_payload(input_handle, argv[optind], &h, buf,
+				   bufsz) < 0)
+		return 1;
+
+	if (stat(opt_device, &s) < 0) {
+		fprintf(stderr, "Cannot stat '%s', '%s'\n", opt_device,
 			strerror(errno));
 		return 1;
 	}
 
-	if (!S_ISBLK(s.st_mode)) {
-		fprintf(stderr, "'/dev/mtdblock0' is not a block device\n");
+	if (!S_ISBLK(s.st_mode) && !S_ISREG(s.st_mode)) {
+		fprintf(stderr, "'%s' is not a block device\n", opt_device);
 		return 1;
 	}
 
-	if ((output_handle = open("/dev/mtdblock0", O_WRONLY)) < 0) {
-		fprintf(stderr, "Cannot open file '/dev/mtdblock0' for writing\n");
+	if ((output_handle = open(opt_device, O_WRONLY)) < 0) {
+		fprintf(stderr, "Cannot open file '%s' for writing\n",
+			opt_device);
 		return 1;
 	}
 
-	for(n=cnt=0; cnt < file_length; ) {
-		if (read(input_handle, &input_byte, 1) < 0)
+	sha256_init(&hash);
+	for (cnt = 0; cnt < file_length; cnt += n) {
+		n = read_full(input_handle, buf, MIN(file_length - cnt, bufsz));
+		if (n <= 0)
+			break;
+		if (!image)
+			reverse_bits(buf, n);
+		sha256_update(&hash, buf, n);
+		TS_PROBE2(flash_write_start, cnt, n);
+		c = write_full(output_handle, buf, n) < 0 ? errno : 0;
+		TS_PROBE3(flash_write_done, cnt, n, c);
+		if (c) {
+			fprintf(stderr, "Error writing to '%s', '%s'\n",
+				opt_device, strerror(c));
 			break;
-		sector_buffer[n] = reverse[input_byte];
-		cnt++;
-		n++;
-		if (n == 512 || cnt == file_length) {
-			if (write(output_handle, sector_buffer, MIN((n), sizeof(sector_buffer))) < 0) {
-				fprintf(stderr, "Error writing to '/dev/mtdblock0', '%s'\n",  strerror(errno));
-				break;
-			}
-			printf("\r          \r%d", cnt);
-			fflush(stdout);
-			n = 0;
 		}
+		printf("\r          \r%d", cnt + (int)n);
+		fflush(stdout);
 	}
+	sha256_final(&hash, sum);
 
-	sync();
+	fsync(output_handle);
 	close(output_handle);
 	close(input_handle);
 
-	if (cnt == file_length) {
-		printf("\rWrote %d bytes\n", cnt);
-		return 0;
-	}
-	else {
+	if (cnt != file_length) {
 		printf("\rShort write: Wrote %d bytes, should be %d bytes\n",
 			cnt, file_length);
 		return 1;
 	}
+	printf("\rWrote %d bytes\n", cnt);
+	if (verify_flash(opt_device, cnt, sum, buf, bufsz) < 0) {
+		fprintf(stderr, "Verify of '%s' failed\n", opt_device);
+		return 1;
+	}
+	printf("Verified %d bytes\n", cnt);
+	write_record(opt_record, opt_device, src, sum, &id);
+	free(buf);
+	return 0;
 }
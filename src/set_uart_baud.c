@@ -7,6 +7,7 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <linux/pci.h>
+#include <linux/serial.h>
 #include <linux/types.h>
 #include <stdint.h>
 #include <stdint.h>
@@ -16,12 +17,16 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/types.h>
+#include <termios.h>
 #include <unistd.h>
 
 #include "fpga.c"
 
+/* Helpers that not every tool #including this file calls */
+#define UART_MAYBE_UNUSED __attribute__((unused))
+
 /* Recursive euclidean algorithm */
-uint32_t gcd(uint32_t a, uint32_t b) {
+static uint32_t gcd(uint32_t a, uint32_t b) {
 	if (a == 0) return b;
 	else if (b == 0) return a;
 	else return gcd(b, a%b);
@@ -32,7 +37,7 @@ uint32_t gcd(uint32_t a, uint32_t b) {
 #define IDIV_BITS 7
 #define IDIV_MSK ((1<<IDIV_BITS)-1)
 #define BASE_CLK_FREQ 125000000
-uint32_t frac_clk_gen(uint32_t b) {
+static uint32_t frac_clk_gen(uint32_t b) {
 	uint32_t fracn, d;
 	uint32_t idiv = BASE_CLK_FREQ / b;
 
@@ -51,7 +56,7 @@ uint32_t frac_clk_gen(uint32_t b) {
 }
 
 /* If we had to scale down, actual frequency will be off */
-float actual_freq(uint32_t ctl) {
+static float actual_freq(uint32_t ctl) {
 	uint32_t idiv = ctl>>(FRAC_BITS*2);
 	float frac = (ctl>>FRAC_BITS)&FRAC_MSK;
 	frac /= ctl&FRAC_MSK;
@@ -59,21 +64,21 @@ float actual_freq(uint32_t ctl) {
 	return BASE_CLK_FREQ / frac;
 }
 /* This is the max frequency of one period. (fractional divide alternates between min/max) */
-float max_freq(uint32_t ctl) {
+static UART_MAYBE_UNUSED float max_freq(uint32_t ctl) {
 	return actual_freq((ctl>>(FRAC_BITS*2))<<(FRAC_BITS*2));
 }
 /* This is the min frequency of one period. (fractional divide alternates between min/max) */
-float min_freq(uint32_t ctl) {
+static UART_MAYBE_UNUSED float min_freq(uint32_t ctl) {
 	return actual_freq(((ctl>>(FRAC_BITS*2))+1)<<(FRAC_BITS*2));
 }
 /* Parts per million error */
-int32_t ppm(float ctl, float b) {
+static int32_t ppm(float ctl, float b) {
 	float err = (b - ctl)/b;
 	return err * 1000000;
 }
 
 /* Uart specific stuff... */
-float bitperiod_min(uint32_t ctl) {
+static float bitperiod_min(uint32_t ctl) {
 	uint32_t idiv = ctl>>(FRAC_BITS*2);
 	uint32_t fracn = (ctl>>FRAC_BITS)&FRAC_MSK;
 	uint32_t fracd = ctl&FRAC_MSK;
@@ -83,7 +88,7 @@ float bitperiod_min(uint32_t ctl) {
 	return (float)BASE_CLK_FREQ/clks;
 }
 
-float bitperiod_max(uint32_t ctl) {
+static float bitperiod_max(uint32_t ctl) {
 	uint32_t idiv = ctl>>(FRAC_BITS*2);
 	uint32_t fracn = (ctl>>FRAC_BITS)&FRAC_MSK;
 	uint32_t fracd = ctl&FRAC_MSK;
@@ -93,7 +98,7 @@ float bitperiod_max(uint32_t ctl) {
 	return (float)BASE_CLK_FREQ/clks;
 }
 
-float byteperiod_min(uint32_t ctl) {
+static float byteperiod_min(uint32_t ctl) {
 	uint32_t idiv = ctl>>(FRAC_BITS*2);
 	uint32_t fracn = (ctl>>FRAC_BITS)&FRAC_MSK;
 	uint32_t fracd = ctl&FRAC_MSK;
@@ -103,7 +108,7 @@ float byteperiod_min(uint32_t ctl) {
 	return ((float)BASE_CLK_FREQ/clks)*10;
 }
 
-float byteperiod_max(uint32_t ctl) {
+static float byteperiod_max(uint32_t ctl) {
 	uint32_t idiv = ctl>>(FRAC_BITS*2);
 	uint32_t fracn = (ctl>>FRAC_BITS)&FRAC_MSK;
 	uint32_t fracd = ctl&FRAC_MSK;
@@ -115,36 +120,277 @@ float byteperiod_max(uint32_t ctl) {
 
 /* Returns 32-bit value to write to FPGA reg if 16550 UART
  * is set for 115200 divisor (dl = 1) */
-uint32_t set_baudrate(uint8_t channel, uint32_t baudrate) {
+static uint32_t set_baudrate(uint8_t channel, uint32_t baudrate) {
 	return frac_clk_gen(baudrate * 16)|(channel<<29);
 }
 
-void usage(char **argv) {
+/* The 16x clock must leave an integer divide of 1..IDIV_MSK */
+#define BAUD_MIN (BASE_CLK_FREQ / (16 << IDIV_BITS) + 1)
+#define BAUD_MAX (BASE_CLK_FREQ / 16)
+
+/* Everything the divider math can tell about one baud rate without a board.
+ * All UART cores share BASE_CLK_FREQ, so this holds for every port. */
+struct baud_report {
+	uint32_t baud;
+	uint32_t reg;		/* frac_clk_gen() value, without channel bits */
+	float actual_baud;
+	int32_t ppm;		/* Error of the average rate */
+	int32_t bit_ppm_min;	/* Error of the short and long bit period */
+	int32_t bit_ppm_max;
+	float jitter_ns;	/* Difference between long and short bit */
+	int32_t frame_ppm;	/* Worst case over a 10-bit frame */
+};
+
+static inline int32_t abs32(int32_t v) {
+	return v < 0 ? -v : v;
+}
+
+/* Returns 0 if baud is outside what the fractional divider can generate */
+static UART_MAYBE_UNUSED int baud_analyze(uint32_t baud,
+		struct baud_report *r) {
+	int32_t lo, hi;
+
+	if (baud < BAUD_MIN || baud > BAUD_MAX)
+		return 0;
+
+	r->baud = baud;
+	r->reg = frac_clk_gen(baud * 16);
+	r->actual_baud = actual_freq(r->reg) / 16;
+	r->ppm = ppm(actual_freq(r->reg), baud * 16);
+	r->bit_ppm_min = ppm(bitperiod_min(r->reg), baud);
+	r->bit_ppm_max = ppm(bitperiod_max(r->reg), baud);
+	r->jitter_ns = (1 / bitperiod_min(r->reg) - 1 / bitperiod_max(r->reg)) * 1e9;
+	lo = abs32(ppm(byteperiod_min(r->reg), baud));
+	hi = abs32(ppm(byteperiod_max(r->reg), baud));
+	r->frame_ppm = lo > hi ? lo : hi;
+
+	return 1;
+}
+
+#ifdef CTL
+/* Offline sweep over [min, max] in steps of step, no FPGA access.  Rates
+ * whose worst case frame error exceeds max_ppm are left out of the listing
+ * (max_ppm < 0 lists everything).  Returns the highest rate within max_ppm,
+ * or 0 if there is none. */
+static uint32_t baud_sweep(uint32_t min, uint32_t max, uint32_t step,
+			   int32_t max_ppm, int csv, FILE *out) {
+	struct baud_report r;
+	uint32_t b, best = 0;
+	uint64_t mbaud;
+	uint32_t jit;
+
+	if (min < BAUD_MIN)
+		min = BAUD_MIN;
+	if (max > BAUD_MAX)
+		max = BAUD_MAX;
+	if (step == 0)
+		step = 1;
+
+	if (csv)
+		fprintf(out, "baud,reg,actual_baud,ppm,min1bit_ppm,max1bit_ppm,"
+			"jitter_ns,10bit_ppm\n");
+	else
+		fprintf(out, "%10s %10s %14s %8s %11s %11s %9s %9s\n",
+			"baud", "reg", "actual_baud", "ppm", "min1bit_ppm",
+			"max1bit_ppm", "jitter_ns", "10bit_ppm");
+
+	for (b = min; b <= max && b >= min; b += step) {
+		baud_analyze(b, &r);
+		if (max_ppm >= 0 && r.frame_ppm > max_ppm)
+			continue;
+		best = b;
+		/* Fixed point keeps float formatting out of a multi-million
+		 * line sweep */
+		mbaud = r.actual_baud * 1000 + 0.5f;
+		jit = r.jitter_ns * 10 + 0.5f;
+		if (csv)
+			fprintf(out, "%u,0x%08X,%u.%03u,%d,%d,%d,%u.%u,%d\n",
+				r.baud, r.reg, (uint32_t)(mbaud / 1000),
+				(uint32_t)(mbaud % 1000),
+				r.ppm, r.bit_ppm_min, r.bit_ppm_max,
+				jit / 10, jit % 10, r.frame_ppm);
+		else
+			fprintf(out, "%10u 0x%08X %10u.%03u %8d %11d %11d %7u.%u %9d\n",
+				r.baud, r.reg, (uint32_t)(mbaud / 1000),
+				(uint32_t)(mbaud % 1000),
+				r.ppm, r.bit_ppm_min, r.bit_ppm_max,
+				jit / 10, jit % 10, r.frame_ppm);
+	}
+
+	return best;
+}
+#endif
+
+/* Line settings applied by uart_setup_lowlatency() */
+struct uart_lowlat {
+	uint32_t baud;		/* Requested line rate */
+	float actual_baud;	/* What the clock generator really produces */
+	speed_t speed;		/* termios speed, B115200 unless baud < 115200 */
+	int vmin;
+	int vtime;
+	int low_latency;	/* Driver accepted ASYNC_LOW_LATENCY */
+};
+
+static const struct { uint32_t baud; speed_t speed; } termios_speeds[] = {
+	{ 1200, B1200 }, { 2400, B2400 }, { 4800, B4800 }, { 9600, B9600 },
+	{ 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 },
+	{ 115200, B115200 },
+};
+
+/* Rates >= 115200 come from the FPGA clock with the 16550 divisor at 1, so
+ * termios stays at B115200.  Slower rates keep the 115200 clock and divide
+ * in the 16550. */
+static speed_t termios_speed(uint32_t baud) {
+	int i;
+
+	for (i = 0; i < sizeof(termios_speeds)/sizeof(termios_speeds[0]); i++)
+		if (termios_speeds[i].baud == baud)
+			return termios_speeds[i].speed;
+	return baud > 115200 ? B115200 : B0;
+}
+
+/* Puts an open tty in raw 8N1 at the speed matching baud, with VMIN/VTIME
+ * as given and ASYNC_LOW_LATENCY if the driver supports it, then reads the
+ * settings back.  Does not touch the FPGA, so it works on a pty.
+ * Returns 0, or -1 with errno set. */
+static int uart_setup_lowlatency(int fd, uint32_t baud, int vmin, int vtime,
+				 struct uart_lowlat *ll) {
+	struct termios tio, chk;
+	struct serial_struct ser;
+
+	ll->baud = baud;
+	ll->actual_baud = baud > 115200 ? actual_freq(frac_clk_gen(baud*16))/16 : baud;
+	ll->speed = termios_speed(baud);
+	ll->vmin = vmin;
+	ll->vtime = vtime;
+	ll->low_latency = 0;
+	if (ll->speed == B0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (tcgetattr(fd, &tio) < 0)
+		return -1;
+	cfmakeraw(&tio);
+	tio.c_cflag &= ~(CSTOPB|PARENB|CRTSCTS);
+	tio.c_cflag |= CLOCAL|CREAD|CS8;
+	tio.c_cc[VMIN] = vmin;
+	tio.c_cc[VTIME] = vtime;
+	cfsetispeed(&tio, ll->speed);
+	cfsetospeed(&tio, ll->speed);
+	if (tcsetattr(fd, TCSANOW, &tio) < 0)
+		return -1;
+	tcflush(fd, TCIOFLUSH);
+
+	/* Not every driver (pty, usb serial) implements this */
+	if (ioctl(fd, TIOCGSERIAL, &ser) == 0) {
+		ser.flags |= ASYNC_LOW_LATENCY;
+		if (ioctl(fd, TIOCSSERIAL, &ser) == 0 &&
+		    ioctl(fd, TIOCGSERIAL, &ser) == 0)
+			ll->low_latency = !!(ser.flags & ASYNC_LOW_LATENCY);
+	}
+
+	if (tcgetattr(fd, &chk) < 0)
+		return -1;
+	if ((chk.c_lflag & ICANON) || chk.c_cc[VMIN] != vmin ||
+	    chk.c_cc[VTIME] != vtime || cfgetospeed(&chk) != ll->speed ||
+	    (chk.c_cflag & CSIZE) != CS8) {
+		errno = EIO;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* One call setup for an FPGA UART: programs the port's clock for baud,
+ * opens tty and applies uart_setup_lowlatency().  Returns the open fd, or
+ * -1 with errno set. */
+static UART_MAYBE_UNUSED int uart_open_lowlatency(const char *tty,
+		uint8_t port, uint32_t baud, int vmin, int vtime,
+		struct uart_lowlat *ll) {
+	int fd, err;
+
+	if (termios_speed(baud) == B0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	fpga_init();
+	fpga_poke32(0x7c, set_baudrate(port, baud > 115200 ? baud : 115200));
+
+	fd = open(tty, O_RDWR|O_NOCTTY);
+	if (fd < 0)
+		return -1;
+	if (uart_setup_lowlatency(fd, baud, vmin, vtime, ll) < 0) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	return fd;
+}
+
+#ifdef CTL
+static void uart_print_lowlatency(const struct uart_lowlat *ll) {
+	float bit_ns = 1e9 / ll->actual_baud;
+
+	printf("termios_baud=%d\n", ll->baud > 115200 ? 115200 : ll->baud);
+	printf("raw=1\n");
+	printf("vmin=%d\n", ll->vmin);
+	printf("vtime_ms=%d\n", ll->vtime * 100);
+	printf("low_latency=%d\n", ll->low_latency);
+	printf("bit_ns=%f\n", bit_ns);
+	printf("frame_us=%f\n", bit_ns * 10 / 1000);
+}
+
+static void usage(char **argv) {
 	fprintf(stderr,
 		"Usage: %s [OPTIONS] ...\n"
 		"embeddedTS UART baud rate control\n"
 		"\n"
 		"  -p, --port <num>       Set port to modify\n"
 		"  -b, --baud <rate>      Specify target baud rate\n"
+		"  -v, --verbose          Print per-bit and per-frame error\n"
+		"  -s, --sweep <min>:<max>[:<step>]\n"
+		"                         Offline report of achievable rates, does not\n"
+		"                         touch the FPGA\n"
+		"  -e, --max-ppm <ppm>    With --sweep, only list rates whose worst case\n"
+		"                         10-bit frame error is within <ppm>\n"
+		"  -c, --csv              With --sweep, print CSV instead of a table\n"
+		"  -t, --tty <dev>        Also open <dev> raw at the matching termios\n"
+		"                         speed with low latency settings\n"
+		"  -M, --vmin <n>         With --tty, VMIN (default 1)\n"
+		"  -I, --vtime <n>        With --tty, VTIME in 100ms units (default 0)\n"
 		"  -h, --help             This message\n"
 		"\n",
 		argv[0]
 	);
 }
 
-#ifdef CTL
 int main(int argc, char **argv)
 {
 	int c;
 	int opt_port = -1;
 	int opt_baud = 0;
 	int opt_verbose = 0;
+	int opt_sweep = 0, opt_csv = 0;
+	uint32_t sweep_min = BAUD_MIN, sweep_max = BAUD_MAX, sweep_step = 1;
+	int32_t opt_max_ppm = -1;
+	char *opt_tty = NULL;
+	int opt_vmin = 1, opt_vtime = 0;
 	uint32_t reg;
 
 	static struct option long_options[] = {
 		{ "port", required_argument, 0, 'p' },
 		{ "baud", required_argument, 0, 'b' },
 		{ "verbose", 0, 0, 'v' },
+		{ "sweep", required_argument, 0, 's' },
+		{ "max-ppm", required_argument, 0, 'e' },
+		{ "csv", 0, 0, 'c' },
+		{ "tty", required_argument, 0, 't' },
+		{ "vmin", required_argument, 0, 'M' },
+		{ "vtime", required_argument, 0, 'I' },
 		{ "help", 0, 0, 'h' },
 		{ 0, 0, 0, 0 }
 	};
@@ -154,9 +400,7 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	fpga_init();
-
-	while((c = getopt_long(argc, argv, "p:b:vh", long_options, NULL)) != -1) {
+	while((c = getopt_long(argc, argv, "p:b:vs:e:ct:M:I:h", long_options, NULL)) != -1) {
 		switch(c) {
 		case 'p':
 			opt_port = atoi(optarg);
@@ -166,14 +410,33 @@ int main(int argc, char **argv)
 			break;
 		case 'b':
 			opt_baud = atoi(optarg);
-			if(opt_baud < 115200) {
-				fprintf(stderr, "For baud rates < 115200, use 115200 as the baudrate and set the baud rate with termios\n");
-				return 1;
-			}
 			break;
 		case 'v':
 			opt_verbose = 1;
 			break;
+		case 's':
+			opt_sweep = 1;
+			if (sscanf(optarg, "%u:%u:%u", &sweep_min, &sweep_max,
+			    &sweep_step) < 2) {
+				fprintf(stderr, "Sweep range must be <min>:<max>[:<step>]\n");
+				return 1;
+			}
+			break;
+		case 'e':
+			opt_max_ppm = atoi(optarg);
+			break;
+		case 'c':
+			opt_csv = 1;
+			break;
+		case 't':
+			opt_tty = optarg;
+			break;
+		case 'M':
+			opt_vmin = atoi(optarg);
+			break;
+		case 'I':
+			opt_vtime = atoi(optarg);
+			break;
 		case ':':
 			fprintf(stderr, "%s: option `-%c' requires an argument\n",
 				argv[0], optopt);
@@ -187,18 +450,59 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if(opt_sweep) {
+		uint32_t best;
+
+		best = baud_sweep(sweep_min, sweep_max, sweep_step, opt_max_ppm,
+				  opt_csv, stdout);
+		if(opt_max_ppm >= 0) {
+			fprintf(opt_csv ? stderr : stdout,
+				"highest_baud_within_ppm=%u\n", best);
+			return best ? 0 : 1;
+		}
+		return 0;
+	}
+
 	if(opt_port != -1 && opt_baud == 0) {
 		printf("Must specify a baud rate for the port\n");
 		usage(argv);
 		return 1;
 	}
 
+	if(opt_tty) {
+		struct uart_lowlat ll;
+		int fd;
+
+		if(opt_port == -1) {
+			printf("Must specify a port for the tty\n");
+			return 1;
+		}
+		fd = uart_open_lowlatency(opt_tty, opt_port, opt_baud,
+					  opt_vmin, opt_vtime, &ll);
+		if(fd < 0) {
+			fprintf(stderr, "%s: %s\n", opt_tty, strerror(errno));
+			return 1;
+		}
+		printf("port=%d\n", opt_port);
+		printf("tty=%s\n", opt_tty);
+		printf("requested_baud=%d\n", opt_baud);
+		printf("actual_baud=%f\n", ll.actual_baud);
+		uart_print_lowlatency(&ll);
+		close(fd);
+		return 0;
+	}
+
+	if(opt_baud < 115200) {
+		fprintf(stderr, "For baud rates < 115200, use 115200 as the baudrate and set the baud rate with termios, or use --tty\n");
+		return 1;
+	}
+
 	printf("port=%d\n", opt_port);
 	printf("requested_baud=%d\n", opt_baud);
 
 	reg = frac_clk_gen(opt_baud * 16);
 	printf("actual_baud=%f\n", actual_freq(reg)/16);
-	printf("baud_ppm_error=%d\n", ppm(reg, opt_baud*16));
+	printf("baud_ppm_error=%d\n", ppm(actual_freq(reg), opt_baud*16));
 	if(opt_verbose) {
 		printf("xtal_freq_required_mhz=%f\n", opt_baud*16/1e6);
 		printf("xtal_freq_actual_mhz=%f\n", actual_freq(reg)/1e6);
@@ -212,6 +516,7 @@ int main(int argc, char **argv)
 		printf("max10bit_freq_ppm=%d\n", ppm(byteperiod_max(reg), opt_baud));
 	}
 
+	fpga_init();
 	fpga_poke32(0x7c, set_baudrate(opt_port, opt_baud));
 
 	return 0;
@@ -0,0 +1,1553 @@
+/* Long running silabs modes that need Linux (timerfd, files).  Included
+ * from silabs.c, after the register level API. */
+
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/mount.h>
+#include <sys/reboot.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <time.h>
+
+static volatile sig_atomic_t silab_stop = 0;
+static void silab_stop_handler(int sig) { silab_stop = 1; }
+
+static void silab_catch_signals(void) {
+  struct sigaction sa;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = silab_stop_handler;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+}
+
+/* Periodic CLOCK_MONOTONIC timer, first expiry one period from now */
+static int silab_timer(uint64_t period_ns) {
+  struct itimerspec its;
+  int fd;
+
+  fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  its.it_interval.tv_sec = period_ns / 1000000000ULL;
+  its.it_interval.tv_nsec = period_ns % 1000000000ULL;
+  its.it_value = its.it_interval;
+  if (timerfd_settime(fd, 0, &its, NULL) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Blocks until the next expiry, returns expirations since the last call
+ * (more than 1 means ticks were missed) or 0 if interrupted */
+static uint64_t silab_timer_wait(int fd) {
+  uint64_t n;
+
+  if (read(fd, &n, sizeof(n)) != sizeof(n))
+    return 0;
+  return n;
+}
+
+/* SCHED_FIFO at prio, and no page faults from here on */
+static void silab_realtime(int prio) {
+  struct sched_param sp;
+
+  memset(&sp, 0, sizeof(sp));
+  sp.sched_priority = prio;
+  if (sched_setscheduler(0, SCHED_FIFO, &sp) < 0)
+    perror("sched_setscheduler");
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+    perror("mlockall");
+}
+
+static double silab_walltime(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Parses "<key> <value>" pairs after argv[first].  Returns the value for
+ * key, or def if absent. */
+static const char *silab_opt(int argc, char *const argv[], int first,
+                             const char *key, const char *def) {
+  int i;
+
+  for (i = first; i + 1 < argc; i += 2)
+    if (strcmp(argv[i], key) == 0)
+      return argv[i + 1];
+  return def;
+}
+
+/* The uC's analog block: 10 channels then temperature, big endian words */
+#define SILAB_AN_CHANNELS 11
+#define SILAB_AN_TEMP 10
+
+static int silab_read_analog(struct silab *s, uint16_t *an) {
+  uint8_t buf[SILAB_AN_CHANNELS * 2];
+  int i;
+
+  if (silab_read(s, 0, buf, sizeof(buf)))
+    return -1;
+  for (i = 0; i < SILAB_AN_CHANNELS; i++)
+    an[i] = ((uint16_t)buf[i << 1] << 8) | buf[(i << 1) | 1];
+  return 0;
+}
+
+/* Per channel min/max/sum over one decimation interval */
+struct silab_an_stats {
+  uint16_t min[SILAB_AN_CHANNELS];
+  uint16_t max[SILAB_AN_CHANNELS];
+  uint32_t sum[SILAB_AN_CHANNELS];
+  uint32_t n;
+};
+
+static void silab_an_add(struct silab_an_stats *st, const uint16_t *an) {
+  int i;
+
+  for (i = 0; i < SILAB_AN_CHANNELS; i++) {
+    if (st->n == 0 || an[i] < st->min[i])
+      st->min[i] = an[i];
+    if (st->n == 0 || an[i] > st->max[i])
+      st->max[i] = an[i];
+    st->sum[i] += an[i];
+  }
+  st->n++;
+}
+
+static const char *silab_an_name(const struct silab_board *b, int i) {
+  return i == SILAB_AN_TEMP ? "Temperature" : b->an[i];
+}
+
+static void silab_monitor_json(FILE *f, const struct silab_board *b,
+                               const struct silab_an_stats *st, double ts) {
+  int i;
+
+  fprintf(f, "{\"ts\":%.3f,\"n\":%u", ts, st->n);
+  for (i = 0; i < SILAB_AN_CHANNELS; i++) {
+    if (!*silab_an_name(b, i))
+      continue;
+    if (st->n == 1)
+      fprintf(f, ",\"%s\":%u", silab_an_name(b, i), st->min[i]);
+    else
+      fprintf(f, ",\"%s\":{\"min\":%u,\"max\":%u,\"mean\":%.1f}",
+              silab_an_name(b, i), st->min[i], st->max[i],
+              (double)st->sum[i] / st->n);
+  }
+  fprintf(f, "}\n");
+  fflush(f);
+}
+
+/* node_exporter's textfile collector may read at any time, so the file is
+ * written aside and renamed over the old one */
+static int silab_monitor_prom(const char *path, const struct silab_board *b,
+                              const struct silab_an_stats *st) {
+  char tmp[4096];
+  FILE *f;
+  int i;
+
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+  f = fopen(tmp, "w");
+  if (!f)
+    return -1;
+
+  fprintf(f, "# HELP silabs_analog Analog channel in thousandths of its unit "
+             "(mV, mA), mean over the interval\n"
+             "# TYPE silabs_analog gauge\n");
+  for (i = 0; i < SILAB_AN_TEMP; i++)
+    if (*b->an[i])
+      fprintf(f, "silabs_analog{channel=\"%s\"} %.1f\n", b->an[i],
+              (double)st->sum[i] / st->n);
+  fprintf(f, "# HELP silabs_analog_min Minimum over the interval\n"
+             "# TYPE silabs_analog_min gauge\n");
+  for (i = 0; i < SILAB_AN_TEMP; i++)
+    if (*b->an[i])
+      fprintf(f, "silabs_analog_min{channel=\"%s\"} %u\n", b->an[i],
+              st->min[i]);
+  fprintf(f, "# HELP silabs_analog_max Maximum over the interval\n"
+             "# TYPE silabs_analog_max gauge\n");
+  for (i = 0; i < SILAB_AN_TEMP; i++)
+    if (*b->an[i])
+      fprintf(f, "silabs_analog_max{channel=\"%s\"} %u\n", b->an[i],
+              st->max[i]);
+  fprintf(f,
+          "# HELP silabs_temperature_celsius uC temperature\n"
+          "# TYPE silabs_temperature_celsius gauge\n"
+          "silabs_temperature_celsius %.1f\n"
+          "# HELP silabs_samples Samples in the interval\n"
+          "# TYPE silabs_samples gauge\n"
+          "silabs_samples %u\n",
+          (double)st->sum[SILAB_AN_TEMP] / st->n, st->n);
+
+  if (fclose(f) != 0 || rename(tmp, path) != 0) {
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+/* monitor [rate <Hz>] [decimate <N>] [prom <file>] [count <N>]
+ * Each sample is one 22 byte read of the analog block; the bus is opened
+ * once.  Every <N> samples one record with min/max/mean goes out as a JSON
+ * line on stdout, or replaces the Prometheus textfile. */
+static int silab_monitor(struct silab *s, int argc, char *const argv[]) {
+  const struct silab_board *b;
+  struct silab_an_stats st;
+  uint16_t an[SILAB_AN_CHANNELS];
+  double rate = atof(silab_opt(argc, argv, 2, "rate", "1"));
+  int decimate = atoi(silab_opt(argc, argv, 2, "decimate", "1"));
+  long count = atol(silab_opt(argc, argv, 2, "count", "0"));
+  const char *prom = silab_opt(argc, argv, 2, "prom", NULL);
+  int tfd;
+
+  if (rate <= 0 || decimate < 1) {
+    fprintf(stderr, "rate must be > 0 and decimate >= 1\n");
+    return 1;
+  }
+
+  silab_board_is(s, ""); /* Reads the board id once */
+  b = silab_board_find(s->board_id);
+  if (!b) {
+    fprintf(stderr, "Unknown board\n");
+    return 1;
+  }
+
+  tfd = silab_timer(1e9 / rate);
+  if (tfd < 0) {
+    perror("timerfd");
+    return 1;
+  }
+  silab_catch_signals();
+
+  memset(&st, 0, sizeof(st));
+  while (!silab_stop) {
+    if (silab_read_analog(s, an) == 0)
+      silab_an_add(&st, an);
+    else
+      fprintf(stderr, "I2C read failed\n");
+
+    if (st.n >= decimate) {
+      if (prom) {
+        if (silab_monitor_prom(prom, b, &st))
+          perror(prom);
+      } else
+        silab_monitor_json(stdout, b, &st, silab_walltime());
+      memset(&st, 0, sizeof(st));
+      if (count && --count == 0)
+        break;
+    }
+    silab_timer_wait(tfd);
+  }
+
+  close(tfd);
+  return 0;
+}
+
+/* Log2 histogram of microsecond values, bucket k holds [2^(k-1), 2^k) */
+#define SILAB_HIST_BUCKETS 24
+
+struct silab_hist {
+  uint32_t bucket[SILAB_HIST_BUCKETS];
+  uint64_t sum;
+  uint32_t n, min, max;
+};
+
+static void silab_hist_add(struct silab_hist *h, uint32_t us) {
+  int k = 0;
+
+  while (k < SILAB_HIST_BUCKETS - 1 && (us >> k))
+    k++;
+  h->bucket[k]++;
+  if (h->n == 0 || us < h->min)
+    h->min = us;
+  if (us > h->max)
+    h->max = us;
+  h->sum += us;
+  h->n++;
+}
+
+static void silab_hist_print(FILE *f, const char *name,
+                             const struct silab_hist *h) {
+  int k;
+
+  fprintf(f, "%s_n=%u\n", name, h->n);
+  if (!h->n)
+    return;
+  fprintf(f, "%s_min_us=%u\n%s_max_us=%u\n%s_mean_us=%u\n", name, h->min,
+          name, h->max, name, (uint32_t)(h->sum / h->n));
+  for (k = 0; k < SILAB_HIST_BUCKETS; k++)
+    if (h->bucket[k])
+      fprintf(f, "%s_lt_%uus=%u\n", name, 1u << k, h->bucket[k]);
+}
+
+static volatile sig_atomic_t silab_dump = 0;
+static void silab_dump_handler(int sig) { silab_dump = 1; }
+
+/* Returns 1 if the health file was touched within max_age_ms */
+static int silab_health_ok(const char *path, uint32_t max_age_ms) {
+  struct stat st;
+  struct timespec now;
+  int64_t age_ms;
+
+  if (stat(path, &st) < 0)
+    return 0;
+  clock_gettime(CLOCK_REALTIME, &now);
+  age_ms = (int64_t)(now.tv_sec - st.st_mtim.tv_sec) * 1000 +
+           (now.tv_nsec - st.st_mtim.tv_nsec) / 1000000;
+  return age_ms <= (int64_t)max_age_ms;
+}
+
+struct silab_wdog_stats {
+  uint32_t feeds, failed, skipped, missed;
+  struct silab_hist latency; /* I2C feed write */
+  struct silab_hist jitter;  /* Wakeup past the scheduled tick */
+};
+
+static void silab_lock_stats_print(FILE *f, struct silab *s) {
+  struct silab_lock_stats st;
+
+  silab_lock_stats(s, &st);
+  fprintf(f, "lock_n=%u\nlock_contended=%u\nlock_wdog_ahead=%u\n", st.locks,
+          st.contended, st.wdog_ahead);
+  if (st.locks)
+    fprintf(f,
+            "lock_wait_mean_us=%u\nlock_wait_max_us=%u\n"
+            "lock_hold_mean_us=%u\nlock_hold_max_us=%u\n",
+            (uint32_t)(st.wait_ns / st.locks / 1000),
+            (uint32_t)(st.wait_max_ns / 1000),
+            (uint32_t)(st.hold_ns / st.locks / 1000),
+            (uint32_t)(st.hold_max_ns / 1000));
+}
+
+static void silab_wdog_stats_print(struct silab *s,
+                                   const struct silab_wdog_stats *st) {
+  printf("feeds=%u\nfeeds_failed=%u\nfeeds_skipped=%u\nticks_missed=%u\n",
+         st->feeds, st->failed, st->skipped, st->missed);
+  silab_hist_print(stdout, "feed_latency", &st->latency);
+  silab_hist_print(stdout, "wakeup_jitter", &st->jitter);
+  silab_lock_stats_print(stdout, s);
+  fflush(stdout);
+}
+
+/* wdog daemon <ms> [fraction <N>] [rt <prio>] [health <file>]
+ *                  [maxage <ms>] [nowayout 1]
+ * Arms the watchdog once, then feeds it every <ms>/<N> from a timerfd with
+ * a single 1 byte write.  With a health file, feeding stops while the
+ * file's mtime is older than maxage (default <ms>), so the uC resets the
+ * board when the application stops checking in.  SIGUSR1 prints the
+ * statistics; SIGINT/SIGTERM print them, disarm (unless nowayout) and
+ * exit. */
+static int silab_wdog_daemon(struct silab *s, int argc, char *const argv[]) {
+  const char *ms_s = argc > 3 ? argv[3] : NULL;
+  const char *fraction_s = silab_opt(argc, argv, 4, "fraction", "3");
+  const char *prio_s = silab_opt(argc, argv, 4, "rt", "0");
+  const char *health = silab_opt(argc, argv, 4, "health", NULL);
+  const char *maxage_s = silab_opt(argc, argv, 4, "maxage", NULL);
+  const char *nowayout_s = silab_opt(argc, argv, 4, "nowayout", "0");
+  uint32_t ms, maxage;
+  int fraction, prio, nowayout;
+  struct silab_wdog_stats st;
+  struct sigaction sa;
+  uint64_t period, start, ticks = 0;
+  int tfd, r, healthy = 1;
+
+  /* my_atoi() does no checking, "60s" would arm a 667 ms watchdog */
+  if ((ms_s && !my_isnum(ms_s)) || !my_isnum(fraction_s) ||
+      !my_isnum(prio_s) || (maxage_s && !my_isnum(maxage_s)) ||
+      !my_isnum(nowayout_s)) {
+    fprintf(stderr, "timeout, fraction, rt, maxage and nowayout take a "
+                    "number\n");
+    return 1;
+  }
+  ms = ms_s ? my_atoi(ms_s) : DEFAULT_WDOG_MS;
+  fraction = my_atoi(fraction_s);
+  prio = my_atoi(prio_s);
+  maxage = maxage_s ? my_atoi(maxage_s) : ms;
+  nowayout = my_atoi(nowayout_s);
+
+  if (ms < 20 || fraction < 2) {
+    fprintf(stderr, "timeout must be >= 20 ms and fraction >= 2\n");
+    return 1;
+  }
+  period = (uint64_t)ms * 1000000ULL / fraction;
+
+  if (prio)
+    silab_realtime(prio);
+
+  silab_wdog_set(s, ms);
+
+  start = silab_ns();
+  tfd = silab_timer(period);
+  if (tfd < 0) {
+    perror("timerfd");
+    silab_wdog_set(s, 0);
+    return 1;
+  }
+  silab_catch_signals();
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = silab_dump_handler;
+  sigaction(SIGUSR1, &sa, NULL);
+
+  memset(&st, 0, sizeof(st));
+  while (!silab_stop) {
+    uint64_t n = silab_timer_wait(tfd), now, t;
+
+    if (silab_dump) {
+      silab_dump = 0;
+      silab_wdog_stats_print(s, &st);
+    }
+    if (n == 0)
+      continue;
+
+    now = silab_ns();
+    ticks += n;
+    st.missed += n - 1;
+    t = now - start; /* The timer was armed after start, t >= ticks*period */
+    silab_hist_add(&st.jitter, (t - ticks * period) / 1000);
+
+    if (health && !silab_health_ok(health, maxage)) {
+      if (healthy)
+        fprintf(stderr, "%s stale, not feeding\n", health);
+      healthy = 0;
+      st.skipped++;
+      continue;
+    }
+    if (!healthy)
+      fprintf(stderr, "%s fresh, feeding\n", health);
+    healthy = 1;
+
+    silab_lock(s, SILAB_PRIO_WDOG);
+    r = silab_outb(s, 1028, 1);
+    silab_unlock(s);
+    if (r) {
+      st.failed++;
+      continue;
+    }
+    silab_hist_add(&st.latency, (silab_ns() - now) / 1000);
+    st.feeds++;
+  }
+
+  close(tfd);
+  if (!nowayout)
+    silab_wdog_set(s, 0);
+  silab_wdog_stats_print(s, &st);
+  return 0;
+}
+
+/* Power fail: regs 16..22 hold Supercap 2, the charger voltage and the
+ * control byte, so one 7 byte read per poll covers the detection that
+ * status does (caps above the charger, or ctl bit 0). */
+struct silab_pf {
+  uint64_t t_det; /* Detection time */
+  uint32_t reserve_mv;
+  int dryrun;
+};
+
+static int silab_pf_read(struct silab *s, uint16_t *mv, int *discharging) {
+  uint8_t buf[7];
+
+  if (silab_read(s, 16, buf, sizeof(buf)))
+    return -1;
+  *mv = (buf[0] << 8) | buf[1];
+  *discharging = (buf[6] & 1) || *mv > ((buf[2] << 8) | buf[3]) + 250;
+  return 0;
+}
+
+/* Logs one step with the time since detection and the cap voltage now.
+ * Returns the voltage, or 0 if it could not be read. */
+static uint16_t silab_pf_log(struct silab *s, const struct silab_pf *pf,
+                             const char *step, const char *what) {
+  uint16_t mv = 0;
+  int dis;
+
+  silab_pf_read(s, &mv, &dis);
+  printf("powerfail step=%s t_ms=%u mv=%u%s%s%s\n", step,
+         (uint32_t)((silab_ns() - pf->t_det) / 1000000), mv,
+         what ? " (" : "", what ? what : "", what ? ")" : "");
+  fflush(stdout);
+  return mv;
+}
+
+/* Whether there is charge left for optional steps */
+static int silab_pf_budget(const struct silab_pf *pf, uint16_t mv) {
+  return mv >= MIN_CHARGE_MV + pf->reserve_mv;
+}
+
+/* Runs cmd with sh, killed after ms */
+static void silab_pf_hook(const char *cmd, uint32_t ms) {
+  uint64_t end = silab_ns() + (uint64_t)ms * 1000000ULL;
+  struct timespec ts = {0, 1000000};
+  pid_t pid;
+  int st;
+
+  pid = fork();
+  if (pid == 0) {
+    execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+    _exit(127);
+  } else if (pid < 0) {
+    perror("fork");
+    return;
+  }
+  while (waitpid(pid, &st, WNOHANG) == 0) {
+    if (silab_ns() > end) {
+      kill(pid, SIGKILL);
+      waitpid(pid, &st, 0);
+      printf("powerfail hook killed after %u ms\n", ms);
+      return;
+    }
+    nanosleep(&ts, NULL);
+  }
+}
+
+/* Calls fn on each comma separated path in list */
+static void silab_pf_each(const char *list, void (*fn)(const char *, int),
+                          int dryrun) {
+  char path[256];
+  const char *p = list, *e;
+
+  while (p && *p) {
+    e = strchr(p, ',');
+    snprintf(path, sizeof(path), "%.*s", e ? (int)(e - p) : (int)strlen(p),
+             p);
+    fn(path, dryrun);
+    p = e ? e + 1 : NULL;
+  }
+}
+
+static void silab_pf_syncfs(const char *path, int dryrun) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0 || syncfs(fd) < 0)
+    perror(path);
+  if (fd >= 0)
+    close(fd);
+}
+
+static void silab_pf_remount(const char *path, int dryrun) {
+  if (!dryrun && mount(NULL, path, NULL, MS_REMOUNT | MS_RDONLY, NULL) < 0)
+    perror(path);
+}
+
+/* powerfail [rate <Hz>] [confirm <N>] [hook <cmd>] [hookms <ms>]
+ *           [sync <path,..>] [remount <path,..>] [reserve <mV>] [rt <prio>]
+ *           [dryrun 1]
+ * Polls for input power loss and, once <N> polls in a row see the caps
+ * discharging, shuts down in order: hook, syncfs() of each sync path (or
+ * sync()), read-only remount of each remount path, poweroff.  The hook and
+ * the syncs are skipped once the caps are within <mV> of MIN_CHARGE_MV.
+ * Every step is logged with its time since detection and the cap voltage.
+ * dryrun runs the hook and the syncs only, then exits. */
+static int silab_powerfail(struct silab *s, int argc, char *const argv[]) {
+  double rate = atof(silab_opt(argc, argv, 2, "rate", "100"));
+  int confirm = atoi(silab_opt(argc, argv, 2, "confirm", "2"));
+  const char *hook = silab_opt(argc, argv, 2, "hook", NULL);
+  uint32_t hookms = atoi(silab_opt(argc, argv, 2, "hookms", "1000"));
+  const char *syncs = silab_opt(argc, argv, 2, "sync", NULL);
+  const char *remounts = silab_opt(argc, argv, 2, "remount", NULL);
+  int prio = atoi(silab_opt(argc, argv, 2, "rt", "0"));
+  struct silab_pf pf;
+  uint64_t last_ok;
+  uint16_t mv;
+  int tfd, dis, seen = 0;
+
+  memset(&pf, 0, sizeof(pf));
+  pf.reserve_mv = atoi(silab_opt(argc, argv, 2, "reserve", "200"));
+  pf.dryrun = atoi(silab_opt(argc, argv, 2, "dryrun", "0"));
+  if (rate <= 0 || confirm < 1) {
+    fprintf(stderr, "rate must be > 0 and confirm >= 1\n");
+    return 1;
+  }
+
+  silab_board_is(s, ""); /* Reads the board id once */
+  if (!silab_board_find(s->board_id) ||
+      !(silab_board_find(s->board_id)->flags & SB_SCAPS)) {
+    fprintf(stderr, "No supercaps on this board\n");
+    return 1;
+  }
+
+  if (prio)
+    silab_realtime(prio);
+  tfd = silab_timer(1e9 / rate);
+  if (tfd < 0) {
+    perror("timerfd");
+    return 1;
+  }
+  silab_catch_signals();
+
+  last_ok = silab_ns();
+  while (!silab_stop) {
+    silab_timer_wait(tfd);
+    if (silab_pf_read(s, &mv, &dis)) {
+      seen = 0;
+      continue;
+    }
+    if (!dis) {
+      seen = 0;
+      last_ok = silab_ns();
+    } else if (++seen >= confirm)
+      break;
+  }
+  close(tfd);
+  if (silab_stop)
+    return 0;
+
+  /* Power went away at some point after the last good poll */
+  pf.t_det = silab_ns();
+  printf("powerfail detected mv=%u latency_max_us=%u\n", mv,
+         (uint32_t)((pf.t_det - last_ok) / 1000));
+  fflush(stdout);
+
+  if (hook && silab_pf_budget(&pf, mv)) {
+    silab_pf_hook(hook, hookms);
+    mv = silab_pf_log(s, &pf, "hook", hook);
+  }
+  if (silab_pf_budget(&pf, mv)) {
+    if (syncs)
+      silab_pf_each(syncs, silab_pf_syncfs, pf.dryrun);
+    else
+      sync();
+    mv = silab_pf_log(s, &pf, "sync", syncs);
+  } else
+    mv = silab_pf_log(s, &pf, "sync", "skipped, low charge");
+  if (remounts) {
+    silab_pf_each(remounts, silab_pf_remount, pf.dryrun);
+    mv = silab_pf_log(s, &pf, "remount", pf.dryrun ? "dryrun" : remounts);
+  }
+  if (pf.dryrun) {
+    silab_pf_log(s, &pf, "poweroff", "dryrun");
+    return 0;
+  }
+  silab_pf_log(s, &pf, "poweroff", NULL);
+  sync();
+  reboot(RB_POWER_OFF);
+  perror("reboot");
+  return 1;
+}
+
+/* History: a ring of 4 KiB pages in a file, each page decodable on its own.
+ * A page starts with a key frame (the full readings) and holds fixed size
+ * records of per channel deltas from the record before.  A record counts
+ * the samples it stands for, and a sample within the deadband of the last
+ * record only bumps that count, so a quiet board writes little.  The page
+ * being filled lives in memory and is copied into the mapping every <flush>
+ * s and when full: the kernel writes back at most one page per interval,
+ * nothing is fsync()ed.  The newest valid page by sequence is the head.
+ * Host byte order. */
+#define SILAB_HS_PAGE 4096
+#define SILAB_HS_MAGIC 0x31484c53 /* "SLH1" */
+
+struct silab_hs_rec {
+  uint16_t n;                  /* Samples this record stands for */
+  uint8_t ctl;                 /* Reg 22 */
+  int8_t d[SILAB_AN_CHANNELS]; /* From the previous record, 0 in the first */
+};
+
+struct silab_hs_hdr {
+  uint32_t magic;
+  uint32_t seq;
+  uint64_t t0_ms; /* CLOCK_REALTIME of the first sample */
+  uint32_t period_ms;
+  uint32_t crc; /* CRC-32 of the header and records, taken with crc 0 */
+  uint16_t nrec;
+  uint8_t board_id[8];
+  uint16_t key[SILAB_AN_CHANNELS]; /* Readings of the first record */
+};
+
+#define SILAB_HS_RECS                                                          \
+  ((SILAB_HS_PAGE - sizeof(struct silab_hs_hdr)) / sizeof(struct silab_hs_rec))
+
+struct silab_hs_page {
+  struct silab_hs_hdr h;
+  struct silab_hs_rec r[SILAB_HS_RECS];
+};
+
+struct silab_hs {
+  uint8_t *map;
+  uint32_t npages, head;
+  struct silab_hs_page cur;
+  uint16_t last[SILAB_AN_CHANNELS]; /* Readings of the last record */
+  uint32_t ticks;                   /* Samples in cur */
+};
+
+static uint32_t silab_hs_crc(const void *buf, size_t len) {
+  const uint8_t *p = buf;
+  uint32_t crc = ~0U;
+  int k;
+
+  while (len--) {
+    crc ^= *p++;
+    for (k = 0; k < 8; k++)
+      crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+  }
+  return ~crc;
+}
+
+static size_t silab_hs_used(const struct silab_hs_page *p) {
+  return sizeof(p->h) + p->h.nrec * sizeof(p->r[0]);
+}
+
+static int silab_hs_valid(const struct silab_hs_page *p) {
+  struct silab_hs_page tmp;
+
+  if (p->h.magic != SILAB_HS_MAGIC || p->h.nrec == 0 ||
+      p->h.nrec > SILAB_HS_RECS)
+    return 0;
+  memcpy(&tmp, p, silab_hs_used(p));
+  tmp.h.crc = 0;
+  return silab_hs_crc(&tmp, silab_hs_used(p)) == p->h.crc;
+}
+
+static struct silab_hs_page *silab_hs_slot(const struct silab_hs *hs,
+                                           uint32_t i) {
+  return (struct silab_hs_page *)(hs->map + (size_t)i * SILAB_HS_PAGE);
+}
+
+/* Maps the ring, creating it with size_kib if it is empty.  size_kib 0
+ * takes an existing file's size. */
+static int silab_hs_open(struct silab_hs *hs, const char *path,
+                         uint32_t size_kib, int wr) {
+  struct stat st;
+  int fd;
+
+  memset(hs, 0, sizeof(*hs));
+  fd = open(path, (wr ? O_RDWR | O_CREAT : O_RDONLY) | O_CLOEXEC, 0644);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    perror(path);
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  if (wr && st.st_size == 0) {
+    st.st_size = (off_t)(size_kib ? size_kib : 4096) * 1024;
+    if (ftruncate(fd, st.st_size) < 0) {
+      perror(path);
+      close(fd);
+      return -1;
+    }
+  } else if (size_kib && st.st_size != (off_t)size_kib * 1024) {
+    fprintf(stderr, "%s: exists with %lld KiB\n", path,
+            (long long)st.st_size / 1024);
+    close(fd);
+    return -1;
+  }
+  hs->npages = st.st_size / SILAB_HS_PAGE;
+  if (hs->npages < 2) {
+    fprintf(stderr, "%s: not a history file\n", path);
+    close(fd);
+    return -1;
+  }
+  hs->map = mmap(NULL, (size_t)hs->npages * SILAB_HS_PAGE,
+                 wr ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (hs->map == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+  return 0;
+}
+
+static void silab_hs_close(struct silab_hs *hs) {
+  munmap(hs->map, (size_t)hs->npages * SILAB_HS_PAGE);
+}
+
+/* Copies the page being filled into its slot */
+static void silab_hs_commit(struct silab_hs *hs) {
+  if (!hs->cur.h.nrec)
+    return;
+  hs->cur.h.crc = 0;
+  hs->cur.h.crc = silab_hs_crc(&hs->cur, silab_hs_used(&hs->cur));
+  memcpy(silab_hs_slot(hs, hs->head), &hs->cur, silab_hs_used(&hs->cur));
+}
+
+/* Starts a page in the slot after the head, key frame an */
+static void silab_hs_start(struct silab_hs *hs, const struct silab *s,
+                           const uint16_t *an, uint8_t ctl, uint64_t now_ms,
+                           uint32_t period_ms) {
+  uint32_t seq = hs->cur.h.seq;
+
+  hs->head = (hs->head + 1) % hs->npages;
+  memset(&hs->cur, 0, sizeof(hs->cur));
+  hs->cur.h.magic = SILAB_HS_MAGIC;
+  hs->cur.h.seq = seq + 1;
+  hs->cur.h.t0_ms = now_ms;
+  hs->cur.h.period_ms = period_ms;
+  hs->cur.h.nrec = 1;
+  memcpy(hs->cur.h.board_id, s->board_id, sizeof(hs->cur.h.board_id));
+  memcpy(hs->cur.h.key, an, sizeof(hs->cur.h.key));
+  memcpy(hs->last, an, sizeof(hs->last));
+  hs->cur.r[0].n = 1;
+  hs->cur.r[0].ctl = ctl;
+  hs->ticks = 1;
+}
+
+/* Adds a sample, after crediting held extra samples to the last record.
+ * Returns nonzero if it needs a new page. */
+static int silab_hs_add(struct silab_hs *hs, const uint16_t *an, uint8_t ctl,
+                        uint32_t held, uint16_t deadband) {
+  struct silab_hs_rec *r = &hs->cur.r[hs->cur.h.nrec - 1];
+  int i, d, same = r->ctl == ctl;
+
+  if (r->n + held + 1 > 0xffff)
+    return 1;
+  r->n += held;
+  hs->ticks += held;
+  for (i = 0; i < SILAB_AN_CHANNELS && same; i++) {
+    d = an[i] - hs->last[i];
+    same = i == SILAB_AN_TEMP ? d == 0 : d >= -deadband && d <= deadband;
+  }
+  if (same) {
+    r->n++;
+    hs->ticks++;
+    return 0;
+  }
+
+  if (hs->cur.h.nrec == SILAB_HS_RECS)
+    return 1;
+  for (i = 0; i < SILAB_AN_CHANNELS; i++) {
+    d = an[i] - hs->last[i];
+    if (d < -128 || d > 127)
+      return 1;
+  }
+  r = &hs->cur.r[hs->cur.h.nrec++];
+  r->n = 1;
+  r->ctl = ctl;
+  for (i = 0; i < SILAB_AN_CHANNELS; i++)
+    r->d[i] = an[i] - hs->last[i];
+  memcpy(hs->last, an, sizeof(hs->last));
+  hs->ticks++;
+  return 0;
+}
+
+/* Slot of the newest valid page, or -1 for an empty ring */
+static int silab_hs_head(const struct silab_hs *hs) {
+  const struct silab_hs_page *p;
+  int i, head = -1;
+
+  for (i = 0; i < hs->npages; i++) {
+    p = silab_hs_slot(hs, i);
+    if (silab_hs_valid(p) &&
+        (head < 0 || (int32_t)(p->h.seq - silab_hs_slot(hs, head)->h.seq) > 0))
+      head = i;
+  }
+  return head;
+}
+
+/* The analog block and ctl, regs 0..22, in one read */
+static int silab_hs_read(struct silab *s, uint16_t *an, uint8_t *ctl) {
+  uint8_t buf[SILAB_AN_CHANNELS * 2 + 1];
+  int i;
+
+  if (silab_read(s, 0, buf, sizeof(buf)))
+    return -1;
+  for (i = 0; i < SILAB_AN_CHANNELS; i++)
+    an[i] = ((uint16_t)buf[i << 1] << 8) | buf[(i << 1) | 1];
+  *ctl = buf[22];
+  return 0;
+}
+
+/* history record <file> [rate <Hz>] [size <KiB>] [deadband <N>]
+ *                       [flush <s>]
+ * Samples the analog block and ctl at <Hz> (default 1) into the ring,
+ * created at <KiB> (default 4096).  Voltage channels within <N> (default
+ * 10) of the last record, with the same temperature and ctl, extend that
+ * record instead of adding one.  A page is rewritten every <s> (default
+ * 60), which bounds both flash wear and what a reset can lose. */
+static int silab_history_record(struct silab *s, int argc,
+                                char *const argv[]) {
+  double rate = atof(silab_opt(argc, argv, 4, "rate", "1"));
+  uint32_t size_kib = atoi(silab_opt(argc, argv, 4, "size", "0"));
+  uint16_t deadband = atoi(silab_opt(argc, argv, 4, "deadband", "10"));
+  uint64_t flush_ns =
+      atoi(silab_opt(argc, argv, 4, "flush", "60")) * 1000000000ULL;
+  uint16_t an[SILAB_AN_CHANNELS];
+  uint32_t period_ms, held = 0;
+  uint64_t n, now_ms, expect_ms, last_flush;
+  int tfd, head, fresh = 1;
+  struct silab_hs hs;
+  uint8_t ctl;
+
+  if (rate <= 0 || rate > 1000) {
+    fprintf(stderr, "rate must be > 0 and <= 1000\n");
+    return 1;
+  }
+  period_ms = 1000 / rate;
+  silab_board_is(s, ""); /* Reads the board id once */
+  if (silab_hs_open(&hs, argv[3], size_kib, 1))
+    return 1;
+  head = silab_hs_head(&hs);
+  if (head >= 0) { /* Continue the sequence after the newest page */
+    hs.head = head;
+    hs.cur.h.seq = silab_hs_slot(&hs, head)->h.seq;
+  } else
+    hs.head = hs.npages - 1;
+
+  tfd = silab_timer(period_ms * 1000000ULL);
+  if (tfd < 0) {
+    perror("timerfd");
+    silab_hs_close(&hs);
+    return 1;
+  }
+  silab_catch_signals();
+
+  last_flush = silab_ns();
+  while (!silab_stop) {
+    if (silab_hs_read(s, an, &ctl) == 0) {
+      /* A page's times are t0 plus samples, so a clock step (NTP after
+       * boot) or a read error gap starts a new one */
+      now_ms = silab_walltime() * 1000;
+      expect_ms = hs.cur.h.t0_ms + (uint64_t)(hs.ticks + held) * period_ms;
+      if (fresh || now_ms + 1000 < expect_ms || now_ms > expect_ms + 1000 ||
+          silab_hs_add(&hs, an, ctl, held, deadband)) {
+        if (!fresh)
+          silab_hs_commit(&hs);
+        silab_hs_start(&hs, s, an, ctl, now_ms, period_ms);
+        fresh = 0;
+      }
+      held = 0;
+    } else
+      fresh = 1;
+
+    if (silab_ns() - last_flush >= flush_ns) {
+      silab_hs_commit(&hs);
+      last_flush = silab_ns();
+    }
+    n = silab_timer_wait(tfd);
+    if (n)
+      held += n - 1;
+  }
+
+  silab_hs_commit(&hs);
+  close(tfd);
+  silab_hs_close(&hs);
+  return 0;
+}
+
+struct silab_hs_ord {
+  uint32_t seq, slot;
+};
+
+static int silab_hs_ord_cmp(const void *a, const void *b) {
+  const struct silab_hs_ord *x = a, *y = b;
+
+  return (int32_t)(x->seq - y->seq) < 0 ? -1 : x->seq != y->seq;
+}
+
+static void silab_hs_row(const struct silab_board *b, uint64_t t_ms,
+                         const uint16_t *an, uint8_t ctl, uint32_t n) {
+  int i;
+
+  printf("%llu.%03u", (unsigned long long)(t_ms / 1000),
+         (uint32_t)(t_ms % 1000));
+  for (i = 0; i < SILAB_AN_CHANNELS; i++)
+    if (!b || *silab_an_name(b, i))
+      printf(",%u", an[i]);
+  printf(",%u,%u\n", ctl, n);
+}
+
+/* history query <file> [from <t>] [to <t>] [expand 1]
+ * Prints the records in [from, to) as CSV, times in unix seconds, negative
+ * ones relative to now.  A record's readings hold for its samples; expand
+ * prints one row per sample instead. */
+static int silab_history_query(int argc, char *const argv[]) {
+  double from = atof(silab_opt(argc, argv, 4, "from", "0"));
+  double to = atof(silab_opt(argc, argv, 4, "to", "0"));
+  int expand = atoi(silab_opt(argc, argv, 4, "expand", "0"));
+  const struct silab_board *b = NULL;
+  const struct silab_hs_page *p;
+  struct silab_hs_ord *ord;
+  uint16_t an[SILAB_AN_CHANNELS];
+  uint64_t from_ms, to_ms, t_ms;
+  int i, j, k, n = 0, bad = 0, hdr = 0;
+  struct silab_hs hs;
+
+  if (from < 0)
+    from += silab_walltime();
+  if (to < 0)
+    to += silab_walltime();
+  from_ms = from * 1000;
+  to_ms = to ? to * 1000 : UINT64_MAX;
+  if (silab_hs_open(&hs, argv[3], 0, 0))
+    return 1;
+
+  ord = malloc(hs.npages * sizeof(*ord));
+  assert(ord);
+  for (i = 0; i < hs.npages; i++) {
+    p = silab_hs_slot(&hs, i);
+    if (silab_hs_valid(p)) {
+      ord[n].seq = p->h.seq;
+      ord[n++].slot = i;
+    } else if (p->h.magic == SILAB_HS_MAGIC)
+      bad++;
+  }
+  qsort(ord, n, sizeof(*ord), silab_hs_ord_cmp);
+
+  for (i = 0; i < n; i++) {
+    p = silab_hs_slot(&hs, ord[i].slot);
+    if (!hdr) {
+      b = silab_board_find(p->h.board_id);
+      printf("time");
+      for (j = 0; j < SILAB_AN_CHANNELS; j++)
+        if (!b)
+          printf(",an%d", j);
+        else if (*silab_an_name(b, j))
+          printf(",%s", silab_an_name(b, j));
+      printf(",ctl,samples\n");
+      hdr = 1;
+    }
+    memcpy(an, p->h.key, sizeof(an));
+    t_ms = p->h.t0_ms;
+    for (j = 0; j < p->h.nrec && t_ms < to_ms; j++) {
+      const struct silab_hs_rec *r = &p->r[j];
+
+      for (k = 0; k < SILAB_AN_CHANNELS; k++)
+        an[k] += r->d[k];
+      if (expand) {
+        for (k = 0; k < r->n; k++, t_ms += p->h.period_ms)
+          if (t_ms >= from_ms && t_ms < to_ms)
+            silab_hs_row(b, t_ms, an, r->ctl, 1);
+        continue;
+      }
+      if (t_ms + (uint64_t)r->n * p->h.period_ms > from_ms)
+        silab_hs_row(b, t_ms, an, r->ctl, r->n);
+      t_ms += (uint64_t)r->n * p->h.period_ms;
+    }
+  }
+  if (bad)
+    fprintf(stderr, "%d damaged pages skipped\n", bad);
+
+  free(ord);
+  silab_hs_close(&hs);
+  return 0;
+}
+
+static int silab_history(struct silab *s, int argc, char *const argv[]) {
+  if (argc >= 4 && strcmp("record", argv[2]) == 0)
+    return silab_history_record(s, argc, argv);
+  else if (argc >= 4 && strcmp("query", argv[2]) == 0)
+    return silab_history_query(argc, argv);
+  printf("Usage: %s history record|query <file> ...\n", argv[0]);
+  return 1;
+}
+
+static long long silab_ctx_cmd(struct silab *s, int argc, char *const argv[]);
+
+/* Batch: commands in the order they run */
+#define SILAB_BATCH_REG 0   /* Updates regs 22..27 or the fan */
+#define SILAB_BATCH_QUERY 1 /* Answered from regs 22/23 */
+#define SILAB_BATCH_OTHER 2 /* Run as is, after the writes */
+#define SILAB_BATCH_WDOG 3
+#define SILAB_BATCH_LAST 4 /* sleep, reboot */
+
+#define SILAB_BATCH_ARGS 16
+
+struct silab_batch_cmd {
+  int argc;
+  char *argv[SILAB_BATCH_ARGS];
+  int kind;
+  uint8_t mask; /* Bytes of regs 22..27 written for this command */
+  uint8_t bits; /* Its bits within those bytes */
+  long long r;
+  const char *res; /* Result of an update, "ok", "unchanged" or "error" */
+  uint32_t us;
+};
+
+#define SILAB_BATCH_FAN 0x80 /* In mask, the fan register */
+
+/* Regs 22..27 as read, plus the pending updates */
+struct silab_batch {
+  uint8_t reg[6];
+  uint8_t orig[6];
+  uint8_t dirty;
+  int fan; /* -1 untouched */
+};
+
+/* Whether c is "<w1> <w2> .." with n words, w2 NULL for any */
+static int silab_batch_is(const struct silab_batch_cmd *c, int n,
+                          const char *w1, const char *w2) {
+  return c->argc == n && strcmp(c->argv[1], w1) == 0 &&
+         (n < 3 || !w2 || strcmp(c->argv[2], w2) == 0);
+}
+
+/* Splits line into c->argv[1..], argv[0] is the program.  Returns the word
+ * count, or -1 when there are more words than c->argv holds. */
+static int silab_batch_parse(struct silab_batch_cmd *c, const char *prog,
+                             char *line) {
+  char *w, *save;
+
+  memset(c, 0, sizeof(*c));
+  c->argv[c->argc++] = (char *)prog;
+  for (w = strtok_r(line, " \t\r\n", &save); w && *w != '#';
+       w = strtok_r(NULL, " \t\r\n", &save)) {
+    if (c->argc == SILAB_BATCH_ARGS - 1)
+      return -1;
+    c->argv[c->argc++] = w;
+  }
+  return c->argc - 1;
+}
+
+static int silab_batch_kind(const struct silab_batch_cmd *c) {
+  if (silab_batch_is(c, 4, "flags", "set") ||
+      silab_batch_is(c, 4, "flags", "clear") ||
+      silab_batch_is(c, 3, "scaps", "enable") ||
+      silab_batch_is(c, 3, "scaps", "disable") ||
+      silab_batch_is(c, 4, "scaps", "default") ||
+      silab_batch_is(c, 4, "scaps", "current") ||
+      silab_batch_is(c, 5, "scaps", "current") ||
+      silab_batch_is(c, 3, "fan", "enable") ||
+      silab_batch_is(c, 3, "fan", "disable"))
+    return SILAB_BATCH_REG;
+  if (silab_batch_is(c, 3, "flags", NULL) ||
+      silab_batch_is(c, 2, "scaps", NULL) ||
+      silab_batch_is(c, 2, "usb", NULL) || silab_batch_is(c, 2, "wdog", NULL))
+    return SILAB_BATCH_QUERY;
+  if (silab_batch_is(c, 4, "wdog", "set") ||
+      silab_batch_is(c, 3, "wdog", "disable") ||
+      silab_batch_is(c, 3, "wdog", "feed"))
+    return SILAB_BATCH_WDOG;
+  if (c->argc >= 2 && (strcmp(c->argv[1], "sleep") == 0 ||
+                       strcmp(c->argv[1], "reboot") == 0))
+    return SILAB_BATCH_LAST;
+  return SILAB_BATCH_OTHER;
+}
+
+static void silab_batch_setw(struct silab_batch *b, struct silab_batch_cmd *c,
+                             int i, uint16_t w) {
+  b->reg[i] = w >> 8;
+  b->reg[i + 1] = w & 0xff;
+  c->mask |= 3 << i;
+  c->bits = 0xff;
+}
+
+/* Does to b what the command would do to the uC, in order */
+static void silab_batch_apply(struct silab_batch *b,
+                              struct silab_batch_cmd *c, int scaps) {
+  char *const *av = c->argv;
+  uint8_t *ctl = &b->reg[0], *flags = &b->reg[1];
+
+  if (strcmp(av[1], "fan") == 0) {
+    b->fan = strcmp(av[2], "enable") == 0;
+    c->mask = SILAB_BATCH_FAN;
+  } else if (strcmp(av[1], "flags") == 0) {
+    if (c->argc == 3)
+      c->r = (*flags >> atoi(av[2])) & 1;
+    else if (strcmp(av[2], "set") == 0)
+      *flags |= 1 << (atoi(av[3]) & 7);
+    else
+      *flags &= ~(1 << (atoi(av[3]) & 7));
+    if (c->argc == 4) {
+      c->mask = 1 << 1;
+      c->bits = 1 << (atoi(av[3]) & 7);
+    }
+  } else if (strcmp(av[1], "usb") == 0) {
+    c->r = (*ctl & 0x10) ? 1 : 0;
+  } else if (strcmp(av[1], "wdog") == 0) {
+    c->r = (*ctl & (1 << 6)) ? 1 : 0;
+  } else if (!scaps) { /* As silab_ctx_cmd() on the 7250 */
+    c->r = c->argc == 2 ? 0 : 1;
+  } else if (c->argc == 2) {
+    c->r = (*ctl & 2) ? 1 : 0;
+  } else if (strcmp(av[2], "current") == 0) {
+    if (c->argc == 5)
+      silab_batch_setw(b, c, 2, atoi(av[4]));
+    else
+      silab_batch_setw(b, c, 4, atoi(av[3]));
+  } else if (strcmp(av[2], "default") == 0) {
+    if (strcmp(av[3], "enable") == 0)
+      *flags &= ~1;
+    else if (strcmp(av[3], "disable") == 0)
+      *flags |= 1;
+    c->mask = 1 << 1;
+    c->bits = 1;
+  } else {
+    *ctl &= ~6;
+    if (strcmp(av[2], "enable") == 0)
+      *ctl |= 1 << 1;
+    c->mask = 1 << 0;
+    c->bits = 1 << 1;
+  }
+  b->dirty |= c->mask & ~SILAB_BATCH_FAN;
+}
+
+/* Regs 22..27 as the settings they hold: ctl's scaps enable bit, flags,
+ * and the two charge currents */
+static const uint8_t silab_batch_groups[] = {0x01, 0x02, 0x0c, 0x30};
+
+/* Drops updates that leave a setting as it was */
+static void silab_batch_prune(struct silab_batch *b) {
+  int g, i, same;
+
+  for (g = 0; g < sizeof(silab_batch_groups); g++) {
+    if (!(b->dirty & silab_batch_groups[g]))
+      continue;
+    same = 1;
+    for (i = 0; i < sizeof(b->reg); i++)
+      if ((silab_batch_groups[g] >> i) & 1)
+        same &= i == 0 ? !((b->reg[0] ^ b->orig[0]) & 2)
+                       : b->reg[i] == b->orig[i];
+    if (same)
+      b->dirty &= ~silab_batch_groups[g];
+  }
+}
+
+/* Writes each changed setting in a transfer of its own, as the single
+ * commands do: ctl and flags a byte each, a current as one word.  Nothing
+ * says the uC takes one write across settings.  Returns the bytes whose
+ * write failed. */
+static uint8_t silab_batch_flush(struct silab *s, struct silab_batch *b) {
+  uint8_t failed = 0, m;
+  int g, i, n;
+
+  for (g = 0; g < sizeof(silab_batch_groups); g++) {
+    m = silab_batch_groups[g];
+    if (!(b->dirty & m))
+      continue;
+    for (i = 0; !((m >> i) & 1); i++)
+      ;
+    for (n = 0; (m >> (i + n)) & 1; n++)
+      ;
+    if (silab_write(s, 22 + i, &b->reg[i], n))
+      failed |= m;
+  }
+  return failed;
+}
+
+/* Whether the bits c updates end up different from what was read */
+static int silab_batch_changed(const struct silab_batch *b,
+                               const struct silab_batch_cmd *c) {
+  int i;
+
+  for (i = 0; i < sizeof(b->reg); i++)
+    if (((c->mask >> i) & 1) && ((b->reg[i] ^ b->orig[i]) & c->bits))
+      return 1;
+  return 0;
+}
+
+static void silab_batch_print(const struct silab_batch_cmd *c) {
+  int i;
+
+  for (i = 1; i < c->argc; i++)
+    printf("%s%s", i > 1 ? " " : "", c->argv[i]);
+  if (c->res)
+    printf(": %s\n", c->res);
+  else
+    printf(": %lld\n", c->r);
+}
+
+/* Runs cmds[0..n): changes to regs 22..27 are made to a copy read in one
+ * transfer together with the board id, and only settings that change are
+ * written back, one transfer per changed setting, all with the bus
+ * held.  The fan is written once, with the last setting.  Queries of regs
+ * 22/23 are answered from the copy as of their place in the list.  Other
+ * commands then run as they would alone, then the watchdog, then sleep or
+ * reboot.  done() gets each command as its result (r, or res for updates)
+ * and time (us, shared by the merged ones) are known.  Returns 1 if an
+ * update failed, or with every res "error" and nothing run if the first
+ * read did. */
+static int silab_batch_run(struct silab *s, struct silab_batch_cmd *cmds,
+                           int n, void (*done)(const struct silab_batch_cmd *)) {
+  struct silab_batch b;
+  uint8_t build[sizeof(s->board_id)], failed = 0;
+  struct silab_region rd[] = {
+      {22, b.reg, sizeof(b.reg)},
+      {4096, build, sizeof(build)},
+  };
+  int i, need = 0, scaps = 1, ret = 0, kind;
+  uint64_t t0 = silab_ns();
+  uint32_t us;
+
+  for (i = 0; i < n; i++) {
+    cmds[i].kind = silab_batch_kind(&cmds[i]);
+    need |= cmds[i].kind == SILAB_BATCH_QUERY ||
+            (cmds[i].kind == SILAB_BATCH_REG &&
+             strcmp(cmds[i].argv[1], "fan") != 0);
+  }
+
+  memset(&b, 0, sizeof(b));
+  b.fan = -1;
+  silab_lock(s, SILAB_PRIO_NORMAL);
+  if (need) {
+    if (silab_readv(s, rd, sizeof(rd) / sizeof(rd[0]))) {
+      silab_unlock(s);
+      fprintf(stderr, "I2C read failed\n");
+      for (i = 0; i < n; i++)
+        cmds[i].res = "error";
+      return 1;
+    }
+    silab_board_id_set(s, build);
+    scaps = !silab_board_is(s, "7250");
+    memcpy(b.orig, b.reg, sizeof(b.orig));
+  }
+  for (i = 0; i < n; i++)
+    if (cmds[i].kind <= SILAB_BATCH_QUERY)
+      silab_batch_apply(&b, &cmds[i], scaps);
+  silab_batch_prune(&b);
+  failed = silab_batch_flush(s, &b);
+  if (b.fan >= 0 && silab_outb(s, 1024 + 8, b.fan ? 0 : 1))
+    failed |= SILAB_BATCH_FAN;
+  silab_unlock(s);
+
+  us = (silab_ns() - t0) / 1000;
+  for (i = 0; i < n; i++) {
+    struct silab_batch_cmd *c = &cmds[i];
+
+    if (c->kind == SILAB_BATCH_REG) {
+      if ((c->mask & failed) || c->r) {
+        c->res = "error";
+        ret = 1;
+      } else if ((c->mask & SILAB_BATCH_FAN) || silab_batch_changed(&b, c))
+        c->res = "ok";
+      else
+        c->res = "unchanged";
+    }
+    if (c->kind <= SILAB_BATCH_QUERY) {
+      c->us = us;
+      done(c);
+    }
+  }
+
+  /* Everything else keeps its relative order */
+  for (kind = SILAB_BATCH_OTHER; kind <= SILAB_BATCH_LAST; kind++)
+    for (i = 0; i < n; i++)
+      if (cmds[i].kind == kind) {
+        fflush(stdout);
+        t0 = silab_ns();
+        cmds[i].r = silab_ctx_cmd(s, cmds[i].argc, cmds[i].argv);
+        cmds[i].us = (silab_ns() - t0) / 1000;
+        done(&cmds[i]);
+      }
+  return ret;
+}
+
+/* batch <cmd> ... | batch -f <file>
+ * Runs the commands, one per argument or per line of <file> (- for
+ * stdin), with silab_batch_run().  Prints one "<cmd>: <result>" line
+ * each. */
+static int silab_batch(struct silab *s, int argc, char *const argv[]) {
+  struct silab_batch_cmd *cmds = NULL;
+  char **lines = NULL, *line = NULL;
+  size_t len = 0;
+  int i, n = 0, nlines = 0, ret = 0;
+  FILE *f = NULL;
+
+  if (argc >= 4 && strcmp(argv[2], "-f") == 0) {
+    f = strcmp(argv[3], "-") == 0 ? stdin : fopen(argv[3], "r");
+    if (!f) {
+      perror(argv[3]);
+      return 1;
+    }
+    while (getline(&line, &len, f) > 0) {
+      lines = realloc(lines, (nlines + 1) * sizeof(*lines));
+      assert(lines);
+      lines[nlines] = strdup(line);
+      assert(lines[nlines]);
+      nlines++;
+    }
+    free(line);
+    if (f != stdin)
+      fclose(f);
+  } else {
+    for (i = 2; i < argc; i++) {
+      lines = realloc(lines, (nlines + 1) * sizeof(*lines));
+      assert(lines);
+      lines[nlines] = strdup(argv[i]);
+      assert(lines[nlines]);
+      nlines++;
+    }
+  }
+
+  cmds = calloc(nlines ? nlines : 1, sizeof(*cmds));
+  assert(cmds);
+  /* Nothing runs unless every line parses */
+  for (i = 0; i < nlines && !ret; i++) {
+    int words = silab_batch_parse(&cmds[n], argv[0], lines[i]);
+
+    if (words < 0) {
+      fprintf(stderr, "%s: line %d has more than %d words\n", argv[1], i + 1,
+              SILAB_BATCH_ARGS - 2);
+      ret = 1;
+    } else if (words) {
+      n++;
+    }
+  }
+  if (!ret)
+    ret = silab_batch_run(s, cmds, n, silab_batch_print);
+
+  for (i = 0; i < nlines; i++)
+    free(lines[i]);
+  free(lines);
+  free(cmds);
+  return ret;
+}
+
+/* Fan control from the uC temperature.  Fan current, where the board
+ * measures it, is expected above <stall> once the fan has had time to spin
+ * up; below it the fan is reported stalled or missing. */
+#define SILAB_FAN_SPINUP_NS 2000000000ULL
+
+struct silab_fan_stats {
+  uint32_t n, on, switches;
+  int32_t tmin, tmax, tsum;
+  uint32_t cur_sum;
+  uint64_t khz_sum;
+  uint32_t khz_n;
+};
+
+/* Current frequency of cpu0, which drops when the kernel throttles */
+static long silab_cpufreq_khz(void) {
+  FILE *f = fopen("/sys/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq", "r");
+  long khz = -1;
+
+  if (f) {
+    if (fscanf(f, "%ld", &khz) != 1)
+      khz = -1;
+    fclose(f);
+  }
+  return khz;
+}
+
+static void silab_fan_event(FILE *f, const char *event, int16_t temp,
+                            int cur) {
+  fprintf(f, "{\"ts\":%.3f,\"event\":\"%s\",\"temp\":%d", silab_walltime(),
+          event, temp);
+  if (cur >= 0)
+    fprintf(f, ",\"fan_current\":%d", cur);
+  fprintf(f, "}\n");
+  fflush(f);
+}
+
+static void silab_fan_summary(FILE *f, const struct silab_fan_stats *st,
+                              int has_cur, int stalled) {
+  fprintf(f,
+          "{\"ts\":%.3f,\"n\":%u,\"temp\":{\"min\":%d,\"max\":%d,"
+          "\"mean\":%.1f},\"duty\":%.3f,\"switches\":%u",
+          silab_walltime(), st->n, st->tmin, st->tmax,
+          (double)st->tsum / st->n, (double)st->on / st->n, st->switches);
+  if (has_cur)
+    fprintf(f, ",\"fan_current\":%.1f,\"stalled\":%d",
+            (double)st->cur_sum / st->n, stalled);
+  if (st->khz_n)
+    fprintf(f, ",\"cpufreq_khz\":%.0f", (double)st->khz_sum / st->khz_n);
+  fprintf(f, "}\n");
+  fflush(f);
+}
+
+/* fan auto [on <C>] [off <C>] [dwell <s>] [stall <mA>] [rate <Hz>]
+ *          [interval <N>] [log <file>]
+ * Turns the fan on at or above <on> C (default 60) and off at or below
+ * <off> C (default 50), at most once per <dwell> s (default 30).  Every
+ * switch and stall is logged as a JSON line, and every <N> samples
+ * (default 60) a summary with temperature, fan duty cycle, fan current and
+ * the cpu0 frequency.  Leaves the fan on when stopped. */
+static int silab_fan_auto(struct silab *s, int argc, char *const argv[]) {
+  int on_c = atoi(silab_opt(argc, argv, 3, "on", "60"));
+  int off_c = atoi(silab_opt(argc, argv, 3, "off", "50"));
+  uint64_t dwell_ns =
+      atoi(silab_opt(argc, argv, 3, "dwell", "30")) * 1000000000ULL;
+  int stall_ma = atoi(silab_opt(argc, argv, 3, "stall", "20"));
+  double rate = atof(silab_opt(argc, argv, 3, "rate", "1"));
+  int interval = atoi(silab_opt(argc, argv, 3, "interval", "60"));
+  const char *path = silab_opt(argc, argv, 3, "log", NULL);
+  const struct silab_board *b;
+  struct silab_fan_stats st;
+  uint16_t an[SILAB_AN_CHANNELS];
+  uint64_t now, switched = 0;
+  int tfd, i, fan = -1, cur_ch = -1, on, stalled = 0, first = 1;
+  int16_t temp;
+  long khz;
+  FILE *f = stdout;
+
+  if (off_c >= on_c || rate <= 0 || interval < 1) {
+    fprintf(stderr, "need off < on, rate > 0 and interval >= 1\n");
+    return 1;
+  }
+  silab_board_is(s, ""); /* Reads the board id once */
+  b = silab_board_find(s->board_id);
+  if (!b) {
+    fprintf(stderr, "Unknown board\n");
+    return 1;
+  }
+  for (i = 0; i < SILAB_AN_TEMP; i++)
+    if (strcmp(b->an[i], "Fan current") == 0)
+      cur_ch = i;
+  if (path) {
+    f = fopen(path, "a");
+    if (!f) {
+      perror(path);
+      return 1;
+    }
+  }
+
+  tfd = silab_timer(1e9 / rate);
+  if (tfd < 0) {
+    perror("timerfd");
+    return 1;
+  }
+  silab_catch_signals();
+
+  memset(&st, 0, sizeof(st));
+  while (!silab_stop) {
+    if (silab_read_analog(s, an) == 0) {
+      now = silab_ns();
+      temp = an[SILAB_AN_TEMP];
+
+      /* The first reading picks the state without waiting out the dwell */
+      on = fan;
+      if (temp >= on_c)
+        on = 1;
+      else if (temp <= off_c)
+        on = 0;
+      else if (fan < 0)
+        on = 1;
+      if (on != fan && (first || now - switched >= dwell_ns)) {
+        if (silab_outb(s, 1024 + 8, on ? 0 : 1) == 0) {
+          if (!first)
+            st.switches++;
+          silab_fan_event(f, on ? "on" : "off", temp,
+                          cur_ch >= 0 ? an[cur_ch] : -1);
+          fan = on;
+          switched = now;
+          first = 0;
+        } else
+          fprintf(stderr, "I2C write failed\n");
+      }
+
+      if (cur_ch >= 0 && fan == 1 && now - switched >= SILAB_FAN_SPINUP_NS &&
+          (an[cur_ch] < stall_ma) != stalled) {
+        stalled = !stalled;
+        silab_fan_event(f, stalled ? "stall" : "running", temp, an[cur_ch]);
+      }
+
+      if (st.n == 0 || temp < st.tmin)
+        st.tmin = temp;
+      if (st.n == 0 || temp > st.tmax)
+        st.tmax = temp;
+      st.tsum += temp;
+      st.on += fan == 1;
+      if (cur_ch >= 0)
+        st.cur_sum += an[cur_ch];
+      khz = silab_cpufreq_khz();
+      if (khz > 0) {
+        st.khz_sum += khz;
+        st.khz_n++;
+      }
+      if (++st.n >= interval) {
+        silab_fan_summary(f, &st, cur_ch >= 0, stalled);
+        memset(&st, 0, sizeof(st));
+      }
+    } else
+      fprintf(stderr, "I2C read failed\n");
+    silab_timer_wait(tfd);
+  }
+
+  if (st.n)
+    silab_fan_summary(f, &st, cur_ch >= 0, stalled);
+  silab_fan_en(s, 1);
+  close(tfd);
+  if (f != stdout)
+    fclose(f);
+  return 0;
+}
@@ -0,0 +1,351 @@
+/* Simulated uC for the silabs-port.c porting layer.  Build silabs.c with
+ * -DSILABS_PORT (the silabs_sim program) to run every silabs command against
+ * a model of the register map instead of /dev/i2c-N:
+ *
+ *   SILABS_SIM_STATE  File holding the register state, shared by every
+ *                     process using it.  Unset: private, fresh each run.
+ *   SILABS_SIM_BOARD  7840 (default), 7100, 7250 or 4400, read when the
+ *                     state is created
+ *   SILABS_SIM_KHZ    Bus clock, each transfer takes as long as it would on
+ *                     the wire (default 100, 0 for no delay)
+ *   SILABS_SIM_TAU_MS Supercap RC time constant at 200 mA (default 30000)
+ *   SILABS_SIM_POWERFAIL_MS
+ *                     Input power goes away this long after the first
+ *                     transfer, the caps then discharge at
+ *   SILABS_SIM_LOAD_MV_S  (default 600)
+ *   SILABS_SIM_STATS  Print this process's transfer counts at exit
+ *
+ * Modelled: supercaps charge on an RC curve while enabled (regs 14/16,
+ * charged bit in 22, time constant scaled by the current at 26), the
+ * input power loss (ctl bit 0, charger reads 0, caps discharge linearly), the
+ * watchdog expires and "reboots" the board if not fed in time, sleep and
+ * reboot requests, flags, charge currents, fan, MAC. */
+
+#include <fcntl.h>
+#include <math.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SIM_MAGIC 0x53494d31 /* "SIM1" */
+#define SIM_VINF_MV 4950     /* Charger output, above MAX_CHARGE_MV */
+
+struct sim_board {
+  const char *build;
+  uint16_t ver_subadr;
+  uint8_t ver;
+  uint8_t scaps, mac;
+  int8_t an_boot; /* Channel showing the cap voltage at power up, or -1 */
+  uint16_t an[10]; /* Static channels, caps are filled in by the model */
+};
+
+static const struct sim_board sim_boards[] = {
+    {"TS-7840 sim", 2048, 12, 1, 1, 5,
+     {5000, 12000, 0, 24000, 35, 0, 150, 0, 0, SIM_VINF_MV}},
+    {"TS-7100 sim", 2048, 9, 1, 0, -1,
+     {5000, 12000, 3300, 24000, 0, 0, 0, 0, 0, SIM_VINF_MV}},
+    {"TS-7250-V3 sim", 2048, 7, 0, 0, -1,
+     {5000, 900, 3300, 24000, 0, 1100, 0, 0, 0, 0}},
+    {"TS-4400 sim", 0xffff, 3, 1, 0, -1,
+     {5000, 5100, 3300, 1500, 1200, 1800, 300, 0, 0, 4700}},
+};
+
+/* Shared between processes through the state file */
+struct sim_state {
+  uint32_t magic;
+  uint32_t board;
+  uint8_t regs[65536];
+  /* Supercaps: v0 mV at t0, then an RC towards SIM_VINF_MV while enabled */
+  uint64_t caps_t0_ns;
+  double caps_v0;
+  uint16_t caps_boot_mv;
+  /* Watchdog */
+  uint64_t wdog_fed_ns;
+  uint32_t wdog_ms;
+  uint8_t wdog_expired;
+  /* Totals over all processes */
+  uint64_t transfers, bytes, bus_ns;
+  uint32_t reboots, sleeps;
+};
+
+static struct sim_state *sim;
+static int sim_fd = -1;
+static uint32_t sim_khz;
+static double sim_tau_ms;
+static uint64_t sim_pf_ns; /* Input power lost, 0 never */
+static double sim_load_mv_s;
+static uint64_t sim_transfers, sim_bytes, sim_bus_ns; /* This process */
+
+static uint64_t sim_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sim_report(void) {
+  fprintf(stderr, "sim_transfers=%llu\nsim_bytes=%llu\nsim_bus_us=%llu\n",
+          (unsigned long long)sim_transfers, (unsigned long long)sim_bytes,
+          (unsigned long long)(sim_bus_ns / 1000));
+}
+
+static double sim_caps_charge(uint64_t now) {
+  double tau = sim_tau_ms, ma;
+
+  if (!sim_boards[sim->board].scaps)
+    return 0;
+  if (!(sim->regs[22] & 2))
+    return sim->caps_v0;
+  ma = (sim->regs[26] << 8) | sim->regs[27];
+  if (ma < 1)
+    return sim->caps_v0;
+  tau *= 200 / ma;
+  return SIM_VINF_MV - (SIM_VINF_MV - sim->caps_v0) *
+                           exp(-(double)(now - sim->caps_t0_ns) / 1e6 / tau);
+}
+
+static double sim_caps_mv(uint64_t now) {
+  double mv;
+
+  if (!sim_pf_ns || now < sim_pf_ns)
+    return sim_caps_charge(now);
+  mv = sim_caps_charge(sim_pf_ns) - (now - sim_pf_ns) / 1e9 * sim_load_mv_s;
+  return mv > 0 ? mv : 0;
+}
+
+/* Restarts the charge curve from the present voltage, for when the enable
+ * or the current changes */
+static void sim_caps_rebase(uint64_t now) {
+  sim->caps_v0 = sim_caps_mv(now);
+  sim->caps_t0_ns = now;
+}
+
+static void sim_put16(uint16_t subadr, uint16_t v) {
+  sim->regs[subadr] = v >> 8;
+  sim->regs[subadr + 1] = v & 0xff;
+}
+
+/* Brings the registers up to date with the models */
+static void sim_update(uint64_t now) {
+  const struct sim_board *b = &sim_boards[sim->board];
+  uint16_t mv;
+  int i;
+
+  if ((sim->regs[22] & (1 << 6)) &&
+      now - sim->wdog_fed_ns > (uint64_t)sim->wdog_ms * 1000000ULL) {
+    /* Expired: the uC power cycles the board, the caps keep their charge */
+    sim->wdog_expired = 1;
+    sim->regs[22] &= ~(1 << 6);
+    sim->caps_boot_mv = sim_caps_mv(now);
+    sim->reboots++;
+  }
+
+  for (i = 0; i < 10; i++)
+    sim_put16(i * 2, b->an[i]);
+  if (sim_pf_ns && now >= sim_pf_ns) {
+    sim_put16(18, 0); /* Charger */
+    sim->regs[22] |= 1;
+  } else
+    sim->regs[22] &= ~1;
+  if (b->scaps) {
+    mv = sim_caps_mv(now);
+    sim_put16(14, mv);
+    sim_put16(16, mv);
+    if (b->an_boot >= 0)
+      sim_put16(b->an_boot * 2, sim->caps_boot_mv);
+    if (mv >= MAX_CHARGE_MV)
+      sim->regs[22] |= 4;
+    else
+      sim->regs[22] &= ~4;
+  }
+  sim_put16(20, 40 + (now / 1000000000ULL) % 3); /* Temperature */
+  sim->regs[1028] = sim->wdog_expired << 7;
+}
+
+static void sim_init(void) {
+  const char *path = getenv("SILABS_SIM_STATE");
+  const char *board = getenv("SILABS_SIM_BOARD");
+  const char *e;
+  const struct sim_board *b;
+  uint64_t now = sim_ns();
+  int i;
+
+  e = getenv("SILABS_SIM_KHZ");
+  sim_khz = e ? atoi(e) : 100;
+  e = getenv("SILABS_SIM_TAU_MS");
+  sim_tau_ms = e ? atof(e) : 30000;
+  e = getenv("SILABS_SIM_POWERFAIL_MS");
+  if (e)
+    sim_pf_ns = now + (uint64_t)(atof(e) * 1e6);
+  e = getenv("SILABS_SIM_LOAD_MV_S");
+  sim_load_mv_s = e ? atof(e) : 600;
+  if (getenv("SILABS_SIM_STATS"))
+    atexit(sim_report);
+
+  if (path) {
+    sim_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  } else {
+    char tmp[] = "/tmp/silabs-sim.XXXXXX";
+
+    sim_fd = mkstemp(tmp);
+    if (sim_fd >= 0)
+      unlink(tmp);
+  }
+  if (sim_fd < 0 || ftruncate(sim_fd, sizeof(*sim)) < 0) {
+    perror(path ? path : "silabs sim state");
+    exit(1);
+  }
+  sim = mmap(NULL, sizeof(*sim), PROT_READ | PROT_WRITE, MAP_SHARED, sim_fd, 0);
+  if (sim == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+
+  flock(sim_fd, LOCK_EX);
+  if (sim->magic != SIM_MAGIC) {
+    memset(sim, 0, sizeof(*sim));
+    for (i = 0; i < sizeof(sim_boards) / sizeof(sim_boards[0]); i++)
+      if (board && strstr(sim_boards[i].build, board))
+        sim->board = i;
+    b = &sim_boards[sim->board];
+    strcpy((char *)&sim->regs[4096], b->build);
+    sim->regs[b->ver_subadr] = b->ver;
+    sim->regs[22] = b->scaps ? 2 : 0; /* Supercaps enabled */
+    sim_put16(24, 200);
+    sim_put16(26, 200);
+    if (b->mac)
+      for (i = 0; i < 6; i++)
+        sim->regs[28 + i] = i ? 0x10 + i : 0x00;
+    sim->caps_v0 = sim->caps_boot_mv = 2000;
+    sim->caps_t0_ns = now;
+    sim->magic = SIM_MAGIC;
+  }
+  flock(sim_fd, LOCK_UN);
+}
+
+/* Time on the wire: 9 clocks a byte (data + ack), start and stop */
+static void sim_transfer(int bytes, int starts) {
+  uint64_t ns = 0;
+  struct timespec ts;
+
+  if (sim_khz) {
+    ns = (uint64_t)(bytes * 9 + starts + 1) * 1000000ULL / sim_khz;
+    ts.tv_sec = ns / 1000000000ULL;
+    ts.tv_nsec = ns % 1000000000ULL;
+    nanosleep(&ts, NULL);
+  }
+  sim_transfers++;
+  sim_bytes += bytes;
+  sim_bus_ns += ns;
+  sim->transfers++;
+  sim->bytes += bytes;
+  sim->bus_ns += ns;
+}
+
+/* The cross-process lock is taken on this fd, so processes sharing a state
+ * file are ordered like processes sharing a real bus */
+static int silab_bus_open(struct silab *s) {
+  if (!sim)
+    sim_init();
+  return dup(sim_fd);
+}
+
+static int8_t i2c_eeprom_read(struct silab *s, uint16_t subadr, uint8_t *buf,
+                              int len) {
+  if (!sim || subadr + len > sizeof(sim->regs))
+    return 1;
+  sim_update(sim_ns());
+  memcpy(buf, &sim->regs[subadr], len);
+  /* Address + 2 subaddress bytes, repeated start, address + data */
+  sim_transfer(4 + len, 2);
+  return 0;
+}
+
+#define SILAB_HAVE_READV
+static int8_t i2c_eeprom_readv(struct silab *s, const struct silab_region *r,
+                               int n) {
+  int i, bytes = 0;
+
+  if (!sim)
+    return 1;
+  sim_update(sim_ns());
+  for (i = 0; i < n; i++) {
+    if (r[i].subadr + r[i].len > sizeof(sim->regs))
+      return 1;
+    memcpy(r[i].buf, &sim->regs[r[i].subadr], r[i].len);
+    bytes += 4 + r[i].len;
+  }
+  sim_transfer(bytes, n * 2);
+  return 0;
+}
+
+static int8_t i2c_eeprom_write(struct silab *s, uint16_t subadr, uint8_t *buf,
+                               int len) {
+  uint64_t now = sim_ns();
+  uint8_t keep;
+  int i;
+
+  if (!sim || subadr + len > sizeof(sim->regs) || subadr >= 2048)
+    return 1;
+  sim_update(now);
+  sim_transfer(3 + len, 1);
+
+  if (subadr == 1024 && len == 5) { /* Watchdog/sleep command */
+    uint32_t t = buf[0] | (buf[1] << 8) | (buf[2] << 16) | (buf[3] << 24);
+
+    memcpy(&sim->regs[1024], buf, 4);
+    if (buf[4] == 1) {
+      sim->wdog_ms = t * 10;
+      sim->wdog_fed_ns = now;
+      if (t)
+        sim->regs[22] |= 1 << 6;
+      else
+        sim->regs[22] &= ~(1 << 6);
+    } else if (buf[4] == 2) { /* Sleep, then power up: watchdog is off */
+      sim->sleeps++;
+      sim->regs[22] &= ~(1 << 6);
+    }
+    return 0;
+  }
+  if (subadr == 1028) { /* Feed */
+    sim->wdog_fed_ns = now;
+    return 0;
+  }
+
+  for (i = 0; i < len; i++) {
+    uint16_t a = subadr + i;
+
+    if (a < 22)
+      continue; /* Analog block is read only */
+    if (a == 22) {
+      /* Only the scaps enable is writable, the rest is status */
+      keep = sim->regs[22] & ~2;
+      if ((sim->regs[22] ^ buf[i]) & 2) {
+        sim_caps_rebase(now);
+        sim->regs[22] = keep | (buf[i] & 2);
+      }
+      continue;
+    }
+    if (a == 26 || a == 27)
+      sim_caps_rebase(now);
+    sim->regs[a] = buf[i];
+  }
+  return 0;
+}
+
+/* Return -1 to abort */
+static int wait_hook(int pct, int eta_s, int sleep_ms) {
+  if (isatty(0))
+    inform_human_of_progress("Waiting on supercaps charging...", pct, eta_s);
+  if (sleep_ms)
+    usleep(sleep_ms * 1000);
+  return 0;
+}
+
+#ifndef SILABS_NO_MAIN
+int main(int argc, char *const argv[]) {
+  setvbuf(stdout, NULL, _IONBF, 0);
+  return silab_cmd(argc, argv);
+}
+#endif
@@ -0,0 +1,221 @@
+/* I2C transfer accounting, built with ./configure --enable-i2c-stats
+ * (SILAB_STATS).  Included from silabs.c ahead of the register level API,
+ * which calls the hooks through silab_xfer_*().  Without SILAB_STATS those
+ * are the hooks themselves.
+ *
+ * Counts transfers, bytes and errors per subaddress, and keeps a log2
+ * histogram of transfer times from CLOCK_MONOTONIC.  'silabs --stats <CMD>'
+ * prints the summary to stderr after the command.  SILABS_TRACE=<file>
+ * appends one struct silab_trace per transfer (host byte order) for
+ * offline analysis. */
+
+#define SILAB_OP_READ 0
+#define SILAB_OP_WRITE 1
+#define SILAB_OP_READV 2 /* One record per region, same t_ns */
+
+struct silab_trace {
+  uint64_t t_ns;   /* CLOCK_MONOTONIC at the start of the transfer */
+  uint32_t dur_ns; /* Whole transfer, all regions of a readv */
+  uint32_t pid;
+  uint16_t subadr;
+  uint16_t len;
+  uint8_t op;
+  uint8_t err;
+  uint8_t adr;
+  uint8_t pad;
+};
+
+#define SILAB_STAT_SLOTS 64 /* Distinct subaddresses, plenty for the map */
+#define SILAB_STAT_BUCKETS 24
+
+struct silab_stat_slot {
+  uint32_t key; /* subadr + 1, 0 is free */
+  uint32_t reads, writes, errors;
+  uint64_t rd_bytes, wr_bytes;
+};
+
+/* Transfers of every context, updated with atomics since contexts on
+ * different buses do not share a lock */
+static struct {
+  struct silab_stat_slot slot[SILAB_STAT_SLOTS];
+  uint32_t transfers, errors, overflow;
+  uint64_t bytes, ns;
+  uint32_t hist[SILAB_STAT_BUCKETS]; /* [2^(k-1), 2^k) us */
+} silab_stats;
+
+#define SILAB_ADD(p, v) __atomic_fetch_add(p, v, __ATOMIC_RELAXED)
+
+static pthread_mutex_t silab_trace_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct silab_trace silab_trace_buf[256];
+static int silab_trace_n, silab_trace_fd = -2; /* -2 not checked yet */
+
+/* With silab_trace_mtx held.  O_APPEND keeps whole buffers of several
+ * processes tracing to one file apart. */
+static void silab_trace_write(void) {
+  if (silab_trace_fd >= 0 && silab_trace_n &&
+      write(silab_trace_fd, silab_trace_buf,
+            silab_trace_n * sizeof(silab_trace_buf[0])) < 0)
+    perror("SILABS_TRACE");
+  silab_trace_n = 0;
+}
+
+static void silab_trace_flush(void) {
+  pthread_mutex_lock(&silab_trace_mtx);
+  silab_trace_write();
+  pthread_mutex_unlock(&silab_trace_mtx);
+}
+
+static void silab_trace(const struct silab *s, uint64_t t0, uint32_t dur,
+                        int op, uint16_t subadr, int len, int err) {
+  struct silab_trace *t;
+
+  if (silab_trace_fd == -2) {
+    const char *path = getenv("SILABS_TRACE");
+
+    pthread_mutex_lock(&silab_trace_mtx);
+    if (silab_trace_fd == -2) {
+      silab_trace_fd = -1;
+      if (path) {
+        silab_trace_fd =
+            open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+        if (silab_trace_fd < 0)
+          perror(path);
+        else
+          atexit(silab_trace_flush);
+      }
+    }
+    pthread_mutex_unlock(&silab_trace_mtx);
+  }
+  if (silab_trace_fd < 0)
+    return;
+
+  pthread_mutex_lock(&silab_trace_mtx);
+  t = &silab_trace_buf[silab_trace_n++];
+  memset(t, 0, sizeof(*t));
+  t->t_ns = t0;
+  t->dur_ns = dur;
+  t->pid = getpid();
+  t->subadr = subadr;
+  t->len = len;
+  t->op = op;
+  t->err = err != 0;
+  t->adr = s->adr;
+  if (silab_trace_n == sizeof(silab_trace_buf) / sizeof(silab_trace_buf[0]))
+    silab_trace_write();
+  pthread_mutex_unlock(&silab_trace_mtx);
+}
+
+static struct silab_stat_slot *silab_stat_slot(uint16_t subadr) {
+  uint32_t key = subadr + 1, expect = 0;
+  int i;
+
+  for (i = 0; i < SILAB_STAT_SLOTS; i++) {
+    struct silab_stat_slot *sl = &silab_stats.slot[i];
+
+    if (sl->key == key)
+      return sl;
+    if (sl->key == 0 &&
+        (__atomic_compare_exchange_n(&sl->key, &expect, key, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED) ||
+         expect == key))
+      return sl;
+    expect = 0;
+  }
+  SILAB_ADD(&silab_stats.overflow, 1);
+  return NULL;
+}
+
+static void silab_stat_region(int op, uint16_t subadr, int len, int err) {
+  struct silab_stat_slot *sl = silab_stat_slot(subadr);
+
+  if (!sl)
+    return;
+  if (err)
+    SILAB_ADD(&sl->errors, 1);
+  else if (op == SILAB_OP_WRITE) {
+    SILAB_ADD(&sl->writes, 1);
+    SILAB_ADD(&sl->wr_bytes, len);
+  } else {
+    SILAB_ADD(&sl->reads, 1);
+    SILAB_ADD(&sl->rd_bytes, len);
+  }
+}
+
+static void silab_stat_xfer(uint64_t t0, int bytes, int err) {
+  uint64_t ns = silab_ns() - t0;
+  uint32_t us = ns / 1000;
+  int k = 0;
+
+  while (k < SILAB_STAT_BUCKETS - 1 && (us >> k))
+    k++;
+  SILAB_ADD(&silab_stats.hist[k], 1);
+  SILAB_ADD(&silab_stats.transfers, 1);
+  SILAB_ADD(&silab_stats.bytes, bytes);
+  SILAB_ADD(&silab_stats.ns, ns);
+  if (err)
+    SILAB_ADD(&silab_stats.errors, 1);
+}
+
+static int8_t silab_xfer_read(struct silab *s, uint16_t subadr, uint8_t *buf,
+                              int len) {
+  uint64_t t0 = silab_ns();
+  int8_t r = i2c_eeprom_read(s, subadr, buf, len);
+
+  silab_stat_xfer(t0, len, r);
+  silab_stat_region(SILAB_OP_READ, subadr, len, r);
+  silab_trace(s, t0, silab_ns() - t0, SILAB_OP_READ, subadr, len, r);
+  return r;
+}
+
+static int8_t silab_xfer_write(struct silab *s, uint16_t subadr, uint8_t *buf,
+                               int len) {
+  uint64_t t0 = silab_ns();
+  int8_t r = i2c_eeprom_write(s, subadr, buf, len);
+
+  silab_stat_xfer(t0, len, r);
+  silab_stat_region(SILAB_OP_WRITE, subadr, len, r);
+  silab_trace(s, t0, silab_ns() - t0, SILAB_OP_WRITE, subadr, len, r);
+  return r;
+}
+
+static int8_t silab_xfer_readv(struct silab *s, const struct silab_region *r,
+                               int n) {
+  uint64_t t0 = silab_ns(), dur;
+  int8_t ret = i2c_eeprom_readv(s, r, n);
+  int i, bytes = 0;
+
+  dur = silab_ns() - t0;
+  for (i = 0; i < n; i++) {
+    bytes += r[i].len;
+    silab_stat_region(SILAB_OP_READV, r[i].subadr, r[i].len, ret);
+    silab_trace(s, t0, dur, SILAB_OP_READV, r[i].subadr, r[i].len, ret);
+  }
+  silab_stat_xfer(t0, bytes, ret);
+  return ret;
+}
+
+static void silab_stats_print(FILE *f) {
+  int i, k;
+
+  fprintf(f, "I2C: %u transfers, %llu bytes, %llu us (%u errors)\n",
+          silab_stats.transfers, (unsigned long long)silab_stats.bytes,
+          (unsigned long long)(silab_stats.ns / 1000), silab_stats.errors);
+  if (!silab_stats.transfers)
+    return;
+  fprintf(f, "subadr   reads  writes  rd_bytes  wr_bytes  errors\n");
+  for (i = 0; i < SILAB_STAT_SLOTS; i++) {
+    const struct silab_stat_slot *sl = &silab_stats.slot[i];
+
+    if (sl->key)
+      fprintf(f, "%6u  %6u  %6u  %8llu  %8llu  %6u\n", sl->key - 1, sl->reads,
+              sl->writes, (unsigned long long)sl->rd_bytes,
+              (unsigned long long)sl->wr_bytes, sl->errors);
+  }
+  if (silab_stats.overflow)
+    fprintf(f, "(%u transfers to further subaddresses not itemized)\n",
+            silab_stats.overflow);
+  fprintf(f, "transfer time   count\n");
+  for (k = 0; k < SILAB_STAT_BUCKETS; k++)
+    if (silab_stats.hist[k])
+      fprintf(f, "  < %7u us  %6u\n", 1u << k, silab_stats.hist[k]);
+}
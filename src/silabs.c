@@ -4,7 +4,28 @@
 #define MAX_CHARGE_MV 4800
 #define DEFAULT_WDOG_MS 60000
 
-long long silab_cmd(int argc, char *const argv[]);
+/* Built into another tool (SILABS_NO_MAIN), the entry points stay private
+ * to it, which may not call them all */
+#ifdef SILABS_NO_MAIN
+#define SILAB_API static __attribute__((unused))
+#else
+#define SILAB_API
+#endif
+
+SILAB_API long long silab_cmd(int argc, char *const argv[]);
+
+#if defined(__linux__) && !defined(__UBOOT__)
+#define SILAB_LINUX /* Long running modes in silabs-linux.c */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* syncfs() */
+#endif
+#endif
+
+#ifdef SILAB_LINUX
+#include "tsprobes.h"
+#else
+#define TS_PROBE1(name, a)
+#endif
 
 /* clang-format off */
 #define SILAB_HELP                                                                 \
@@ -24,9 +45,10 @@ long long silab_cmd(int argc, char *const argv[]);
 "  scaps default disable      Sets supercaps to be default disabled on bootup\n"   \
 "  scaps current <N>          Sets supercaps charging current in N milliamps\n"    \
 "  scaps current default <N>  Sets default charging current to N milliamps\n"      \
-"  scaps wait                 Blocks until supercaps reach minimum charge\n"       \
-"  scaps wait full            Blocks until supercaps reach max charge\n"           \
-"  scaps wait pct <N>         Blocks until scaps reach (max-min)*N/100+min\n"      \
+"  scaps wait [T]             Blocks until supercaps reach minimum charge\n"       \
+"  scaps wait full [T]        Blocks until supercaps reach max charge\n"           \
+"  scaps wait pct <N> [T]     Blocks until scaps reach (max-min)*N/100+min\n"      \
+"                             With T, gives up after T ms, errorlevel 2\n"         \
 "  scaps pct <N>              Exits errorlevel 1 if scaps at N %\n"                \
 "  usb                        Exits errorlevel 1 if USB console connected\n"       \
 "  flags <N>                  Exits errorlevel 1 if uC flash flag N set\n"         \
@@ -34,15 +56,84 @@ long long silab_cmd(int argc, char *const argv[]);
 "  flags clear <N>            Clears uC flash flag N\n"                            \
 "  fan enable                 Turns on fan\n"                                      \
 "  fan disable                Turns off fan\n"
+
+#define SILAB_HELP_LINUX                                                           \
+"  monitor [rate <Hz>] [decimate <N>] [prom <file>] [count <N>]\n"                 \
+"                             Samples analog channels at <Hz>, prints min/max/\n"  \
+"                             mean of every <N> samples as JSON lines, or\n"       \
+"                             atomically replaces a Prometheus textfile\n"         \
+"  wdog daemon <N> [fraction <F>] [rt <prio>] [health <file>] [maxage <ms>]\n"     \
+"              [nowayout 1]   Arms watchdog for N ms and feeds it every N/F ms\n"  \
+"                             (default F=3), optionally SCHED_FIFO.  Stops\n"      \
+"                             feeding while <file> is older than maxage.\n"        \
+"                             SIGUSR1 prints latency/jitter histograms\n"          \
+"  powerfail [rate <Hz>] [confirm <N>] [hook <cmd>] [hookms <ms>]\n"               \
+"            [sync <path,..>] [remount <path,..>] [reserve <mV>] [rt <prio>]\n"    \
+"            [dryrun 1]       Polls for input power loss, then runs hook,\n"       \
+"                             syncs, remounts read-only and powers off\n"          \
+"  history record <file> [rate <Hz>] [size <KiB>] [deadband <N>] [flush <s>]\n"    \
+"                             Records analog channels and ctl into a ring\n"       \
+"                             file of delta encoded pages, rewriting the\n"        \
+"                             current page every <s> seconds\n"                    \
+"  history query <file> [from <t>] [to <t>] [expand 1]\n"                          \
+"                             Prints recorded samples as CSV, <t> in unix\n"       \
+"                             seconds or negative for relative to now\n"           \
+"  fan auto [on <C>] [off <C>] [dwell <s>] [stall <mA>] [rate <Hz>]\n"             \
+"           [interval <N>] [log <file>]\n"                                         \
+"                             Switches the fan on/off by uC temperature with\n"    \
+"                             hysteresis and minimum dwell, detects a stalled\n"   \
+"                             fan, logs JSON lines with duty cycle and temp\n"     \
+"  batch <CMD> ... | batch -f <file>\n"                                            \
+"                             Runs each CMD (argument, or line of <file>,\n"       \
+"                             - for stdin) in one process, merging\n"              \
+"                             updates of a register into one read and\n"           \
+"                             one write, watchdog last\n"                          \
+"  --stats <CMD> ...          Runs CMD, then prints I2C transfer counts and\n"     \
+"                             times (./configure --enable-i2c-stats)\n"            \
+"  --bus <N> --adr <A> <CMD>  Runs CMD on the uC at address A on\n"                \
+"                             /dev/i2c-N (default 0 and 0x54)\n"
 /* clang-format on */
 
+#ifdef SILAB_LINUX
+static const char *silab_help = SILAB_HELP SILAB_HELP_LINUX;
+#else
 static const char *silab_help = SILAB_HELP;
+#endif
 
 /* Helper function for wait_hook() porting layer impl */
-static void inform_human_of_progress(const char *msg, int pct);
-
-#if defined(__linux__) && !defined(__UBOOT__)
+static void inform_human_of_progress(const char *msg, int pct, int eta_s);
+
+/* One register range of a multi-range read.  Plain C types, this is
+ * declared ahead of the porting layer's headers. */
+struct silab_region {
+  unsigned short subadr;
+  unsigned char *buf;
+  int len;
+};
+
+/* Handle on one uC.  Everything that used to be a file global lives here so
+ * several threads, or several uCs, can use the API at once.  The port keeps
+ * its lock state behind 'port' (see silab_port_lock()). */
+struct silab {
+  int bus;           /* /dev/i2c-<bus> on Linux, i2c_set_bus_num() on U-Boot */
+  unsigned char adr; /* 7 bit address */
+  int fd;            /* Linux, opened on first use */
+  int depth;         /* Lock nesting of the owning thread */
+  unsigned char board_id[8]; /* Start of the uC build string at 4096 */
+  unsigned char board_id_valid;
+  unsigned char wdog_init;
+  volatile unsigned char wdog_feed_pending; /* Set from signal handlers */
+  void *port;
+};
+
+#define SILAB_PRIO_NORMAL 0
+#define SILAB_PRIO_WDOG 1 /* Goes ahead of waiting normal transfers */
+
+/* SILABS_PORT selects silabs-port.c even where a built-in port exists, e.g.
+ * the simulator on Linux */
+#if defined(__linux__) && !defined(__UBOOT__) && !defined(SILABS_PORT)
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <linux/i2c-dev.h>
 #include <linux/i2c.h>
@@ -53,6 +144,9 @@ static void inform_human_of_progress(const char *msg, int pct);
 #include <sys/ioctl.h>
 #include <unistd.h>
 
+/* Defining SILABS_NO_MAIN turns this file into a library for other tools
+ * to #include, the way set_uart_baud.c is shared */
+#ifndef SILABS_NO_MAIN
 int main(int argc, char *const argv[]) {
   // static const char *wdog_feed[] = {"silab", "wdog", "feed"};
   // return silab_cmd(3, wdog_feed);
@@ -60,31 +154,41 @@ int main(int argc, char *const argv[]) {
   setvbuf(stdout, NULL, _IONBF, 0);
   return silab_cmd(argc, argv);
 }
+#endif
+
+/* Called with the context locked, returns the fd the hooks use (and the
+ * cross-process lock is taken on) or -1 */
+static int silab_bus_open(struct silab *s) {
+  char dev[32];
+  int fd;
+
+  snprintf(dev, sizeof(dev), "/dev/i2c-%d", s->bus);
+  fd = open(dev, O_RDWR | O_CLOEXEC);
+  if (fd == -1)
+    perror(dev);
+  return fd;
+}
 
-static int i2c_fd = -1;
-static int8_t i2c_eeprom_read(uint8_t adr, uint16_t subadr, uint8_t *buf,
+/* The hooks run with the context locked, which also opened the bus */
+static int8_t i2c_eeprom_read(struct silab *s, uint16_t subadr, uint8_t *buf,
                               int len) {
   struct i2c_rdwr_ioctl_data packets;
   struct i2c_msg msgs[2];
   uint8_t busaddr[2];
+  int r;
 
-  if (i2c_fd == -1)
-    i2c_fd = open("/dev/i2c-0", O_RDWR);
-
-  if (i2c_fd == -1) {
-    perror("/dev/i2c-0");
+  if (s->fd == -1)
     return 1;
-  }
 
   busaddr[0] = ((subadr >> 8) & 0xff);
   busaddr[1] = (subadr & 0xff);
 
-  msgs[0].addr = adr;
+  msgs[0].addr = s->adr;
   msgs[0].flags = 0;
   msgs[0].len = 2;
   msgs[0].buf = busaddr;
 
-  msgs[1].addr = adr;
+  msgs[1].addr = s->adr;
   msgs[1].flags = I2C_M_RD;
   msgs[1].len = len;
   msgs[1].buf = buf;
@@ -92,40 +196,80 @@ static int8_t i2c_eeprom_read(uint8_t adr, uint16_t subadr, uint8_t *buf,
   packets.msgs = msgs;
   packets.nmsgs = 2;
 
-  return ioctl(i2c_fd, I2C_RDWR, &packets) < 0;
+  TS_PROBE2(i2c_read_start, subadr, len);
+  r = ioctl(s->fd, I2C_RDWR, &packets) < 0 ? errno : 0;
+  TS_PROBE3(i2c_read_done, subadr, len, r);
+  return r != 0;
 }
 
-static int8_t i2c_eeprom_write(uint8_t adr, uint16_t subadr, uint8_t *buf,
+/* Reads several register ranges with one I2C_RDWR, a repeated start
+ * between each.  Ports without this get a loop over i2c_eeprom_read(). */
+#define SILAB_HAVE_READV
+#define SILAB_READV_MAX (I2C_RDWR_IOCTL_MAX_MSGS / 2)
+static int8_t i2c_eeprom_readv(struct silab *s, const struct silab_region *r,
+                               int n) {
+  struct i2c_rdwr_ioctl_data packets;
+  struct i2c_msg msgs[SILAB_READV_MAX * 2];
+  uint8_t busaddr[SILAB_READV_MAX][2];
+  int i, len = 0, ret;
+
+  assert(n <= SILAB_READV_MAX);
+  if (s->fd == -1)
+    return 1;
+
+  for (i = 0; i < n; i++) {
+    busaddr[i][0] = (r[i].subadr >> 8) & 0xff;
+    busaddr[i][1] = r[i].subadr & 0xff;
+    msgs[i * 2].addr = s->adr;
+    msgs[i * 2].flags = 0;
+    msgs[i * 2].len = 2;
+    msgs[i * 2].buf = busaddr[i];
+    msgs[i * 2 + 1].addr = s->adr;
+    msgs[i * 2 + 1].flags = I2C_M_RD;
+    msgs[i * 2 + 1].len = r[i].len;
+    msgs[i * 2 + 1].buf = r[i].buf;
+    len += r[i].len;
+  }
+
+  packets.msgs = msgs;
+  packets.nmsgs = n * 2;
+  TS_PROBE2(i2c_readv_start, n, len);
+  ret = ioctl(s->fd, I2C_RDWR, &packets) < 0 ? errno : 0;
+  TS_PROBE3(i2c_readv_done, n, len, ret);
+  return ret != 0;
+}
+
+static int8_t i2c_eeprom_write(struct silab *s, uint16_t subadr, uint8_t *buf,
                                int len) {
   struct i2c_rdwr_ioctl_data packets;
   struct i2c_msg msg;
   uint8_t *buf2 = (uint8_t *)alloca(len + 2);
+  int r;
 
-  if (i2c_fd == -1)
-    i2c_fd = open("/dev/i2c-0", O_RDWR);
-  if (i2c_fd == -1) {
-    perror("/dev/i2c-0");
+  if (s->fd == -1)
     return 1;
-  }
 
   buf2[0] = subadr >> 8;
   buf2[1] = subadr & 0xff;
   memcpy(&buf2[2], buf, len);
-  msg.addr = adr;
+  msg.addr = s->adr;
   msg.flags = 0;
   msg.len = 2 + len;
   msg.buf = buf2;
   packets.msgs = &msg;
   packets.nmsgs = 1;
-  return ioctl(i2c_fd, I2C_RDWR, &packets) < 0;
+  TS_PROBE2(i2c_write_start, subadr, len);
+  r = ioctl(s->fd, I2C_RDWR, &packets) < 0 ? errno : 0;
+  TS_PROBE3(i2c_write_done, subadr, len, r);
+  return r != 0;
 }
 
 /* Return -1 to abort */
-static int wait_hook(int pct) {
+static int wait_hook(int pct, int eta_s, int sleep_ms) {
   if (isatty(0))
-    inform_human_of_progress("Waiting on supercaps charging...", pct);
-  if (pct != -1)
-    usleep(100000);
+    inform_human_of_progress("Waiting on supercaps charging...", pct, eta_s);
+  if (sleep_ms)
+    usleep(sleep_ms * 1000);
   return 0;
 }
 
@@ -145,22 +289,22 @@ static int do_silabs(cmd_tbl_t *cmdtp, int flags, int argc,
 
 U_BOOT_CMD(silabs, 5, 0, do_silabs, "Silabs management utility", SILAB_HELP);
 
-static int8_t i2c_eeprom_read(uint8_t adr, uint16_t subadr, uint8_t *buf,
+static int8_t i2c_eeprom_read(struct silab *s, uint16_t subadr, uint8_t *buf,
                               int len) {
-  i2c_set_bus_num(0);
-  return i2c_read(adr, subadr, 2, buf, len);
+  i2c_set_bus_num(s->bus);
+  return i2c_read(s->adr, subadr, 2, buf, len);
 }
 
-static int8_t i2c_eeprom_write(uint8_t adr, uint16_t subadr, uint8_t *buf,
+static int8_t i2c_eeprom_write(struct silab *s, uint16_t subadr, uint8_t *buf,
                                int len) {
-  i2c_set_bus_num(0);
-  return i2c_write(adr, subadr, 2, buf, len);
+  i2c_set_bus_num(s->bus);
+  return i2c_write(s->adr, subadr, 2, buf, len);
 }
 
-static int wait_hook(int pct) {
-  inform_human_of_progress("Waiting on supercaps charging...", pct);
-  if (pct != -1)
-    udelay(100000);
+static int wait_hook(int pct, int eta_s, int sleep_ms) {
+  inform_human_of_progress("Waiting on supercaps charging...", pct, eta_s);
+  if (sleep_ms)
+    udelay(sleep_ms * 1000);
   if (ctrlc()) {
     puts("\n");
     return 1;
@@ -168,7 +312,7 @@ static int wait_hook(int pct) {
     return 0;
 }
 
-#elif defined(__WATCOMC__)
+#elif defined(__WATCOMC__) && !defined(SILABS_PORT)
 #include <assert.h>
 #include <bios.h>
 #include <conio.h>
@@ -261,20 +405,21 @@ static int8_t i2c_write(uint8_t adr, uint8_t *buf, int len) {
   return 0;
 }
 
-static int8_t i2c_eeprom_read(uint8_t adr, uint16_t subadr, uint8_t *buf,
+static int8_t i2c_eeprom_read(struct silab *s, uint16_t subadr, uint8_t *buf,
                               int len) {
   uint8_t sa[2];
 
   sa[0] = subadr >> 8;
   sa[1] = subadr & 0xff;
-  if (i2c_write(adr, sa, 2) == -1)
+  if (i2c_write(s->adr, sa, 2) == -1)
     return -1;
 
-  return i2c_read(adr, buf, len);
+  return i2c_read(s->adr, buf, len);
 }
 
-static int8_t i2c_eeprom_write(uint8_t adr, uint16_t subadr, uint8_t *buf,
+static int8_t i2c_eeprom_write(struct silab *s, uint16_t subadr, uint8_t *buf,
                                int len) {
+  uint8_t adr = s->adr;
   int i;
   uint8_t r;
   uint8_t sa[2];
@@ -306,12 +451,12 @@ static int8_t i2c_eeprom_write(uint8_t adr, uint16_t subadr, uint8_t *buf,
   return 0;
 }
 
-static int wait_hook(int pct) {
+static int wait_hook(int pct, int eta_s, int sleep_ms) {
   unsigned short c;
 
-  inform_human_of_progress("Waiting on supercaps charging...", pct);
-  if (pct != -1)
-    delay(100);
+  inform_human_of_progress("Waiting on supercaps charging...", pct, eta_s);
+  if (sleep_ms)
+    delay(sleep_ms);
   if (c = _bios_keybrd(_KEYBRD_READY)) {
     _bios_keybrd(_KEYBRD_READ);
     if (c == 3)
@@ -343,188 +488,412 @@ int main(int argc, char **argv) {
 
 #else /* Use external porting layer hooks in silabs-port.c */
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-static int wait_hook(int pct); /* pct == -1 for end */
-static int8_t i2c_eeprom_read(uint8_t adr, uint16_t subadr, uint8_t *buf,
+/* Shows progress and sleeps sleep_ms, returns nonzero to abort.  pct < 0
+ * for end (-1 reached, -2 timed out), eta_s < 0 if unknown */
+static int wait_hook(int pct, int eta_s, int sleep_ms);
+static int8_t i2c_eeprom_read(struct silab *s, uint16_t subadr, uint8_t *buf,
                               int len);
-static int8_t i2c_eeprom_write(uint8_t adr, uint16_t subadr, uint8_t *buf,
+static int8_t i2c_eeprom_write(struct silab *s, uint16_t subadr, uint8_t *buf,
                                int len);
 
-/* silabs-port.c should contain implementations of the above 3 functions */
+/* silabs-port.c should contain implementations of the above 3 functions,
+ * and main() if it is a program.  It may also provide i2c_eeprom_readv()
+ * (define SILAB_HAVE_READV).  On Linux it must provide silab_bus_open(). */
 #include "silabs-port.c"
 #endif
 
-/* Assumes being called 10 times per second for purpose of computing ETAs */
-static void inform_human_of_progress(const char *msg, int pct) {
-  static int projected_end = 0, n = 0, pending = 0, last_pct = 0;
-  static char *seq = "-\\|/";
+#ifdef SILAB_LINUX
+/* Locking is the OS's business, not the bus backend's: any port on Linux
+ * gets it */
+#include <errno.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <time.h>
+
+struct silab_lock_stats {
+  uint32_t locks;     /* Outermost acquisitions */
+  uint32_t contended; /* ... that had to wait for another thread */
+  uint32_t wdog_ahead; /* Watchdog feeds that went ahead of waiters */
+  uint64_t wait_ns, wait_max_ns;
+  uint64_t hold_ns, hold_max_ns;
+};
+
+/* Threads in the process queue on the mutex, with watchdog feeds ahead of
+ * everyone else.  The owner then takes flock() on the bus fd, which orders
+ * it against other processes (monitor vs. wdog daemon), first come first
+ * served. */
+struct silab_linux {
+  pthread_mutex_t mtx;
+  pthread_cond_t cv;
+  pthread_t owner;
+  volatile int owned;
+  int waiting, wdog_waiting;
+  uint64_t locked_at;
+  struct silab_lock_stats st;
+};
+
+#define SILAB_HAVE_LOCK
+static struct silab_linux silab_default_port = {PTHREAD_MUTEX_INITIALIZER,
+                                                PTHREAD_COND_INITIALIZER};
+#define SILAB_DEFAULT_PORT (&silab_default_port)
+
+static uint64_t silab_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-  if (!pending && pct == -1)
+static int silab_port_init(struct silab *s) {
+  struct silab_linux *p = calloc(1, sizeof(*p));
+
+  if (!p)
+    return -1;
+  pthread_mutex_init(&p->mtx, NULL);
+  pthread_cond_init(&p->cv, NULL);
+  s->port = p;
+  return 0;
+}
+
+static void silab_port_free(struct silab *s) {
+  struct silab_linux *p = s->port;
+
+  if (s->fd >= 0)
+    close(s->fd);
+  s->fd = -1;
+  if (p == &silab_default_port)
     return;
+  pthread_mutex_destroy(&p->mtx);
+  pthread_cond_destroy(&p->cv);
+  free(p);
+  s->port = NULL;
+}
 
-  if (pending && pct == -1)
-    printf("\r%s... done         \n", msg);
-  else if (0 == (n & 0x7)) {
-    int n_to_go;
-    if (pct > last_pct) {
-      last_pct = pct;
-      projected_end = n + ((100 - pct) * n) / pct;
-    }
-    if (projected_end < n)
-      n_to_go = 0;
+static int silab_port_owner(struct silab *s) {
+  struct silab_linux *p = s->port;
+
+  return p->owned && pthread_equal(p->owner, pthread_self());
+}
+
+static void silab_port_lock(struct silab *s, int prio) {
+  struct silab_linux *p = s->port;
+  uint64_t t0 = silab_ns(), t1;
+
+  pthread_mutex_lock(&p->mtx);
+  if (p->owned || (prio == SILAB_PRIO_NORMAL && p->wdog_waiting)) {
+    p->st.contended++;
+    if (prio == SILAB_PRIO_WDOG) {
+      if (p->waiting)
+        p->st.wdog_ahead++;
+      p->wdog_waiting++;
+    } else
+      p->waiting++;
+    while (p->owned || (prio == SILAB_PRIO_NORMAL && p->wdog_waiting))
+      pthread_cond_wait(&p->cv, &p->mtx);
+    if (prio == SILAB_PRIO_WDOG)
+      p->wdog_waiting--;
     else
-      n_to_go = projected_end - n;
-    printf("\r%s... %3d%% [%d:%02d] %c \x08", msg, pct, n_to_go / 600,
-           n_to_go % 600 / 10, seq[n & 3]);
-  } else
-    printf("\x08%c", seq[n & 3]);
+      p->waiting--;
+  }
+  p->owner = pthread_self();
+  p->owned = 1;
+
+  if (s->fd == -1)
+    s->fd = silab_bus_open(s);
+  pthread_mutex_unlock(&p->mtx);
+
+  if (s->fd >= 0)
+    while (flock(s->fd, LOCK_EX) < 0 && errno == EINTR)
+      ;
+  t1 = silab_ns();
+  p->locked_at = t1;
+  p->st.locks++;
+  p->st.wait_ns += t1 - t0;
+  if (t1 - t0 > p->st.wait_max_ns)
+    p->st.wait_max_ns = t1 - t0;
+}
 
+static void silab_port_unlock(struct silab *s) {
+  struct silab_linux *p = s->port;
+  uint64_t held = silab_ns() - p->locked_at;
+
+  p->st.hold_ns += held;
+  if (held > p->st.hold_max_ns)
+    p->st.hold_max_ns = held;
+  if (s->fd >= 0)
+    flock(s->fd, LOCK_UN);
+
+  pthread_mutex_lock(&p->mtx);
+  p->owned = 0;
+  pthread_cond_broadcast(&p->cv);
+  pthread_mutex_unlock(&p->mtx);
+}
+
+/* Snapshot of the lock counters */
+static void silab_lock_stats(struct silab *s, struct silab_lock_stats *st) {
+  struct silab_linux *p = s->port;
+
+  pthread_mutex_lock(&p->mtx);
+  *st = p->st;
+  pthread_mutex_unlock(&p->mtx);
+}
+#endif
+
+#ifndef SILAB_HAVE_READV
+static int8_t i2c_eeprom_readv(struct silab *s, const struct silab_region *r,
+                               int n) {
+  int i;
+
+  for (i = 0; i < n; i++)
+    if (i2c_eeprom_read(s, r[i].subadr, r[i].buf, r[i].len))
+      return 1;
+  return 0;
+}
+#endif
+
+#ifndef SILAB_HAVE_LOCK
+/* Single threaded ports: the nesting count in the context is the lock */
+static int silab_port_init(struct silab *s) { return 0; }
+static void silab_port_free(struct silab *s) {}
+static int silab_port_owner(struct silab *s) { return s->depth != 0; }
+static void silab_port_lock(struct silab *s, int prio) {}
+static void silab_port_unlock(struct silab *s) {}
+#define SILAB_DEFAULT_PORT NULL
+#endif
+
+/* The context silab_cmd() and silab_i2c_lock() work on */
+static struct silab silab_default = {0, 0x54, -1, 0, {0}, 0, 0, 0,
+                                     SILAB_DEFAULT_PORT};
+
+#ifdef SILAB_LINUX
+/* Sets up a context for the uC at adr on bus.  Release with silab_close(). */
+static int silab_open(struct silab *s, int bus, int adr) {
+  memset(s, 0, sizeof(*s));
+  s->bus = bus;
+  s->adr = adr;
+  s->fd = -1;
+  return silab_port_init(s);
+}
+
+static void silab_close(struct silab *s) {
+  assert(s->depth == 0);
+  silab_port_free(s);
+}
+#endif
+
+/* pct -1 ends the line with "done", -2 with "timed out" */
+static void inform_human_of_progress(const char *msg, int pct, int eta_s) {
+  static int n = 0, pending = 0;
+  static char *seq = "-\\|/";
+
+  if (pct < 0) {
+    if (pending)
+      printf("\r%s... %s         \n", msg, pct == -1 ? "done" : "timed out");
+    n = pending = 0;
+    return;
+  }
+
+  if (eta_s < 0)
+    printf("\r%s... %3d%% [-:--] %c \x08", msg, pct, seq[n & 3]);
+  else
+    printf("\r%s... %3d%% [%d:%02d] %c \x08", msg, pct, eta_s / 60,
+           eta_s % 60, seq[n & 3]);
   pending = 1;
   n++;
+}
+
+#ifdef SILAB_STATS
+#ifndef SILAB_LINUX
+#error "--enable-i2c-stats is Linux only"
+#endif
+#include "silabs-stats.c"
+#else
+#define silab_xfer_read i2c_eeprom_read
+#define silab_xfer_write i2c_eeprom_write
+#define silab_xfer_readv i2c_eeprom_readv
+#endif
+
+static void silab_wdog_feed_locked(struct silab *s);
 
-  if (pct == -1)
-    n = last_pct = pending = projected_end = 0;
+/* Recursive, so multi-step sequences (read-modify-write) hold the bus across
+ * their transfers.  The outermost lock takes the port lock, which on Linux
+ * orders threads and processes. */
+static void silab_lock(struct silab *s, int prio) {
+  if (silab_port_owner(s)) {
+    assert(s->depth < 128); /* Over 128 deep I don't think so... */
+    s->depth++;
+    return;
+  }
+  silab_port_lock(s, prio);
+  s->depth = 1;
 }
 
-static volatile uint8_t busy = 0;
-static volatile uint8_t wdog_feed_pending = 0;
-static int8_t silab_outw(uint16_t subadr, uint16_t s) {
+static void silab_unlock(struct silab *s) {
+  assert(s->depth > 0); /* Unlock with no lock ? */
+  if (s->depth > 1) {
+    s->depth--;
+    return;
+  }
+  /* A feed requested while we held the bus goes out before anyone else */
+  if (s->wdog_feed_pending)
+    silab_wdog_feed_locked(s);
+  s->depth = 0;
+  silab_port_unlock(s);
+}
+
+/* The writes return 0, or 1 if the transfer failed, as the port hooks do.
+ * Not a negative errno: test them with if (r), not r < 0. */
+static int8_t silab_outw(struct silab *s, uint16_t subadr, uint16_t w) {
   int8_t r;
   uint8_t buf[2];
 
-  buf[0] = s >> 8;
-  buf[1] = s & 0xff;
-  /* Detects recursive call.  API is not async-safe except for wdog feed! */
-  assert(!busy);
-  busy = 1;
-  r = i2c_eeprom_write(0x54, subadr, buf, 2);
-  busy = 0;
+  buf[0] = w >> 8;
+  buf[1] = w & 0xff;
+  silab_lock(s, SILAB_PRIO_NORMAL);
+  r = silab_xfer_write(s, subadr, buf, 2);
+  silab_unlock(s);
   return r;
 }
 
-static int8_t silab_outb(uint16_t subadr, uint8_t b) {
+static int8_t silab_outb(struct silab *s, uint16_t subadr, uint8_t b) {
   int8_t r;
   uint8_t buf[1];
 
   buf[0] = b;
-  /* Detects recursive call.  API is not async-safe except for wdog feed! */
-  assert(!busy);
-  busy = 1;
-  r = i2c_eeprom_write(0x54, subadr, buf, 1);
-  busy = 0;
+  silab_lock(s, SILAB_PRIO_NORMAL);
+  r = silab_xfer_write(s, subadr, buf, 1);
+  silab_unlock(s);
   return r;
 }
 
-static int16_t silab_inb(uint16_t subadr) {
+static int16_t silab_inb(struct silab *s, uint16_t subadr) {
   int r;
   uint8_t buf[1];
 
-  /* Detects recursive call.  API is not async-safe except for wdog feed! */
-  assert(!busy);
-  busy = 1;
-  r = i2c_eeprom_read(0x54, subadr, buf, 1);
-  busy = 0;
-  if (r == -1)
+  silab_lock(s, SILAB_PRIO_NORMAL);
+  r = silab_xfer_read(s, subadr, buf, 1);
+  silab_unlock(s);
+  if (r)
     return -1;
   else
     return buf[0];
 }
 
-static int32_t silab_inw(uint16_t subadr) {
+static int32_t silab_inw(struct silab *s, uint16_t subadr) {
   int r;
   uint8_t buf[2];
 
-  /* Detects recursive call.  API is not async-safe except for wdog feed! */
-  assert(!busy);
-  busy = 1;
-  r = i2c_eeprom_read(0x54, subadr, buf, 2);
-  busy = 0;
-  if (r == -1)
+  silab_lock(s, SILAB_PRIO_NORMAL);
+  r = silab_xfer_read(s, subadr, buf, 2);
+  silab_unlock(s);
+  if (r)
     return -1;
   else
     return ((buf[0] << 8) | buf[1]);
 }
 
-static int silab_read(uint16_t subadr, uint8_t *buf, int len) {
+static int silab_read(struct silab *s, uint16_t subadr, uint8_t *buf,
+                      int len) {
   int r;
-  /* Detects recursive call.  API is not async-safe except for wdog feed! */
-  assert(!busy);
-  busy = 1;
-  r = i2c_eeprom_read(0x54, subadr, buf, len);
-  busy = 0;
+
+  silab_lock(s, SILAB_PRIO_NORMAL);
+  r = silab_xfer_read(s, subadr, buf, len);
+  silab_unlock(s);
   return r;
 }
 
-static int silab_write(uint16_t subadr, uint8_t *buf, int len) {
+static int silab_write(struct silab *s, uint16_t subadr, uint8_t *buf,
+                       int len) {
   int r;
-  /* Detects recursive call.  API is not async-safe except for wdog feed! */
-  assert(!busy);
-  busy = 1;
-  r = i2c_eeprom_write(0x54, subadr, buf, len);
-  busy = 0;
+
+  silab_lock(s, SILAB_PRIO_NORMAL);
+  r = silab_xfer_write(s, subadr, buf, len);
+  silab_unlock(s);
   return r;
 }
 
-static uint8_t silab_board_is(const char *board) {
-  static uint8_t buf[8];
-  static uint8_t d = 0;
+static int silab_readv(struct silab *s, const struct silab_region *r, int n) {
+  int ret;
+
+  silab_lock(s, SILAB_PRIO_NORMAL);
+  ret = silab_xfer_readv(s, r, n);
+  silab_unlock(s);
+  return ret;
+}
+
+static void silab_board_id_set(struct silab *s, const uint8_t *build) {
+  memcpy(s->board_id, build, sizeof(s->board_id));
+  s->board_id[sizeof(s->board_id) - 1] = 0;
+  s->board_id_valid = 1;
+}
+
+static uint8_t silab_board_is(struct silab *s, const char *board) {
+  uint8_t id[sizeof(s->board_id)];
   int r;
 
-  if (!d) {
-    d = 1;
-    r = silab_read(4096, buf, sizeof(buf));
+  silab_lock(s, SILAB_PRIO_NORMAL);
+  if (!s->board_id_valid) {
+    r = silab_read(s, 4096, id, sizeof(id));
     assert(r == 0);
-    buf[sizeof(buf) - 1] = 0;
+    silab_board_id_set(s, id);
   }
+  silab_unlock(s);
 
-  return strstr((char *)buf, board) == NULL ? 0 : 1;
+  return strstr((char *)s->board_id, board) == NULL ? 0 : 1;
 }
 
 /* Sets the current runtime scaps_en */
-static void silab_scaps_en(uint8_t val) {
+static void silab_scaps_en(struct silab *s, uint8_t val) {
   uint8_t ctl;
 
-  ctl = silab_inb(22);
+  silab_lock(s, SILAB_PRIO_NORMAL);
+  ctl = silab_inb(s, 22);
   ctl &= ~6;
   if (val)
     ctl |= 1 << 1;
-  silab_outb(22, ctl);
+  silab_outb(s, 22, ctl);
+  silab_unlock(s);
 }
 
-static void silab_fan_en(uint8_t val) { silab_outb(1024 + 8, val ? 0 : 1); }
+static void silab_fan_en(struct silab *s, uint8_t val) {
+  silab_outb(s, 1024 + 8, val ? 0 : 1);
+}
 
 /* Sets powerup/reboot default for scaps_en (does not effect current boot) */
-static void silab_scaps_default_en(uint8_t val) {
+static void silab_scaps_default_en(struct silab *s, uint8_t val) {
   uint8_t flags;
 
-  flags = silab_inb(23);
+  silab_lock(s, SILAB_PRIO_NORMAL);
+  flags = silab_inb(s, 23);
   if (val)
     flags &= ~1;
   else
     flags |= 1;
-  silab_outb(23, flags);
+  silab_outb(s, 23, flags);
+  silab_unlock(s);
 }
 
 /* returns int 0-100 (could be >100 too) */
-static uint8_t silab_scaps_charge_pct(void) {
-  uint32_t a;
-
-  a = silab_inw(16);
-  return (a * 100 / MAX_CHARGE_MV);
-}
+static uint8_t scaps_charge_pct(uint32_t mv) { return (mv * 100 / MAX_CHARGE_MV); }
 
 /* Stores the value in flash */
-static void silab_scaps_default_current(uint16_t ma) { silab_outw(24, ma); }
+static void silab_scaps_default_current(struct silab *s, uint16_t ma) {
+  silab_outw(s, 24, ma);
+}
 
 /* Temporary, for this current boot only. */
-static void silab_scaps_current(uint16_t ma) { silab_outw(26, ma); }
+static void silab_scaps_current(struct silab *s, uint16_t ma) {
+  silab_outw(s, 26, ma);
+}
 
 /* Returns 100% at MIN_CHARGE_MV and 0% for full charge */
-static uint8_t silab_scaps_discharge_pct(void) {
-  int32_t a, b;
+static uint8_t scaps_discharge_pct(int32_t a) {
+  int32_t b;
 
-  a = silab_inw(16);
   if (a <= MIN_CHARGE_MV)
     return 100;
   else
@@ -537,7 +906,7 @@ static uint8_t silab_scaps_discharge_pct(void) {
 }
 
 /* Sleeps CPU, FPGA, and uC.  About 13ma on 2/23/2018. */
-static void silab_sleep(uint32_t ms) {
+static void silab_sleep(struct silab *s, uint32_t ms) {
   uint8_t buf[5];
   if (ms % 10)
     ms = (ms / 10) + 1;
@@ -550,12 +919,11 @@ static void silab_sleep(uint32_t ms) {
   buf[3] = (ms >> 24) & 0xff;
   buf[4] = 2;
 
-  silab_write(1024, buf, 5);
+  silab_write(s, 1024, buf, 5);
 }
 
-static uint8_t wdog_init = 0;
 /* 0 ms disables */
-static void silab_wdog_set(uint32_t ms) {
+static void silab_wdog_set(struct silab *s, uint32_t ms) {
   uint8_t buf[5];
   if (ms % 10)
     ms = (ms / 10) + 1;
@@ -568,322 +936,432 @@ static void silab_wdog_set(uint32_t ms) {
   buf[3] = (ms >> 24) & 0xff;
   buf[4] = 1;
 
-  silab_write(1024, buf, 5);
-  wdog_init = 1;
+  silab_write(s, 1024, buf, 5);
+  s->wdog_init = 1;
 }
 
-/* Feeds for another interval (interval set via silab_wdog_set()) */
-static void silab_wdog_feed(void) {
-  if (!busy) {
-    if (!wdog_init) { /* If the wdog is being fed but has never been
-                         initialized, set it once to a reasonable
-                         default. */
-      uint8_t buf[4];
+/* With the bus held */
+static void silab_wdog_feed_locked(struct silab *s) {
+  int8_t r;
+
+  s->wdog_feed_pending = 0;
+  if (!s->wdog_init) { /* If the wdog is being fed but has never been
+                          initialized, set it once to a reasonable
+                          default. */
+    uint8_t buf[4];
 
-      wdog_init = 1;
-      silab_read(1024, buf, 4);
-      if (buf[0] == 0 && buf[1] == 0 && buf[2] == 0 && buf[3] == 0)
-        silab_wdog_set(DEFAULT_WDOG_MS);
-    }
+    s->wdog_init = 1;
+    silab_read(s, 1024, buf, 4);
+    if (buf[0] == 0 && buf[1] == 0 && buf[2] == 0 && buf[3] == 0)
+      silab_wdog_set(s, DEFAULT_WDOG_MS);
+  }
+  r = silab_outb(s, 1028, 1);
+  TS_PROBE1(wdog_feed, r);
+  (void)r;
+}
 
-    silab_outb(1028, 1);
-    wdog_feed_pending = 0;
-  } else
-    wdog_feed_pending = 1;
+/* Feeds for another interval (interval set via silab_wdog_set()).  Goes
+ * ahead of other threads waiting for the bus.  If this thread already holds
+ * the bus, the feed is sent when it is released.  This takes the bus lock,
+ * so it is not for signal handlers, see silab_wdog_feed_async(). */
+static void silab_wdog_feed(struct silab *s) {
+  if (silab_port_owner(s)) {
+    s->wdog_feed_pending = 1;
+    return;
+  }
+  silab_lock(s, SILAB_PRIO_WDOG);
+  silab_wdog_feed_locked(s);
+  silab_unlock(s);
+}
+
+/* Holds the uC's bus, e.g. across transfers to other devices that must not
+ * be split by silabs traffic */
+SILAB_API void silab_i2c_lock(void) {
+  silab_lock(&silab_default, SILAB_PRIO_NORMAL);
+}
+
+SILAB_API void silab_i2c_unlock(void) { silab_unlock(&silab_default); }
+
+/* Safe from a signal handler: only marks a feed pending.  It is sent the
+ * next time a thread releases the bus, or by the next silab_wdog_feed(), so
+ * a program calling this must keep using the bus from normal context. */
+SILAB_API void silab_wdog_feed_async(void) {
+  silab_default.wdog_feed_pending = 1;
 }
 
-static uint8_t lockn = 0;
-void silab_i2c_lock(void) {
-  if (lockn++ == 0) {
-    assert(!busy);
-    assert(lockn < 128); /* Over 128 deep I don't think so... */
-    busy = 1;
+/* The caps charge roughly as an RC, dV/dt = (Vinf - V) / tau.  A least
+ * squares fit of dV/dt against V over the last few samples gives tau and
+ * Vinf, and from them the time left to the target.  The wait sleeps most of
+ * that and polls densely once the crossing is near, so the bus is left
+ * alone during the charge and the wait still ends right after the crossing.
+ * Integer math only, this also runs in U-Boot and DOS. */
+#define SCAPS_FIT_SAMPLES 8  /* Samples kept for the fit */
+#define SCAPS_FIT_MS 250     /* Minimum spacing of fit samples */
+#define SCAPS_SLEEP_MAX_MS 1000
+#define SCAPS_NEAR_MS 300    /* Poll densely inside this ETA */
+#define SCAPS_DENSE_MS 20
+
+struct scaps_fit {
+  uint32_t t[SCAPS_FIT_SAMPLES]; /* ms since the start of the wait */
+  int32_t mv[SCAPS_FIT_SAMPLES];
+  int n; /* Samples added, the newest is at (n - 1) % SCAPS_FIT_SAMPLES */
+};
+
+static void scaps_fit_add(struct scaps_fit *f, uint32_t t, int32_t mv) {
+  f->t[f->n % SCAPS_FIT_SAMPLES] = t;
+  f->mv[f->n % SCAPS_FIT_SAMPLES] = mv;
+  f->n++;
+}
+
+/* a * b / c for a, b >= 0 and c > 0, dropping precision rather than
+ * overflowing 32 bits */
+static int32_t scaps_muldiv(int32_t a, int32_t b, int32_t c) {
+  while (b && a > 0x7fffffff / b) {
+    if (a > b)
+      a >>= 1;
+    else
+      b >>= 1;
+    c >>= 1;
+    if (!c)
+      return 0x7fffffff;
   }
+  return a * b / c;
 }
 
-void silab_i2c_unlock(void) {
-  assert(busy); /* Unlock with no lock ? */
-  if (--lockn == 0) {
-    busy = 0;
-    if (wdog_feed_pending)
-      silab_wdog_feed();
+/* ln(num / den) in 1/65536 units, num >= den > 0, both below 2^14 */
+static int32_t scaps_ln_q16(int32_t num, int32_t den) {
+  int32_t r = 0, y, y2, term, sum = 0;
+  int i;
+
+  while (num >= den * 2) {
+    den *= 2;
+    r += 45426; /* ln(2) */
   }
+  /* num / den now in [1, 2), ln(x) = 2 * atanh((x - 1) / (x + 1)) */
+  y = ((num - den) << 16) / (num + den);
+  y2 = (y * y) >> 16;
+  for (term = y, i = 1; i <= 9; i += 2, term = (term * y2) >> 16)
+    sum += term / i;
+  return r + 2 * sum;
 }
 
-static void silab_scaps_wait_pct(int pct) {
-  int ctl = silab_inb(22);
-  int init, cur, tar;
+/* Predicted ms until the caps reach tar mV, -1 if there is no estimate */
+static int32_t scaps_fit_eta(const struct scaps_fit *f, int32_t tar) {
+  int32_t vm[SCAPS_FIT_SAMPLES], dv[SCAPS_FIT_SAMPLES];
+  int32_t mean_v = 0, mean_s = 0, sxx = 0, sxy = 0, tau, vinf, cur, dt;
+  int k = f->n < SCAPS_FIT_SAMPLES ? f->n : SCAPS_FIT_SAMPLES;
+  int first = (f->n - k) % SCAPS_FIT_SAMPLES;
+  int last = (f->n - 1) % SCAPS_FIT_SAMPLES;
+  int i, m = 0;
+
+  if (k < 2)
+    return -1;
+  cur = f->mv[last];
+
+  /* Slope in mV/s at the midpoint of each pair of neighbouring samples */
+  for (i = 1; i < k; i++) {
+    int a = (first + i - 1) % SCAPS_FIT_SAMPLES;
+    int b = (first + i) % SCAPS_FIT_SAMPLES;
+
+    dt = f->t[b] - f->t[a];
+    vm[m] = (f->mv[a] + f->mv[b]) / 2;
+    dv[m] = (f->mv[b] - f->mv[a]) * 1000 / dt;
+    mean_v += vm[m];
+    mean_s += dv[m];
+    m++;
+  }
+  mean_v /= m;
+  mean_s /= m;
+  for (i = 0; i < m; i++) {
+    sxx += (vm[i] - mean_v) * (vm[i] - mean_v);
+    sxy += (vm[i] - mean_v) * (dv[i] - mean_s);
+  }
+
+  /* The slope is -1/tau, and the mean point is on the line */
+  if (m >= 3 && sxx > 0 && sxy < 0 && mean_s > 0) {
+    tau = scaps_muldiv(sxx, 1000, -sxy);
+    vinf = mean_v + scaps_muldiv(mean_s, tau, 1000);
+    if (vinf > tar && vinf < (1 << 14))
+      return scaps_muldiv(tau, scaps_ln_q16(vinf - cur, vinf - tar), 65536);
+  }
+
+  /* No usable RC fit (constant current, noise): straight line */
+  dt = f->t[last] - f->t[first];
+  if (f->mv[last] > f->mv[first])
+    return scaps_muldiv(tar - cur, dt, f->mv[last] - f->mv[first]);
+  return -1;
+}
+
+/* ms on a clock for the timeout and the fit.  On Linux that is the
+ * monotonic clock, so the time spent on the bus counts too; elsewhere only
+ * the time slept is known. */
+static uint32_t scaps_clock_ms(uint32_t slept) {
+#ifdef SILAB_LINUX
+  return silab_ns() / 1000000;
+#else
+  return slept;
+#endif
+}
+
+/* timeout_ms 0 waits forever.  Returns 0 once charged, 1 if the wait hook
+ * aborted, 2 on timeout */
+static int silab_scaps_wait_pct(struct silab *s, int pct,
+                                uint32_t timeout_ms) {
+  struct scaps_fit f;
+  uint32_t t0 = scaps_clock_ms(0), slept = 0;
+  uint32_t elapsed = 0; /* ms since t0 */
+  int32_t eta = -1;
+  int ctl, init, cur, tar, sleep_ms;
+
+  silab_lock(s, SILAB_PRIO_NORMAL);
+  ctl = silab_inb(s, 22);
   if (!(ctl & 2)) {
     ctl |= 2;
     ctl &= ~4;
-    silab_outb(22, ctl); /* Turn on scaps if not already */
+    silab_outb(s, 22, ctl); /* Turn on scaps if not already */
   }
+  silab_unlock(s);
 
   if (pct > 100)
     pct = 100;
   tar = MIN_CHARGE_MV + (MAX_CHARGE_MV - MIN_CHARGE_MV) * pct / 100;
-  init = cur = silab_inw(16);
+  init = cur = silab_inw(s, 16);
+  elapsed = scaps_clock_ms(0) - t0;
+  f.n = 0;
+  scaps_fit_add(&f, elapsed, cur);
   while (cur < tar) {
-    int r = wait_hook((cur - init) * 100 / (tar - init));
-    if (r)
-      return;
-    cur = silab_inw(16);
+    if (timeout_ms && elapsed >= timeout_ms) {
+      wait_hook(-2, 0, 0);
+      return 2;
+    }
+
+    eta = f.n < 3 ? -1 : scaps_fit_eta(&f, tar);
+    if (eta < 0)
+      sleep_ms = SCAPS_FIT_MS;
+    else if (eta <= SCAPS_NEAR_MS)
+      sleep_ms = SCAPS_DENSE_MS;
+    else if (eta - SCAPS_NEAR_MS / 2 > SCAPS_SLEEP_MAX_MS)
+      sleep_ms = SCAPS_SLEEP_MAX_MS;
+    else
+      sleep_ms = eta - SCAPS_NEAR_MS / 2;
+    if (timeout_ms && elapsed + sleep_ms > timeout_ms)
+      sleep_ms = timeout_ms - elapsed;
+
+    if (wait_hook(cur > init ? (cur - init) * 100 / (tar - init) : 0,
+                  eta < 0 ? -1 : (eta + 999) / 1000, sleep_ms))
+      return 1;
+    slept += sleep_ms;
+
+    cur = silab_inw(s, 16);
+    elapsed = scaps_clock_ms(slept) - t0;
     if (cur < init)
       init = cur;
-    if (wdog_feed_pending)
-      silab_wdog_feed();
+    /* Dense polls near the end stay out of the fit, their slopes are noise */
+    if (elapsed - f.t[(f.n - 1) % SCAPS_FIT_SAMPLES] >= SCAPS_FIT_MS)
+      scaps_fit_add(&f, elapsed, cur);
+    if (s->wdog_feed_pending)
+      silab_wdog_feed(s);
   }
-  wait_hook(-1);
+  wait_hook(-1, 0, 0);
+  return 0;
 }
 
 /* full_charge means wait for 100%.  not full_charge means wait for min */
-static void silab_scaps_wait(uint8_t full_charge) {
-  silab_scaps_wait_pct(full_charge ? 100 : 1);
+static int silab_scaps_wait(struct silab *s, uint8_t full_charge,
+                            uint32_t timeout_ms) {
+  return silab_scaps_wait_pct(s, full_charge ? 100 : 1, timeout_ms);
 }
 
 /* Returns true if last reboot was caused by silab wdog */
-static int silab_wdog_expired(void) {
-  return ((silab_inb(1028) & (1 << 7)) ? 1 : 0);
+static int silab_wdog_expired(struct silab *s) {
+  return ((silab_inb(s, 1028) & (1 << 7)) ? 1 : 0);
 }
 
 /* Returns true if USB console is connected */
-static int silab_usb_connected(void) {
-  return ((silab_inb(22) & 0x10) ? 1 : 0);
+static int silab_usb_connected(struct silab *s) {
+  return ((silab_inb(s, 22) & 0x10) ? 1 : 0);
 }
 
-static void silab_flags_set(uint8_t n) {
+static void silab_flags_set(struct silab *s, uint8_t n) {
   n &= 0x7;
-  silab_outb(23, silab_inb(23) | (1 << n));
+  silab_lock(s, SILAB_PRIO_NORMAL);
+  silab_outb(s, 23, silab_inb(s, 23) | (1 << n));
+  silab_unlock(s);
 }
 
-static void silab_flags_clr(uint8_t n) {
+static void silab_flags_clr(struct silab *s, uint8_t n) {
   n &= 0x7;
-  silab_outb(23, silab_inb(23) & ~(1 << n));
+  silab_lock(s, SILAB_PRIO_NORMAL);
+  silab_outb(s, 23, silab_inb(s, 23) & ~(1 << n));
+  silab_unlock(s);
 }
 
-static uint8_t silab_flags(uint8_t n) { return ((silab_inb(23) >> n) & 1); }
+static uint8_t silab_flags(struct silab *s, uint8_t n) {
+  return ((silab_inb(s, 23) >> n) & 1);
+}
 
-static void silab_status_ts4400(void) {
-  int i;
-  uint8_t buf[27];
-  uint16_t *sbuf = (uint16_t *)buf;
-  uint8_t wdog[4];
-  uint32_t w;
+/* Everything "status" prints, fetched in as few bus transfers as the uC
+ * allows: one I2C_RDWR for the ranges every board has, one for the board
+ * specific tail (uC version, currents, MAC).  This replaces ~10 separate
+ * transactions and decodes all fields from one point in time. */
+struct silab_snapshot {
+  uint8_t build[80]; /* 4096 */
+  uint8_t regs[34];  /* 0: analog, 22/23 ctl/flags, 24/26 currents, 28 MAC */
+  uint8_t wdog[5];   /* 1024: timeout, 1028: feed/expired */
   uint8_t ver;
-  const static char *an[10] = {
-      "5V",   "Charge V",  "3.3V",       "1.5V",       "1.2V",
-      "1.8V", "Core cur.", "Supercap 1", "Supercap 2", "4.7V"};
-
-  silab_read(0, buf, 27);
-  ver = silab_inb(0xffff);
-  silab_read(1024, wdog, 4);
-  w = wdog[0];
-  w |= (uint32_t)wdog[1] << 8;
-  w |= (uint32_t)wdog[2] << 16;
-  w |= (uint32_t)wdog[3] << 24;
-
-  for (i = 0; i < 11; i++)
-    sbuf[i] = ((uint16_t)buf[i << 1] << 8) | buf[(i << 1) | 1];
+  uint16_t an[11]; /* regs[0..21] as words */
+};
+
+#define SB_SCAPS (1 << 0)         /* Has supercaps */
+#define SB_DISCHARGE_PCT (1 << 1) /* Print % while discharging */
+#define SB_BUILD (1 << 2)         /* Print build string, initial temp */
+#define SB_WDOG_10MS (1 << 3)     /* Watchdog counts in 10ms units */
+#define SB_MAC (1 << 4)           /* Has a MAC at 28 */
+
+struct silab_board {
+  const char *id; /* Matched against the build string */
+  const char *an[10];
+  uint16_t ver_subadr;
+  uint8_t nregs; /* Bytes read from subaddress 0, 28 covers the currents */
+  uint8_t flags;
+};
+
+/* Order matters, first match wins */
+static const struct silab_board silab_boards[] = {
+    {"7840",
+     {"5V", "Charge V", "", "8-48V", "", "Supercap 2 (initial)", "Fan current",
+      "Supercap 1", "Supercap 2", ""},
+     2048,
+     34,
+     SB_SCAPS | SB_DISCHARGE_PCT | SB_BUILD | SB_WDOG_10MS | SB_MAC},
+    {"7100",
+     {"5V", "Charge V", "3.3V", "8-48V", "", "", "", "Supercap 1",
+      "Supercap 2", ""},
+     2048,
+     28,
+     SB_SCAPS | SB_DISCHARGE_PCT | SB_BUILD | SB_WDOG_10MS},
+    {"7250",
+     {"5V", "VDD_SOC", "3.3V", "10-48V", "", "VDD_ARM", "", "", "", ""},
+     2048,
+     27,
+     SB_BUILD | SB_WDOG_10MS},
+    {"4400",
+     {"5V", "Charge V", "3.3V", "1.5V", "1.2V", "1.8V", "Core cur.",
+      "Supercap 1", "Supercap 2", "4.7V"},
+     0xffff,
+     28,
+     SB_SCAPS},
+};
+
+#define SILAB_COMMON_REGS 27
+
+static const struct silab_board *silab_board_find(const uint8_t *build) {
+  char id[8];
+  int i;
 
-  for (i = 0; i < 10; i++)
-    printf("%s:\t%1d.%03d\n", an[i], sbuf[i] / 1000, sbuf[i] % 1000);
-
-  printf("Temperature:\t%dC\n", sbuf[10]);
-  printf("uC ver:\t%d\n", ver);
-  if (sbuf[8] > (sbuf[9] + 250))
-    buf[22] |= 1;
-  printf("Supercaps:\t");
-  if ((buf[22] & 2) == 0)
-    printf("disabled");
-  else if ((buf[22] & 1))
-    printf("discharging");
-  else if ((buf[22] & 4))
-    printf("charged, %d%%", silab_scaps_charge_pct());
-  else
-    printf("charging, %d%%", silab_scaps_charge_pct());
-  printf(" (default: %s)", (buf[23] & 1) ? "disabled" : "enabled");
-  printf("\nSupercaps charge cur.:\t%d mA (default: %d mA)\n", silab_inw(26),
-         silab_inw(24));
-  printf("Watchdog:\t%d ms", w);
-  printf(" (%s)", (buf[22] & (1 << 6)) ? "ARMED" : "disabled");
-  printf(" (last reboot was %sfrom watchdog)",
-         (silab_inb(1028) & (1 << 7)) ? "" : "NOT ");
-  printf("\nUSB console:\t%s\n",
-         (buf[22] & 0x10) ? "connected" : "disconnected");
+  memcpy(id, build, sizeof(id));
+  id[sizeof(id) - 1] = 0;
+  for (i = 0; i < sizeof(silab_boards) / sizeof(silab_boards[0]); i++)
+    if (strstr(id, silab_boards[i].id))
+      return &silab_boards[i];
+  return NULL;
 }
 
-static void silab_status_ts7100(void) {
-  int i, r;
-  uint8_t buf[27], build[80];
-  uint16_t *sbuf = (uint16_t *)buf;
-  uint8_t wdog[4];
-  uint32_t w;
-  const static char *an[10] = {"5V",         "Charge V", "3.3V", "8-48V",
-                               "",           "",         "",     "Supercap 1",
-                               "Supercap 2", ""};
-
-  r = silab_read(4096, build, sizeof(build));
-  assert(r == 0);
-
-  r = silab_read(0, buf, 27);
-  assert(r == 0);
-  silab_read(1024, wdog, 4);
-  w = wdog[0];
-  w |= (uint32_t)wdog[1] << 8;
-  w |= (uint32_t)wdog[2] << 16;
-  w |= (uint32_t)wdog[3] << 24;
-  w *= 10;
+/* Returns the board's decoder, or NULL on bus error or an unknown board */
+static const struct silab_board *silab_snapshot(struct silab *s,
+                                                struct silab_snapshot *sn) {
+  const struct silab_board *b;
+  struct silab_region common[] = {
+      {4096, sn->build, sizeof(sn->build)},
+      {0, sn->regs, SILAB_COMMON_REGS},
+      {1024, sn->wdog, sizeof(sn->wdog)},
+  };
+  struct silab_region tail[2];
+  int i, n = 0;
+
+  memset(sn, 0, sizeof(*sn));
+  if (silab_readv(s, common, sizeof(common) / sizeof(common[0])))
+    return NULL;
+  sn->build[sizeof(sn->build) - 1] = 0;
+  silab_board_id_set(s, sn->build);
+
+  b = silab_board_find(sn->build);
+  if (!b)
+    return NULL;
+  tail[n].subadr = b->ver_subadr;
+  tail[n].buf = &sn->ver;
+  tail[n++].len = 1;
+  if (b->nregs > SILAB_COMMON_REGS) {
+    tail[n].subadr = SILAB_COMMON_REGS;
+    tail[n].buf = &sn->regs[SILAB_COMMON_REGS];
+    tail[n++].len = b->nregs - SILAB_COMMON_REGS;
+  }
+  if (silab_readv(s, tail, n))
+    return NULL;
 
   for (i = 0; i < 11; i++)
-    sbuf[i] = ((uint16_t)buf[i << 1] << 8) | buf[(i << 1) | 1];
-
-  for (i = 0; i < 10; i++)
-    if (*an[i])
-      printf("%s:\t%1d.%03d\n", an[i], sbuf[i] / 1000, sbuf[i] % 1000);
-
-  printf("Temperature:\t%dC (%dC initial)\n", sbuf[10], sbuf[4]);
-  printf("uC build:\t%s\n", build);
-  printf("uC ver:\t%d\n", silab_inb(2048));
-  if (sbuf[8] > (sbuf[9] + 250))
-    buf[22] |= 1;
-  printf("Supercaps:\t");
-  if ((buf[22] & 2) == 0)
-    printf("disabled");
-  else if ((buf[22] & 1))
-    printf("discharging, %d%%", silab_scaps_discharge_pct());
-  else if ((buf[22] & 4))
-    printf("charged, %d%%", silab_scaps_charge_pct());
-  else
-    printf("charging, %d%%", silab_scaps_charge_pct());
-  printf(" (default: %s)", (buf[23] & 1) ? "disabled" : "enabled");
-  printf("\nSupercaps charge cur.:\t%d mA (default: %d mA)\n", silab_inw(26),
-         silab_inw(24));
-  printf("Watchdog:\t%d ms", w);
-  printf(" (%s)", (buf[22] & (1 << 6)) ? "ARMED" : "disabled");
-  printf(" (last reboot was %sfrom watchdog)",
-         (silab_inb(1028) & (1 << 7)) ? "" : "NOT ");
-  printf("\nUSB console:\t%s\n",
-         (buf[22] & 0x10) ? "connected" : "disconnected");
+    sn->an[i] = ((uint16_t)sn->regs[i << 1] << 8) | sn->regs[(i << 1) | 1];
+  return b;
 }
 
-static void silab_status_ts7840(void) {
-  int i, r;
-  uint8_t buf[34];
-  uint8_t build[80];
-  uint16_t *sbuf = (uint16_t *)buf;
-  uint8_t wdog[4];
+static void silab_status(struct silab *s) {
+  struct silab_snapshot sn;
+  const struct silab_board *b;
   uint32_t w;
-  const static char *an[10] = {"5V",
-                               "Charge V",
-                               "",
-                               "8-48V",
-                               "",
-                               "Supercap 2 (initial)",
-                               "Fan current",
-                               "Supercap 1",
-                               "Supercap 2",
-                               ""};
-
-  r = silab_read(4096, build, sizeof(build));
-  assert(r == 0);
-
-  r = silab_read(0, buf, 34);
-  assert(r == 0);
-  silab_read(1024, wdog, 4);
-  w = wdog[0];
-  w |= (uint32_t)wdog[1] << 8;
-  w |= (uint32_t)wdog[2] << 16;
-  w |= (uint32_t)wdog[3] << 24;
-  w *= 10;
-
-  for (i = 0; i < 11; i++)
-    sbuf[i] = ((uint16_t)buf[i << 1] << 8) | buf[(i << 1) | 1];
-
-  for (i = 0; i < 10; i++)
-    if (*an[i])
-      printf("%s:\t%1d.%03d\n", an[i], sbuf[i] / 1000, sbuf[i] % 1000);
-
-  printf("Temperature:\t%dC (%dC initial)\n", sbuf[10], sbuf[4]);
-  printf("uC build:\t%s\n", build);
-  printf("uC ver:\t%d\n", silab_inb(2048));
-  if (sbuf[8] > (sbuf[9] + 250))
-    buf[22] |= 1;
-  printf("Supercaps:\t");
-  if ((buf[22] & 2) == 0)
-    printf("disabled");
-  else if ((buf[22] & 1))
-    printf("discharging, %d%%", silab_scaps_discharge_pct());
-  else if ((buf[22] & 4))
-    printf("charged, %d%%", silab_scaps_charge_pct());
-  else
-    printf("charging, %d%%", silab_scaps_charge_pct());
-  printf(" (default: %s)", (buf[23] & 1) ? "disabled" : "enabled");
-  printf("\nSupercaps charge cur.:\t%d mA (default: %d mA)\n", silab_inw(26),
-         silab_inw(24));
-  printf("Watchdog:\t%d ms", w);
-  printf(" (%s)", (buf[22] & (1 << 6)) ? "ARMED" : "disabled");
-  printf(" (last reboot was %sfrom watchdog)",
-         (silab_inb(1028) & (1 << 7)) ? "" : "NOT ");
-  printf("\nUSB console:\t%s\n",
-         (buf[22] & 0x10) ? "connected" : "disconnected");
-  printf("Silabs MAC:\t%02x:%02x:%02x:%02x:%02x:%02x\n",
-         buf[28], buf[29], buf[30], buf[31], buf[32], buf[33]);
-}
-
-static void silab_status_ts7250v3(void) {
-  int i, r;
-  uint8_t buf[27];
-  uint8_t build[80];
-  uint16_t *sbuf = (uint16_t *)buf;
-  uint8_t wdog[4];
-  uint32_t w;
-  const static char *an[10] = {"5V",      "VDD_SOC", "3.3V", "10-48V", "",
-                               "VDD_ARM", "",        "",     "",       ""};
-
-  r = silab_read(4096, build, sizeof(build));
-  assert(r == 0);
+  uint8_t ctl;
+  int i;
 
-  r = silab_read(0, buf, 27);
-  assert(r == 0);
-  silab_read(1024, wdog, 4);
-  w = wdog[0];
-  w |= (uint32_t)wdog[1] << 8;
-  w |= (uint32_t)wdog[2] << 16;
-  w |= (uint32_t)wdog[3] << 24;
-  w *= 10;
+  b = silab_snapshot(s, &sn);
+  assert(b); /* Invalid silabs */
 
-  for (i = 0; i < 11; i++)
-    sbuf[i] = ((uint16_t)buf[i << 1] << 8) | buf[(i << 1) | 1];
+  w = sn.wdog[0];
+  w |= (uint32_t)sn.wdog[1] << 8;
+  w |= (uint32_t)sn.wdog[2] << 16;
+  w |= (uint32_t)sn.wdog[3] << 24;
+  if (b->flags & SB_WDOG_10MS)
+    w *= 10;
 
   for (i = 0; i < 10; i++)
-    if (*an[i])
-      printf("%s:\t%1d.%03d\n", an[i], sbuf[i] / 1000, sbuf[i] % 1000);
+    if (*b->an[i])
+      printf("%s:\t%1d.%03d\n", b->an[i], sn.an[i] / 1000, sn.an[i] % 1000);
 
-  printf("Temperature:\t%dC (%dC initial)\n", sbuf[10], sbuf[4]);
-  printf("uC build:\t%s\n", build);
-  printf("uC ver:\t%d\n", silab_inb(2048));
+  if (b->flags & SB_BUILD) {
+    printf("Temperature:\t%dC (%dC initial)\n", sn.an[10], sn.an[4]);
+    printf("uC build:\t%s\n", sn.build);
+  } else
+    printf("Temperature:\t%dC\n", sn.an[10]);
+  printf("uC ver:\t%d\n", sn.ver);
+
+  ctl = sn.regs[22];
+  if (b->flags & SB_SCAPS) {
+    if (sn.an[8] > (sn.an[9] + 250))
+      ctl |= 1;
+    printf("Supercaps:\t");
+    if ((ctl & 2) == 0)
+      printf("disabled");
+    else if ((ctl & 1) && (b->flags & SB_DISCHARGE_PCT))
+      printf("discharging, %d%%", scaps_discharge_pct(sn.an[8]));
+    else if ((ctl & 1))
+      printf("discharging");
+    else if ((ctl & 4))
+      printf("charged, %d%%", scaps_charge_pct(sn.an[8]));
+    else
+      printf("charging, %d%%", scaps_charge_pct(sn.an[8]));
+    printf(" (default: %s)", (sn.regs[23] & 1) ? "disabled" : "enabled");
+    printf("\nSupercaps charge cur.:\t%d mA (default: %d mA)\n",
+           (sn.regs[26] << 8) | sn.regs[27], (sn.regs[24] << 8) | sn.regs[25]);
+  }
   printf("Watchdog:\t%d ms", w);
-  printf(" (%s)", (buf[22] & (1 << 6)) ? "ARMED" : "disabled");
+  printf(" (%s)", (ctl & (1 << 6)) ? "ARMED" : "disabled");
   printf(" (last reboot was %sfrom watchdog)",
-         (silab_inb(1028) & (1 << 7)) ? "" : "NOT ");
-  printf("\nUSB console:\t%s\n",
-         (buf[22] & 0x10) ? "connected" : "disconnected");
-}
-
-static void silab_status(void) {
-  if (silab_board_is("7840"))
-    silab_status_ts7840();
-  else if (silab_board_is("7100"))
-    silab_status_ts7100();
-  else if (silab_board_is("7250"))
-    silab_status_ts7250v3();
-  else if (silab_board_is("4400"))
-    silab_status_ts4400();
-  else
-    assert(0); /* Invalid silabs */
+         (sn.wdog[4] & (1 << 7)) ? "" : "NOT ");
+  printf("\nUSB console:\t%s\n", (ctl & 0x10) ? "connected" : "disconnected");
+  if (b->flags & SB_MAC)
+    printf("Silabs MAC:\t%02x:%02x:%02x:%02x:%02x:%02x\n", sn.regs[28],
+           sn.regs[29], sn.regs[30], sn.regs[31], sn.regs[32], sn.regs[33]);
 }
 
-static int my_atoi(char *s) { /* Because uboot doesnt have atoi() */
+static int my_atoi(const char *s) { /* Because uboot doesnt have atoi() */
   int ret;
   for (ret = 0; *s != '\0'; ++s)
     ret = ret * 10 + *s - '0';
@@ -891,6 +1369,16 @@ static int my_atoi(char *s) { /* Because uboot doesnt have atoi() */
   return ret;
 }
 
+/* What my_atoi() takes: one or more digits, nothing else */
+static int my_isnum(const char *s) {
+  if (*s == '\0')
+    return 0;
+  for (; *s != '\0'; ++s)
+    if (*s < '0' || *s > '9')
+      return 0;
+  return 1;
+}
+
 static uint64_t my_hex_to_uint64(const char *mac) {
   uint64_t r = 0;
   uint8_t c;
@@ -904,95 +1392,125 @@ static uint64_t my_hex_to_uint64(const char *mac) {
   return r;
 }
 
-static int64_t silab_mac(int64_t x) { /* x == -1: return current mac only, do not set */
+static int64_t silab_mac(struct silab *s, int64_t x) { /* x == -1: return current mac only, do not set */
   int64_t ret = 0;
   int i;
   uint8_t buf[6];
-  if (!silab_board_is("7840")) return -1;
+  if (!silab_board_is(s, "7840")) return -1;
   else if (x >= 0) {
     for (i = 5; i >= 0; i--, x >>= 8) buf[i] = x & 0xff;
-    return silab_write(28, buf, 6);
+    return silab_write(s, 28, buf, 6);
   } else {
-    silab_read(28, buf, 6);
+    silab_read(s, 28, buf, 6);
     for (i = 0; i < 6; i++) ret = (ret << 8) | buf[i];
     return ret;
   }
 }
 
-long long silab_cmd(int argc, char *const argv[]) {
+#ifdef SILAB_LINUX
+#include "silabs-linux.c"
+#endif
+
+/* silab_cmd() on a context of the caller's */
+static long long silab_ctx_cmd(struct silab *s, int argc, char *const argv[]) {
 
   if (argc == 1) {
     printf("Usage: %s [CMD] ...\n", argv[0]);
     puts(silab_help);
   } else if (strcmp("mac", argv[1]) == 0) { /* Hidden cmd for production and internal uboot */
-    return silab_mac(argc == 2 ? -1 : my_hex_to_uint64(argv[2]));
+    return silab_mac(s, argc == 2 ? -1 : my_hex_to_uint64(argv[2]));
   } else if (strcmp("fan", argv[1]) == 0) {
     if (argc == 3 && strcmp("disable", argv[2]) == 0)
-      silab_fan_en(0);
+      silab_fan_en(s, 0);
     else if (argc == 3 && strcmp("enable", argv[2]) == 0)
-      silab_fan_en(1);
+      silab_fan_en(s, 1);
+#ifdef SILAB_LINUX
+    else if (argc >= 3 && strcmp("auto", argv[2]) == 0)
+      return silab_fan_auto(s, argc, argv);
+#endif
   } else if (strcmp("status", argv[1]) == 0) {
-    silab_status();
+    silab_status(s);
+#ifdef SILAB_LINUX
+  } else if (strcmp("monitor", argv[1]) == 0) {
+    return silab_monitor(s, argc, argv);
+  } else if (strcmp("powerfail", argv[1]) == 0) {
+    return silab_powerfail(s, argc, argv);
+  } else if (strcmp("history", argv[1]) == 0) {
+    return silab_history(s, argc, argv);
+  } else if (strcmp("batch", argv[1]) == 0) {
+    return silab_batch(s, argc, argv);
+#endif
   } else if (strcmp("reboot", argv[1]) == 0)
-    silab_sleep(400);
+    silab_sleep(s, 400);
   else if (strcmp("sleep", argv[1]) == 0) {
     if (argc >= 2)
-      silab_sleep(my_atoi(argv[2]));
+      silab_sleep(s, my_atoi(argv[2]));
     else
-      silab_sleep(0);
+      silab_sleep(s, 0);
   } else if (strcmp("wdog", argv[1]) == 0) {
     if (argc == 2)
-      return ((silab_inb(22) & (1 << 6)) ? 1 : 0);
+      return ((silab_inb(s, 22) & (1 << 6)) ? 1 : 0);
     else if (argc == 3 && strcmp("expired", argv[2]) == 0)
-      return silab_wdog_expired();
+      return silab_wdog_expired(s);
     else if (argc >= 3 && strcmp("set", argv[2]) == 0)
-      silab_wdog_set(my_atoi(argv[3]));
+      silab_wdog_set(s, my_atoi(argv[3]));
+#ifdef SILAB_LINUX
+    else if (argc >= 3 && strcmp("daemon", argv[2]) == 0)
+      return silab_wdog_daemon(s, argc, argv);
+#endif
     else if (argc >= 2 && strcmp("feed", argv[2]) == 0)
-      silab_wdog_feed();
+      silab_wdog_feed(s);
     else if (argc >= 2 && strcmp("disable", argv[2]) == 0)
-      silab_wdog_set(0);
+      silab_wdog_set(s, 0);
   } else if (strcmp("scaps", argv[1]) == 0) {
     /* 7250 has no supercaps */
-    if (silab_board_is("7250"))
+    if (silab_board_is(s, "7250"))
       return (argc == 2) ? 0 : 1;
     else if (argc == 2)
-      return ((silab_inb(22) & 2) ? 1 : 0);
+      return ((silab_inb(s, 22) & 2) ? 1 : 0);
     else if (argc == 4 && strcmp("pct", argv[2]) == 0) {
-      if (100 - my_atoi(argv[3]) >= silab_scaps_discharge_pct())
+      if (100 - my_atoi(argv[3]) >= scaps_discharge_pct(silab_inw(s, 16)))
         return 1;
       else
         return 0;
     } else if (argc >= 3 && strcmp("current", argv[2]) == 0) {
       if (argc >= 4 && strcmp("default", argv[3]) == 0)
-        silab_scaps_default_current(my_atoi(argv[4]));
+        silab_scaps_default_current(s, my_atoi(argv[4]));
       else
-        silab_scaps_current(my_atoi(argv[3]));
+        silab_scaps_current(s, my_atoi(argv[3]));
     } else if (argc == 3 && strcmp("enable", argv[2]) == 0)
-      silab_scaps_en(1);
+      silab_scaps_en(s, 1);
     else if (argc == 3 && strcmp("disable", argv[2]) == 0)
-      silab_scaps_en(0);
+      silab_scaps_en(s, 0);
     else if (argc == 4 && strcmp("default", argv[2]) == 0) {
       if (strcmp("enable", argv[3]) == 0)
-        silab_scaps_default_en(1);
+        silab_scaps_default_en(s, 1);
       else if (strcmp("disable", argv[3]) == 0)
-        silab_scaps_default_en(0);
+        silab_scaps_default_en(s, 0);
     } else if (argc >= 3 && strcmp("wait", argv[2]) == 0) {
-      if (argc == 5 && strcmp("pct", argv[3]) == 0)
-        silab_scaps_wait_pct(my_atoi(argv[4]));
-      else if (argc == 4 && strcmp("full", argv[3]))
-        silab_scaps_wait(1);
-      else if (argc == 3)
-        silab_scaps_wait(0);
+      if ((argc == 5 || argc == 6) && strcmp("pct", argv[3]) == 0 &&
+          my_isnum(argv[4]) && (argc == 5 || my_isnum(argv[5])))
+        return silab_scaps_wait_pct(s, my_atoi(argv[4]),
+                                    argc > 5 ? my_atoi(argv[5]) : 0);
+      else if ((argc == 4 || argc == 5) && strcmp("full", argv[3]) == 0 &&
+               (argc == 4 || my_isnum(argv[4])))
+        return silab_scaps_wait(s, 1, argc > 4 ? my_atoi(argv[4]) : 0);
+      else if (argc == 3 || (argc == 4 && my_isnum(argv[3])))
+        return silab_scaps_wait(s, 0, argc > 3 ? my_atoi(argv[3]) : 0);
+      /* Anything else would have waited on a garbage timeout */
+      printf("Usage: %s [CMD] ...\n", argv[0]);
+      puts(silab_help);
+      return 1;
     }
   } else if (strcmp("usb", argv[1]) == 0)
-    return silab_usb_connected();
+    return silab_usb_connected(s);
   else if (argc >= 3 && strcmp("flags", argv[1]) == 0) {
     if (argc == 4 && strcmp("set", argv[2]) == 0)
-      silab_flags_set(my_atoi(argv[3]));
+      silab_flags_set(s, my_atoi(argv[3]));
     else if (argc == 4 && strcmp("clear", argv[2]) == 0)
-      silab_flags_clr(my_atoi(argv[3]));
+      silab_flags_clr(s, my_atoi(argv[3]));
     else if (argc == 3)
-      return (silab_flags(my_atoi(argv[2])));
+      return (silab_flags(s, my_atoi(argv[2])));
   } else {
     printf("Usage: %s [CMD] ...\n", argv[0]);
     puts(silab_help);
@@ -1000,3 +1518,56 @@ long long silab_cmd(int argc, char *const argv[]) {
 
   return 0;
 }
+
+SILAB_API long long silab_cmd(int argc, char *const argv[]) {
+#ifdef SILAB_LINUX
+  struct silab ctx, *s = &silab_default;
+  int n = 1, stats = 0, bus = s->bus, adr = s->adr;
+  char **av;
+  long long r;
+
+  /* Options ahead of the command */
+  for (;;) {
+    if (argc > n && strcmp("--stats", argv[n]) == 0) {
+      stats = 1;
+      n++;
+    } else if (argc > n + 1 && strcmp("--bus", argv[n]) == 0) {
+      bus = strtol(argv[n + 1], NULL, 0);
+      n += 2;
+    } else if (argc > n + 1 && strcmp("--adr", argv[n]) == 0) {
+      adr = strtol(argv[n + 1], NULL, 0);
+      n += 2;
+    } else
+      break;
+  }
+  if (n == 1)
+    return silab_ctx_cmd(s, argc, argv);
+
+  if (bus != s->bus || adr != s->adr) {
+    if (silab_open(&ctx, bus, adr)) {
+      perror("silab_open");
+      return 1;
+    }
+    s = &ctx;
+  }
+  av = malloc((argc - n + 1) * sizeof(*av));
+  assert(av);
+  av[0] = argv[0];
+  memcpy(&av[1], &argv[n], (argc - n) * sizeof(*av));
+#ifndef SILAB_STATS
+  if (stats)
+    fprintf(stderr, "%s: built without --enable-i2c-stats\n", argv[0]);
+#endif
+  r = silab_ctx_cmd(s, argc - n + 1, av);
+#ifdef SILAB_STATS
+  if (stats)
+    silab_stats_print(stderr);
+#endif
+  free(av);
+  if (s == &ctx)
+    silab_close(&ctx);
+  return r;
+#else
+  return silab_ctx_cmd(&silab_default, argc, argv);
+#endif
+}
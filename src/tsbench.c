@@ -0,0 +1,309 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Syscalls reported from the strace run, the phases of a tool's run.
+ * 32-bit ARM maps with mmap2. */
+static const char *phase_syscalls[] = {
+	"execve", "openat", "open", "mmap", "mmap2", "ioctl", "read", "write",
+	"close",
+};
+
+struct run {
+	uint64_t ns;
+	struct rusage ru;
+	int status;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* fork() to exit of argv, stdout and stderr to the given fds (-1 for
+ * /dev/null).  env, if set, is added to the child's environment. */
+static int run_once(char **argv, const char *env, int out, int err,
+		    struct run *r)
+{
+	uint64_t t0;
+	pid_t pid;
+	int null;
+
+	t0 = now_ns();
+	pid = fork();
+	if (pid == 0) {
+		null = open("/dev/null", O_RDWR);
+		dup2(out >= 0 ? out : null, 1);
+		dup2(err >= 0 ? err : null, 2);
+		if (env)
+			putenv((char *)env);
+		execvp(argv[0], argv);
+		_exit(127);
+	} else if (pid < 0)
+		return -1;
+	if (wait4(pid, &r->status, 0, &r->ru) < 0)
+		return -1;
+	r->ns = now_ns() - t0;
+	return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	const uint64_t *x = a, *y = b;
+
+	return *x < *y ? -1 : *x > *y;
+}
+
+static uint64_t tv_us(const struct timeval *tv)
+{
+	return (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+static FILE *tmp_file(void)
+{
+	FILE *f = tmpfile();
+
+	if (!f)
+		perror("tmpfile");
+	return f;
+}
+
+/* One run with LD_DEBUG=statistics: the dynamic loader's startup time
+ * (cycles on x86) and relocations, and the bytes of output */
+static void probe_loader(const char *label, char **argv)
+{
+	FILE *out = tmp_file(), *err = tmp_file();
+	char line[256], unit[32], *p;
+	unsigned long long v;
+	struct run r;
+	int loader = 0;
+
+	if (!out || !err || run_once(argv, "LD_DEBUG=statistics", fileno(out),
+				     fileno(err), &r) < 0)
+		goto done;
+
+	fseek(out, 0, SEEK_END);
+	printf("%s_out_bytes=%ld\n", label, ftell(out));
+	rewind(err);
+	while (fgets(line, sizeof(line), err)) {
+		/* Once per loaded object set, the first is the startup */
+		p = strstr(line, "total startup time in dynamic loader:");
+		if (!loader && p && sscanf(p + 37, "%llu %31s", &v, unit) == 2) {
+			printf("%s_loader_%s=%llu\n", label, unit, v);
+			loader = 1;
+		} else if ((p = strstr(line, "number of relocations:")) &&
+			   sscanf(p + 22, "%llu", &v) == 1 && loader == 1) {
+			printf("%s_relocations=%llu\n", label, v);
+			loader = 2;
+		}
+	}
+	if (!loader) /* Static, or a loader without statistics */
+		printf("%s_loader_cycles=0\n", label);
+done:
+	if (out)
+		fclose(out);
+	if (err)
+		fclose(err);
+}
+
+/* One run under strace -f -c, syscall counts and times per phase */
+static void probe_strace(const char *label, char **argv)
+{
+	char path[] = "/tmp/tsbench.XXXXXX", **sargv, line[256], name[64], *p;
+	FILE *out = NULL;
+	double pct, secs;
+	unsigned long calls;
+	size_t calls_end = 0;
+	struct run r;
+	int i, n;
+
+	for (n = 0; argv[n]; n++)
+		;
+	sargv = calloc(n + 8, sizeof(*sargv));
+	i = mkstemp(path);
+	if (i < 0 || !sargv)
+		goto done;
+	close(i);
+	sargv[0] = "strace";
+	sargv[1] = "-f";
+	sargv[2] = "-c";
+	sargv[3] = "-o";
+	sargv[4] = path;
+	sargv[5] = "--";
+	memcpy(&sargv[6], argv, n * sizeof(*argv));
+	if (run_once(sargv, NULL, -1, -1, &r) < 0 ||
+	    !WIFEXITED(r.status) || WEXITSTATUS(r.status) == 127 ||
+	    !(out = fopen(path, "r"))) {
+		printf("%s_strace=0\n", label);
+		goto done;
+	}
+
+	while (fgets(line, sizeof(line), out)) {
+		/* Columns: % time, seconds, usecs/call, calls, errors, syscall.
+		 * Any can be blank, so calls is read where its heading ends. */
+		p = strstr(line, " calls");
+		if (p) {
+			calls_end = p - line + 6;
+			continue;
+		}
+		if (!calls_end || strlen(line) < calls_end ||
+		    sscanf(line, "%lf %lf", &pct, &secs) != 2)
+			continue;
+		for (p = line + calls_end; p > line && p[-1] >= '0' && p[-1] <= '9'; p--)
+			;
+		calls = strtoul(p, NULL, 10);
+		n = strlen(line);
+		while (n && (line[n - 1] == '\n' || line[n - 1] == ' '))
+			line[--n] = 0;
+		snprintf(name, sizeof(name), "%s", strrchr(line, ' ') + 1);
+		if (strcmp(name, "total") == 0) {
+			printf("%s_syscalls=%lu\n", label, calls);
+			printf("%s_syscall_us=%.0f\n", label, secs * 1e6);
+			continue;
+		}
+		for (i = 0; i < sizeof(phase_syscalls) / sizeof(phase_syscalls[0]); i++)
+			if (strcmp(name, phase_syscalls[i]) == 0) {
+				printf("%s_sys_%s=%lu\n", label, name, calls);
+				printf("%s_sys_%s_us=%.0f\n", label, name, secs * 1e6);
+			}
+	}
+done:
+	free(sargv);
+	if (out)
+		fclose(out);
+	unlink(path);
+}
+
+static void usage(char **argv) {
+	fprintf(stderr,
+		"Usage: %s [OPTIONS] -- <command> [ARGS] ...\n"
+		"embeddedTS exec to exit benchmark\n"
+		"\n"
+		"  -n, --runs <n>         Timed runs (default 200)\n"
+		"  -w, --warmup <n>       Untimed runs first (default 5)\n"
+		"  -l, --label <name>     Prefix of the result keys (default: command)\n"
+		"  -s, --strace           Count syscalls in one more run under strace\n"
+		"  -h, --help             This message\n"
+		"\n"
+		"Times fork() to exit of each run, output to /dev/null, and reports\n"
+		"percentiles, mean user/system time and peak RSS.  Runs that exit\n"
+		"non-zero or on a signal count as failed.  One more run with\n"
+		"LD_DEBUG=statistics reports the dynamic loader's startup time and\n"
+		"the bytes of output.  Results are printed as key=value lines.\n",
+		argv[0]
+	);
+}
+
+int main(int argc, char **argv)
+{
+	int c, i, fails = 0;
+	int opt_runs = 200, opt_warmup = 5, opt_strace = 0;
+	const char *opt_label = NULL;
+	uint64_t *ns, sum = 0, user = 0, sys = 0;
+	long maxrss = 0;
+	struct run r;
+	char **cmd;
+
+	static struct option long_options[] = {
+		{ "runs", required_argument, 0, 'n' },
+		{ "warmup", required_argument, 0, 'w' },
+		{ "label", required_argument, 0, 'l' },
+		{ "strace", 0, 0, 's' },
+		{ "help", 0, 0, 'h' },
+		{ 0, 0, 0, 0 }
+	};
+
+	while((c = getopt_long(argc, argv, "+n:w:l:sh", long_options, NULL)) != -1) {
+		switch(c) {
+		case 'n':
+			opt_runs = atoi(optarg);
+			break;
+		case 'w':
+			opt_warmup = atoi(optarg);
+			break;
+		case 'l':
+			opt_label = optarg;
+			break;
+		case 's':
+			opt_strace = 1;
+			break;
+		case 'h':
+		default:
+			usage(argv);
+			return 1;
+		}
+	}
+	if (optind >= argc || opt_runs < 1) {
+		usage(argv);
+		return 1;
+	}
+	cmd = &argv[optind];
+	if (!opt_label) {
+		opt_label = strrchr(cmd[0], '/');
+		opt_label = opt_label ? opt_label + 1 : cmd[0];
+	}
+
+	ns = calloc(opt_runs, sizeof(*ns));
+	if (!ns) {
+		perror("calloc");
+		return 1;
+	}
+	for (i = 0; i < opt_warmup; i++)
+		run_once(cmd, NULL, -1, -1, &r);
+	for (i = 0; i < opt_runs; i++) {
+		if (run_once(cmd, NULL, -1, -1, &r) < 0) {
+			perror("fork");
+			return 1;
+		}
+		if (!WIFEXITED(r.status) || WEXITSTATUS(r.status))
+			fails++;
+		ns[i] = r.ns;
+		sum += r.ns;
+		user += tv_us(&r.ru.ru_utime);
+		sys += tv_us(&r.ru.ru_stime);
+		if (r.ru.ru_maxrss > maxrss)
+			maxrss = r.ru.ru_maxrss;
+	}
+	qsort(ns, opt_runs, sizeof(*ns), cmp_u64);
+
+	printf("%s_runs=%d\n", opt_label, opt_runs);
+	printf("%s_exit=%d\n", opt_label,
+	       WIFEXITED(r.status) ? WEXITSTATUS(r.status) : -1);
+	printf("%s_failed=%d\n", opt_label, fails);
+	printf("%s_min_us=%.1f\n", opt_label, ns[0] / 1e3);
+	printf("%s_p50_us=%.1f\n", opt_label, ns[(opt_runs - 1) * 50 / 100] / 1e3);
+	printf("%s_p90_us=%.1f\n", opt_label, ns[(opt_runs - 1) * 90 / 100] / 1e3);
+	printf("%s_p99_us=%.1f\n", opt_label, ns[(opt_runs - 1) * 99 / 100] / 1e3);
+	printf("%s_max_us=%.1f\n", opt_label, ns[opt_runs - 1] / 1e3);
+	printf("%s_mean_us=%.1f\n", opt_label, sum / 1e3 / opt_runs);
+	printf("%s_user_us=%.1f\n", opt_label, (double)user / opt_runs);
+	printf("%s_sys_us=%.1f\n", opt_label, (double)sys / opt_runs);
+	printf("%s_maxrss_kb=%ld\n", opt_label, maxrss);
+	fflush(stdout);
+
+	probe_loader(opt_label, cmd);
+	fflush(stdout);
+	if (opt_strace)
+		probe_strace(opt_label, cmd);
+
+	free(ns);
+	return fails ? 1 : 0;
+}
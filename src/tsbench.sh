@@ -0,0 +1,42 @@
+#!/bin/sh
+# make bench: exec to exit times of the tools, as key=value lines.  Runs
+# against the board when its FPGA and I2C bus are there, otherwise against
+# FPGA_RESOURCE, silabs_sim and a tsprodinfo image in a temporary directory.
+# usage: tsbench.sh [runs]
+set -e
+
+runs=${1:-200}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# Multicall builds have one binary taking the tool as its first argument
+tool() {
+	if [ -x ./tsutils ]; then echo "./tsutils $1"; else echo "./$1"; fi
+}
+
+strace=
+command -v strace >/dev/null 2>&1 && strace=--strace
+
+if [ -e /sys/bus/pci/devices/0000:02:00.0/resource0 ] && [ -e /dev/i2c-0 ]; then
+	backend=hw
+	silabs=$(tool silabs)
+	prod=/dev/mmcblk0boot1
+else
+	backend=sim
+	export FPGA_RESOURCE="$tmp/fpga"
+	export SILABS_SIM_STATE="$tmp/uc"
+	silabs=./silabs_sim
+	prod="$tmp/prod.img"
+	dd if=/dev/zero of="$prod" bs=1024 count=1024 2>/dev/null
+	echo "serial=bench" | $(tool tsprodinfo) -d "$prod" -w
+fi
+
+echo "version=${PACKAGE_VERSION:-unknown}"
+echo "backend=$backend"
+echo "kernel=$(uname -r)"
+echo "arch=$(uname -m)"
+
+./tsbench $strace -n "$runs" -l tshwctl_info -- $(tool tshwctl) --info
+./tsbench $strace -n "$runs" -l fpga_peekpoke -- $(tool fpga_peekpoke) 32 0
+./tsbench $strace -n "$runs" -l silabs_status -- $silabs status
+./tsbench $strace -n "$runs" -l tsprodinfo_read -- $(tool tsprodinfo) -d "$prod" -r
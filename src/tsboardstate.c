@@ -0,0 +1,319 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include "fpga.c"
+#define SILABS_NO_MAIN
+#include "silabs.c"
+#include "tsboardstate.h"
+
+/* Regs 0..27: analog, ctl, flags and the charge currents */
+#define PUBLISH_REGS 28
+
+static void usage(char **argv) {
+	fprintf(stderr,
+		"Usage: %s [OPTIONS]\n"
+		"embeddedTS board state in shared memory\n"
+		"\n"
+		"  -p, --publish          Keep the state updated until SIGINT/SIGTERM\n"
+		"  -r, --rate <Hz>        With --publish, updates per second, 0.25-1000\n"
+		"                         (default 10)\n"
+		"  -F, --no-fpga          With --publish, leave out the FPGA registers\n"
+		"  -n, --name <name>      Shared memory name (default %s)\n"
+		"  -b, --bench <n>        Time <n> reads of the state\n"
+		"  -h, --help             This message\n"
+		"\n"
+		"The publisher reads the silabs registers in one I2C transfer per\n"
+		"update and the FPGA revision and straps.  Without --publish the\n"
+		"latest state is printed as key=value lines; other programs read it\n"
+		"with the functions in tsboardstate.h.\n",
+		argv[0], TSBS_NAME
+	);
+}
+
+/* Reads the board into a copy of the state and stores it under the
+ * sequence lock.  A failed read only counts an error, so the old state
+ * stays and ages. */
+static void publish_update(struct silab *s, const struct silab_board *b,
+			   struct tsbs_segment *seg, int fpga)
+{
+	uint8_t regs[PUBLISH_REGS], wdog[5];
+	struct silab_region rd[] = {
+		{ 0, regs, b->nregs < PUBLISH_REGS ? b->nregs : PUBLISH_REGS },
+		{ 1024, wdog, sizeof(wdog) },
+	};
+	struct tsbs_state st = seg->state;
+	struct timespec ts;
+	uint32_t seq;
+	int i;
+
+	memset(regs, 0, sizeof(regs));
+	if (silab_readv(s, rd, sizeof(rd) / sizeof(rd[0]))) {
+		st.errors++;
+	} else {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		st.mono_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		st.real_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+		st.updates++;
+
+		for (i = 0; i < TSBS_AN_CHANNELS; i++)
+			st.an[i] = ((uint16_t)regs[i << 1] << 8) |
+				   regs[(i << 1) | 1];
+		/* As silabs status decides it */
+		st.ctl = regs[22];
+		if ((b->flags & SB_SCAPS) && st.an[8] > st.an[9] + 250)
+			st.ctl |= TSBS_CTL_DISCHARGING;
+		st.flags = regs[23];
+		st.scaps_default_ma = (regs[24] << 8) | regs[25];
+		st.scaps_ma = (regs[26] << 8) | regs[27];
+		st.wdog_ms = wdog[0] | (uint32_t)wdog[1] << 8 |
+			     (uint32_t)wdog[2] << 16 | (uint32_t)wdog[3] << 24;
+		if (b->flags & SB_WDOG_10MS)
+			st.wdog_ms *= 10;
+		st.wdog_rebooted = !!(wdog[4] & (1 << 7));
+	}
+	if (fpga) {
+		st.fpga_rev = fpga_peek32(0x0);
+		st.fpga_hash = fpga_peek32(0x4);
+		st.fpga_straps = fpga_peek32(0x10) & 0x3f;
+	}
+
+	seq = seg->seq;
+	__atomic_store_n(&seg->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&seg->state, &st, sizeof(st));
+	__atomic_store_n(&seg->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static int publish(const char *name, double rate, int fpga)
+{
+	struct silab *s = &silab_default;
+	struct silab_snapshot sn;
+	const struct silab_board *b;
+	struct tsbs_segment *seg;
+	int fd, tfd, i;
+
+	b = silab_snapshot(s, &sn);
+	if (!b) {
+		fprintf(stderr, "I2C read failed or unknown board\n");
+		return 1;
+	}
+	if (fpga)
+		fpga_init();
+
+	fd = shm_open(name, O_RDWR|O_CREAT, 0644);
+	if (fd < 0) {
+		perror(name);
+		return 1;
+	}
+	/* Held until exit, a second writer would break the sequence lock */
+	if (flock(fd, LOCK_EX|LOCK_NB) < 0) {
+		if (errno == EWOULDBLOCK)
+			fprintf(stderr, "%s: already published\n", name);
+		else
+			perror(name);
+		return 1;
+	}
+	if (ftruncate(fd, sizeof(*seg)) < 0) {
+		perror(name);
+		return 1;
+	}
+	seg = mmap(NULL, sizeof(*seg), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (seg == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	/* A segment left by an earlier publisher is reused, readers that
+	 * still have it mapped carry on */
+	__atomic_store_n(&seg->magic, 0, __ATOMIC_RELEASE);
+	seg->version = TSBS_VERSION;
+	seg->size = sizeof(*seg);
+	memset(&seg->info, 0, sizeof(seg->info));
+	snprintf(seg->info.board, sizeof(seg->info.board), "%s",
+		 (char *)sn.build);
+	for (i = 0; i < TSBS_AN_CHANNELS; i++)
+		snprintf(seg->info.an_name[i], sizeof(seg->info.an_name[i]),
+			 "%s", silab_an_name(b, i));
+	seg->info.period_ns = 1e9 / rate;
+	seg->info.pid = getpid();
+	seg->info.uc_ver = sn.ver;
+	seg->info.has_scaps = !!(b->flags & SB_SCAPS);
+	seg->info.has_fpga = fpga;
+	if (seg->seq & 1)
+		seg->seq++; /* The last publisher died during an update */
+	publish_update(s, b, seg, fpga);
+	__atomic_store_n(&seg->magic, TSBS_MAGIC, __ATOMIC_RELEASE);
+
+	tfd = silab_timer(seg->info.period_ns);
+	if (tfd < 0) {
+		perror("timerfd");
+		return 1;
+	}
+	silab_catch_signals();
+	while (!silab_stop) {
+		if (silab_timer_wait(tfd))
+			publish_update(s, b, seg, fpga);
+	}
+
+	close(tfd);
+	munmap(seg, sizeof(*seg));
+	close(fd);
+	return 0;
+}
+
+/* Current channels ("Fan current", "Core cur.") are in mA, the fan stall
+ * check in silabs-linux.c reads them the same way; the rest in mV */
+static const char *an_unit(const char *name)
+{
+	return strcasestr(name, "cur") ? "ma" : "mv";
+}
+
+/* "Supercap 2 (initial)" -> supercap_2_initial */
+static void print_key(const char *name, const char *unit)
+{
+	int sep = 0;
+
+	for (; *name; name++) {
+		if (!isalnum((unsigned char)*name)) {
+			sep = 1;
+			continue;
+		}
+		if (sep)
+			putchar('_');
+		putchar(tolower((unsigned char)*name));
+		sep = 0;
+	}
+	printf("_%s=", unit);
+}
+
+static int show(const char *name, long bench)
+{
+	struct tsbs_segment *seg = tsbs_open(name);
+	struct tsbs_state st;
+	struct timespec t0, t1;
+	long i;
+	int ret = 0;
+
+	if (!seg) {
+		fprintf(stderr, "%s: %s%s\n", name, strerror(errno),
+			errno == ENOENT ? " (no tsboardstate --publish?)" : "");
+		return 1;
+	}
+
+	if (bench) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (i = 0; i < bench && ret == 0; i++)
+			ret = tsbs_read(seg, &st);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		printf("reads=%ld\n", i);
+		printf("read_ns=%.1f\n", ((t1.tv_sec - t0.tv_sec) * 1e9 +
+		       (t1.tv_nsec - t0.tv_nsec)) / i);
+	}
+	if (tsbs_read(seg, &st) < 0) {
+		perror(name);
+		tsbs_close(seg);
+		return 1;
+	}
+
+	printf("age_ms=%.1f\n", tsbs_age_ns(&st) / 1e6);
+	printf("period_ms=%.1f\n", seg->info.period_ns / 1e6);
+	printf("updates=%llu\n", (unsigned long long)st.updates);
+	printf("errors=%llu\n", (unsigned long long)st.errors);
+	printf("uc_build=\"%s\"\n", seg->info.board);
+	printf("uc_ver=%d\n", seg->info.uc_ver);
+	for (i = 0; i < TSBS_AN_TEMP; i++) {
+		if (!seg->info.an_name[i][0])
+			continue;
+		print_key(seg->info.an_name[i], an_unit(seg->info.an_name[i]));
+		printf("%u\n", st.an[i]);
+	}
+	printf("temperature_c=%u\n", st.an[TSBS_AN_TEMP]);
+	if (seg->info.has_scaps) {
+		printf("scaps_enabled=%d\n", !!(st.ctl & TSBS_CTL_SCAPS_ENABLED));
+		printf("scaps_charged=%d\n", !!(st.ctl & TSBS_CTL_SCAPS_CHARGED));
+		printf("scaps_discharging=%d\n",
+		       !!(st.ctl & TSBS_CTL_DISCHARGING));
+		printf("scaps_ma=%u\n", st.scaps_ma);
+		printf("scaps_default_ma=%u\n", st.scaps_default_ma);
+	}
+	printf("usb=%d\n", !!(st.ctl & TSBS_CTL_USB));
+	printf("flags=0x%02X\n", st.flags);
+	printf("wdog_armed=%d\n", !!(st.ctl & TSBS_CTL_WDOG_ARMED));
+	printf("wdog_ms=%u\n", st.wdog_ms);
+	printf("wdog_rebooted=%d\n", st.wdog_rebooted);
+	if (seg->info.has_fpga) {
+		printf("fpga_rev=%d\n", st.fpga_rev & 0x7fffffff);
+		if (st.fpga_rev & (1 << 31))
+			printf("fpga_hash=\"%x-dirty\"\n", st.fpga_hash);
+		else
+			printf("fpga_hash=\"%x\"\n", st.fpga_hash);
+		printf("opts=0x%X\n", st.fpga_straps);
+	}
+
+	tsbs_close(seg);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int c, opt_publish = 0, opt_fpga = 1;
+	const char *opt_name = TSBS_NAME;
+	double opt_rate = 10;
+	long opt_bench = 0;
+
+	static struct option long_options[] = {
+		{ "publish", 0, 0, 'p' },
+		{ "rate", required_argument, 0, 'r' },
+		{ "no-fpga", 0, 0, 'F' },
+		{ "name", required_argument, 0, 'n' },
+		{ "bench", required_argument, 0, 'b' },
+		{ "help", 0, 0, 'h' },
+		{ 0, 0, 0, 0 }
+	};
+
+	while((c = getopt_long(argc, argv, "pr:Fn:b:h", long_options, NULL)) != -1) {
+		switch(c) {
+		case 'p':
+			opt_publish = 1;
+			break;
+		case 'r':
+			opt_rate = atof(optarg);
+			break;
+		case 'F':
+			opt_fpga = 0;
+			break;
+		case 'n':
+			opt_name = optarg;
+			break;
+		case 'b':
+			opt_bench = atol(optarg);
+			break;
+		case 'h':
+		default:
+			usage(argv);
+			return 1;
+		}
+	}
+	/* info.period_ns is 32 bits, 4 s at most */
+	if (!(opt_rate >= 0.25 && opt_rate <= 1000)) {
+		fprintf(stderr, "Rate must be 0.25 to 1000 Hz\n");
+		return 1;
+	}
+
+	if (opt_publish)
+		return publish(opt_name, opt_rate, opt_fpga);
+	return show(opt_name, opt_bench);
+}
@@ -0,0 +1,158 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* Board state published in POSIX shared memory by tsboardstate --publish.
+ * Reading it is a copy out of the mapping, no bus traffic:
+ *
+ *	struct tsbs_segment *seg = tsbs_open(TSBS_NAME);
+ *	struct tsbs_state st;
+ *
+ *	if (seg && tsbs_read(seg, &st) == 0)
+ *		printf("%u mV\n", st.an[0]);
+ *
+ * The publisher updates the state under a sequence lock: seq is odd while
+ * it writes, and a reader retries if seq changed during its copy.  Readers
+ * never block the publisher or each other.  There is one publisher per name,
+ * it holds an flock() on the segment.  Link with -lrt on C libraries
+ * older than glibc 2.17 for shm_open(). */
+
+#ifndef TSBOARDSTATE_H
+#define TSBOARDSTATE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TSBS_NAME "/tsboardstate"
+#define TSBS_MAGIC 0x53425354 /* "TSBS" */
+#define TSBS_VERSION 1
+#define TSBS_AN_CHANNELS 11
+#define TSBS_AN_TEMP 10
+
+/* Reader gives up after this many copies torn by updates, or while an
+ * update stays in progress (the publisher died in the middle of one) */
+#define TSBS_READ_TRIES 1000
+
+/* ctl bits, the uC's register 22 */
+#define TSBS_CTL_DISCHARGING	(1 << 0)
+#define TSBS_CTL_SCAPS_ENABLED	(1 << 1)
+#define TSBS_CTL_SCAPS_CHARGED	(1 << 2)
+#define TSBS_CTL_USB		(1 << 4)
+#define TSBS_CTL_WDOG_ARMED	(1 << 6)
+
+/* Set once when the publisher starts */
+struct tsbs_info {
+	char board[80];		/* uC build string */
+	char an_name[TSBS_AN_CHANNELS][24]; /* "" for unused channels */
+	uint32_t period_ns;	/* Between updates */
+	int32_t pid;		/* Of the publisher */
+	uint8_t uc_ver;
+	uint8_t has_scaps;
+	uint8_t has_fpga;
+};
+
+/* One update */
+struct tsbs_state {
+	uint64_t mono_ns;	/* CLOCK_MONOTONIC when read */
+	uint64_t real_ns;	/* CLOCK_REALTIME when read */
+	uint64_t updates;
+	uint64_t errors;	/* Failed bus reads, the state is kept */
+	/* mV, but mA for the current channels ("Fan current", "Core
+	 * cur."), and an[TSBS_AN_TEMP] in C */
+	uint16_t an[TSBS_AN_CHANNELS];
+	uint8_t ctl;		/* TSBS_CTL_* */
+	uint8_t flags;		/* silabs flags 0..7 */
+	uint16_t scaps_ma;	/* Supercap charge current */
+	uint16_t scaps_default_ma;
+	uint32_t wdog_ms;	/* Timeout */
+	uint8_t wdog_rebooted;	/* Last reboot was from the watchdog */
+	uint8_t pad[3];
+	uint32_t fpga_rev;	/* Bit 31: built from a dirty tree */
+	uint32_t fpga_hash;
+	uint32_t fpga_straps;
+};
+
+struct tsbs_segment {
+	uint32_t magic;		/* Stored last, once info is filled in */
+	uint32_t version;
+	uint32_t size;		/* sizeof(struct tsbs_segment) */
+	struct tsbs_info info;
+	uint32_t seq;		/* Odd during an update */
+	uint32_t pad;
+	struct tsbs_state state;
+};
+
+/* Maps the segment read only.  NULL with errno set if it is missing or
+ * from an incompatible publisher (EPROTO). */
+static inline struct tsbs_segment *tsbs_open(const char *name)
+{
+	struct tsbs_segment *seg;
+	struct stat st;
+	int fd, err;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*seg)) {
+		close(fd);
+		errno = EPROTO;
+		return NULL;
+	}
+	seg = mmap(NULL, sizeof(*seg), PROT_READ, MAP_SHARED, fd, 0);
+	err = errno;
+	close(fd);
+	if (seg == MAP_FAILED) {
+		errno = err;
+		return NULL;
+	}
+	if (__atomic_load_n(&seg->magic, __ATOMIC_ACQUIRE) != TSBS_MAGIC ||
+	    seg->version != TSBS_VERSION || seg->size != sizeof(*seg)) {
+		munmap(seg, sizeof(*seg));
+		errno = EPROTO;
+		return NULL;
+	}
+	return seg;
+}
+
+static inline void tsbs_close(struct tsbs_segment *seg)
+{
+	munmap(seg, sizeof(*seg));
+}
+
+/* Copies out a consistent state.  Returns 0, or -1 with errno EAGAIN
+ * after TSBS_READ_TRIES torn copies. */
+static inline int tsbs_read(const struct tsbs_segment *seg,
+			    struct tsbs_state *st)
+{
+	uint32_t s0, s1;
+	int i;
+
+	for (i = 0; i < TSBS_READ_TRIES; i++) {
+		s0 = __atomic_load_n(&seg->seq, __ATOMIC_ACQUIRE);
+		if (s0 & 1)
+			continue;
+		memcpy(st, (const void *)&seg->state, sizeof(*st));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		s1 = __atomic_load_n(&seg->seq, __ATOMIC_RELAXED);
+		if (s0 == s1)
+			return 0;
+	}
+	errno = EAGAIN;
+	return -1;
+}
+
+/* Time since st was read from the board.  Much more than
+ * info.period_ns means the publisher has stopped. */
+static inline uint64_t tsbs_age_ns(const struct tsbs_state *st)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec - st->mono_ns;
+}
+
+#endif
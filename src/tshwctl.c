@@ -2,6 +2,7 @@
 
 #define _GNU_SOURCE
 
+#include <ctype.h>
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
@@ -14,17 +15,66 @@
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <pthread.h>
 
-#include "fpga.c"
+#include "set_uart_baud.c"
+#define SILABS_NO_MAIN
+#include "silabs.c"
 
-void usage(char **argv) {
+/* One setting of an --apply config */
+struct apply_step {
+	char line[128];		/* As written, for the report */
+	char words[128];	/* Split up for the silabs commands */
+	int lineno;
+	int kind;
+	uint32_t offs;		/* APPLY_FPGA, APPLY_UART: register */
+	int width;		/* Bytes */
+	uint64_t val;
+	struct silab_batch_cmd *cmd; /* APPLY_I2C */
+	const char *res;
+	uint64_t ns;
+};
+
+#define APPLY_FPGA 0
+#define APPLY_UART 1
+#define APPLY_I2C 2
+
+#define APPLY_MAX_STEPS 256
+#define UART_CLK_REG 0x7c /* Write only */
+
+struct apply {
+	struct apply_step step[APPLY_MAX_STEPS];
+	struct silab_batch_cmd cmd[APPLY_MAX_STEPS];
+	int nsteps, ncmds, nfpga;
+	uint64_t fpga_ns, i2c_ns;
+};
+
+static void usage(char **argv) {
 	fprintf(stderr,
 		"Usage: %s [OPTIONS] ...\n"
 		"embeddedTS System Utility\n"
 		"\n"
 		"  -i, --info             Print board revisions\n"
+		"  -a, --apply <file>     Bring the hardware to the settings in <file>\n"
+		"                         (- for stdin) in one pass\n"
 		"  -h, --help             This message\n"
-		"\n",
+		"\n"
+		"An --apply config has one setting per line, # starts a comment:\n"
+		"  uart <port> <baud>             UART clock, as set_uart_baud\n"
+		"  fpga <offs> <value> [<bits>]   FPGA register preset, 32 bits\n"
+		"                                 unless 8, 16 or 64 is given\n"
+		"  <silabs setting>               flags set|clear <N>,\n"
+		"                                 scaps enable|disable,\n"
+		"                                 scaps default enable|disable,\n"
+		"                                 scaps current [default] <mA>,\n"
+		"                                 fan enable|disable,\n"
+		"                                 wdog set <ms>|disable|feed\n"
+		"The file is checked and every FPGA value worked out before anything\n"
+		"is written.  The FPGA writes and the silabs commands then run at the\n"
+		"same time, the silabs ones as one silabs batch.  FPGA presets and\n"
+		"silabs settings that already hold are left alone; UART clocks (a\n"
+		"write only register) and the watchdog are always written.  Each\n"
+		"line is reported with its result and time.\n",
 		argv[0]
 	);
 }
@@ -53,13 +103,261 @@ static int get_model(void)
 	}
 }
 
+static uint64_t fpga_peekw(int width, uint32_t offs)
+{
+	switch (width) {
+	case 1: return fpga_peek8(offs);
+	case 2: return fpga_peek16(offs);
+	case 8: return fpga_peek64(offs);
+	default: return fpga_peek32(offs);
+	}
+}
+
+static void fpga_pokew(int width, uint32_t offs, uint64_t val)
+{
+	switch (width) {
+	case 1: fpga_poke8(offs, val); break;
+	case 2: fpga_poke16(offs, val); break;
+	case 8: fpga_poke64(offs, val); break;
+	default: fpga_poke32(offs, val); break;
+	}
+}
+
+/* A whole number, decimal or 0x hex, and nothing after it */
+static int apply_num(const char *s, uint64_t *val)
+{
+	char *end;
+
+	if (!isdigit((unsigned char)*s))
+		return 0;
+	errno = 0;
+	*val = strtoull(s, &end, 0);
+	return !*end && !errno;
+}
+
+/* Whether a setting's arguments are what silabs takes: digits where it
+ * wants a number, enable or disable for scaps default */
+static int apply_silab_args(const struct silab_batch_cmd *c)
+{
+	const char *last = c->argv[c->argc - 1];
+
+	if (strcmp(c->argv[2], "set") == 0 ||
+	    strcmp(c->argv[2], "clear") == 0 ||
+	    strcmp(c->argv[2], "current") == 0)
+		return my_isnum(last) &&
+		       (c->argc == 4 || strcmp(c->argv[3], "default") == 0) &&
+		       (strcmp(c->argv[1], "flags") || atoi(last) < 8);
+	if (strcmp(c->argv[2], "default") == 0)
+		return strcmp(last, "enable") == 0 ||
+		       strcmp(last, "disable") == 0;
+	return 1;
+}
+
+/* Fills in st from the line, computing any FPGA value.  Returns 0, or 1
+ * with the reason printed. */
+static int apply_parse(struct apply *a, struct apply_step *st,
+		       const char *path)
+{
+	struct silab_batch_cmd *c = &a->cmd[a->ncmds];
+	char *w[4] = { 0 }, *p, *save;
+	uint64_t port, baud, bits;
+	int n, kind;
+
+	memcpy(st->words, st->line, sizeof(st->words));
+	n = 0;
+	for (p = strtok_r(st->words, " \t", &save); p;
+	     p = strtok_r(NULL, " \t", &save))
+		if (n++ < 4)
+			w[n - 1] = p;
+
+	if (strcmp(w[0], "uart") == 0) {
+		if (n != 3 || !apply_num(w[1], &port) || port > 7 ||
+		    !apply_num(w[2], &baud) || baud < 115200 ||
+		    baud > BAUD_MAX) {
+			fprintf(stderr, "%s:%d: need uart <0-7> <115200-%d>\n",
+				path, st->lineno, BAUD_MAX);
+			return 1;
+		}
+		st->kind = APPLY_UART;
+		st->offs = UART_CLK_REG;
+		st->width = 4;
+		st->val = set_baudrate(port, baud);
+		a->nfpga++;
+	} else if (strcmp(w[0], "fpga") == 0) {
+		uint64_t offs = 0;
+
+		bits = 32;
+		if (n < 3 || n > 4 || !apply_num(w[1], &offs) ||
+		    !apply_num(w[2], &st->val) ||
+		    (n == 4 && !apply_num(w[3], &bits)) ||
+		    (bits != 8 && bits != 16 && bits != 32 && bits != 64) ||
+		    offs > 4096 - bits / 8 || offs % (bits / 8)) {
+			fprintf(stderr, "%s:%d: need fpga <offs> <value> "
+				"[8|16|32|64], aligned, below 4096\n", path,
+				st->lineno);
+			return 1;
+		}
+		/* Wider than the register would never read back unchanged */
+		if (bits < 64 && st->val >> bits) {
+			fprintf(stderr, "%s:%d: 0x%llx does not fit in %d bits\n",
+				path, st->lineno, (unsigned long long)st->val,
+				(int)bits);
+			return 1;
+		}
+		st->kind = APPLY_FPGA;
+		st->offs = offs;
+		st->width = bits / 8;
+		a->nfpga++;
+	} else {
+		memcpy(st->words, st->line, sizeof(st->words));
+		if (silab_batch_parse(c, "silabs", st->words) < 0) {
+			fprintf(stderr, "%s:%d: %s: too many words\n",
+				path, st->lineno, st->line);
+			return 1;
+		}
+		kind = silab_batch_kind(c);
+		/* Settings only.  Queries set nothing, and the rest (a typo,
+		 * reboot, sleep, monitor, wdog daemon) would run as is. */
+		if (kind != SILAB_BATCH_REG && kind != SILAB_BATCH_WDOG) {
+			fprintf(stderr, "%s:%d: %s is not a silabs setting\n",
+				path, st->lineno, st->line);
+			return 1;
+		}
+		if (!apply_silab_args(c)) {
+			fprintf(stderr, "%s:%d: %s: bad argument\n",
+				path, st->lineno, st->line);
+			return 1;
+		}
+		st->kind = APPLY_I2C;
+		st->cmd = c;
+		a->ncmds++;
+	}
+	return 0;
+}
+
+/* Reads the config into a, nothing is touched yet */
+static int apply_load(struct apply *a, const char *path)
+{
+	FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+	struct apply_step *st;
+	char line[256], *p;
+	int lineno = 0, ret = 0;
+
+	if (!f) {
+		perror(path);
+		return 1;
+	}
+	while (!ret && fgets(line, sizeof(line), f)) {
+		lineno++;
+		for (p = line; *p == ' ' || *p == '\t'; p++)
+			;
+		p[strcspn(p, "#\r\n")] = 0;
+		while (*p && strchr(" \t", p[strlen(p) - 1]))
+			p[strlen(p) - 1] = 0;
+		if (!*p)
+			continue;
+		if (a->nsteps == APPLY_MAX_STEPS || strlen(p) >= sizeof(st->line)) {
+			fprintf(stderr, "%s:%d: too many or too long lines\n",
+				path, lineno);
+			ret = 1;
+			break;
+		}
+		st = &a->step[a->nsteps++];
+		snprintf(st->line, sizeof(st->line), "%s", p);
+		st->lineno = lineno;
+		ret = apply_parse(a, st, path);
+	}
+	if (f != stdin)
+		fclose(f);
+	return ret;
+}
+
+/* FPGA thread: the UART clocks, and the presets that differ */
+static void *apply_fpga(void *arg)
+{
+	struct apply *a = arg;
+	struct apply_step *st;
+	uint64_t t0 = silab_ns(), t;
+	int i;
+
+	fpga_init();
+	for (i = 0; i < a->nsteps; i++) {
+		st = &a->step[i];
+		if (st->kind == APPLY_I2C)
+			continue;
+		t = silab_ns();
+		if (st->kind == APPLY_FPGA &&
+		    fpga_peekw(st->width, st->offs) == st->val) {
+			st->res = "unchanged";
+		} else {
+			fpga_pokew(st->width, st->offs, st->val);
+			st->res = "ok";
+		}
+		st->ns = silab_ns() - t;
+	}
+	a->fpga_ns = silab_ns() - t0;
+	return NULL;
+}
+
+static void apply_i2c_done(const struct silab_batch_cmd *c)
+{
+}
+
+static int apply(const char *path)
+{
+	struct apply *a = calloc(1, sizeof(*a));
+	struct apply_step *st;
+	uint64_t t0 = silab_ns(), t;
+	pthread_t fpga_thread;
+	int i, fpga_started = 0, ret = 0;
+
+	assert(a);
+	if (apply_load(a, path)) {
+		free(a);
+		return 1;
+	}
+
+	if (a->nfpga)
+		fpga_started = pthread_create(&fpga_thread, NULL, apply_fpga,
+					      a) == 0;
+	if (a->nfpga && !fpga_started)
+		apply_fpga(a);
+	if (a->ncmds) {
+		t = silab_ns();
+		silab_batch_run(&silab_default, a->cmd, a->ncmds,
+					     apply_i2c_done);
+		a->i2c_ns = silab_ns() - t;
+	}
+	if (fpga_started)
+		pthread_join(fpga_thread, NULL);
+
+	for (i = 0; i < a->nsteps; i++) {
+		st = &a->step[i];
+		if (st->kind == APPLY_I2C) {
+			st->res = st->cmd->res ? st->cmd->res :
+				  st->cmd->r ? "error" : "ok";
+			st->ns = st->cmd->us * 1000ULL;
+		}
+		if (strcmp(st->res, "error") == 0)
+			ret = 1;
+		printf("%s: %s us=%.1f\n", st->line, st->res, st->ns / 1e3);
+	}
+	printf("fpga_us=%.1f\n", a->fpga_ns / 1e3);
+	printf("i2c_us=%.1f\n", a->i2c_ns / 1e3);
+	printf("total_us=%.1f\n", (silab_ns() - t0) / 1e3);
+	free(a);
+	return ret;
+}
+
 int main(int argc, char **argv)
 {
 	int c;
 	int opt_info = 0;
+	const char *opt_apply = NULL;
 
 	static struct option long_options[] = {
 		{ "info", 0, 0, 'i' },
+		{ "apply", required_argument, 0, 'a' },
 		{ "help", 0, 0, 'h' },
 		{ 0, 0, 0, 0 }
 	};
@@ -69,12 +367,16 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	while((c = getopt_long(argc, argv, "im::w:r::l::qc:th", long_options, NULL)) != -1) {
+	while((c = getopt_long(argc, argv, "ia:m::w:r::l::qc:th", long_options, NULL)) != -1) {
 		switch(c) {
 		case 'i':
 			opt_info = 1;
 			break;
 
+		case 'a':
+			opt_apply = optarg;
+			break;
+
 		case ':':
 			fprintf(stderr, "%s: option `-%c' requires an argument\n",
 				argv[0], optopt);
@@ -89,9 +391,8 @@ int main(int argc, char **argv)
 			return 1;
 		}
 	}
-	fpga_init();
-
 	if (opt_info){
+		fpga_init();
 		uint32_t fpga_rev = fpga_peek32(0x0);
 		uint32_t fpga_hash = fpga_peek32(0x4);
 		uint32_t straps = fpga_peek32(0x10) & 0x3f;
@@ -104,6 +405,8 @@ int main(int argc, char **argv)
 			printf("fpga_hash=\"%x\"\n", fpga_hash);
 		printf("opts=0x%X\n", straps);
 	}
+	if (opt_apply)
+		return apply(opt_apply);
 
 	return 0;
 }
@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* USDT probes (sys/sdt.h), provider "tsutils".  Each one is a nop in the
+ * code plus an ELF note until perf, bpftrace or SystemTap attach to it, so
+ * they are always built in when configure finds sys/sdt.h, and compile to
+ * nothing without it.  contrib/bpftrace has scripts using them.
+ *
+ *	fpga_open(path, fd)			fpga_init(), the open
+ *	fpga_mmap(fd, addr)			fpga_init(), the mapping
+ *	i2c_read_start(subadr, len)		silabs I2C_RDWR ioctls,
+ *	i2c_read_done(subadr, len, ret)		ret 0 or errno
+ *	i2c_readv_start(nregions, len)
+ *	i2c_readv_done(nregions, len, ret)
+ *	i2c_write_start(subadr, len)
+ *	i2c_write_done(subadr, len, ret)
+ *	wdog_feed(ret)				silabs watchdog feed
+ *	flash_write_start(offs, len)		load_fpga_flash, each chunk
+ *	flash_write_done(offs, len, ret)
+ *	sector_io_start(write, sect, n)		tsprodinfo, each pread/pwrite
+ *	sector_io_done(write, sect, n, ret)	ret 0 or -errno
+ */
+
+#ifndef TSPROBES_H
+#define TSPROBES_H
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TS_PROBE1(name, a) DTRACE_PROBE1(tsutils, name, a)
+#define TS_PROBE2(name, a, b) DTRACE_PROBE2(tsutils, name, a, b)
+#define TS_PROBE3(name, a, b, c) DTRACE_PROBE3(tsutils, name, a, b, c)
+#define TS_PROBE4(name, a, b, c, d) DTRACE_PROBE4(tsutils, name, a, b, c, d)
+#else
+#define TS_PROBE1(name, a) do { } while (0)
+#define TS_PROBE2(name, a, b) do { } while (0)
+#define TS_PROBE3(name, a, b, c) do { } while (0)
+#define TS_PROBE4(name, a, b, c, d) do { } while (0)
+#endif
+
+#endif
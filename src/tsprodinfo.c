@@ -1,19 +1,844 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <endian.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <linux/fs.h>
 #include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <string.h>
+#include <time.h>
+
+#include "tsprobes.h"
 
 #define MAGIC_STRING "TSPROD"
+/* Legacy records written by this version end in a marker and a CRC-32 of
+ * bytes 0-507.  The byte in front of the marker is 0, and older versions
+ * never wrote anything after the NUL ending the text, so their records
+ * cannot look marked even when the text reaches into the CRC bytes.
+ * Records without the marker are read as plain text. */
+#define LEGACY_MARK_OFF 504
+#define LEGACY_MARK "TSC1"
+#define LEGACY_CRC_OFF 508
+
+/* Indexed key/value format.  The header replaces the legacy record in the
+ * last sector, the entries live in the 'sectors' sectors in front of it:
+ *
+ *   [data 0] ... [data sectors-1] [header + index]
+ *
+ * Index entries are sorted on the key hash, so a lookup reads the header
+ * and then only the sector(s) holding that one entry.  Each entry is
+ * type(1) klen(1) vlen(2, LE) key value, and may cross sector boundaries.
+ * All multi-byte fields are little endian.  The header carries a CRC-32 of
+ * its sector.
+ *
+ * A changed entry is appended to the free end of the data area and the
+ * header write is what makes it visible.  When the area is full the live
+ * entries are compacted into a second bank of 'sectors' sectors in front
+ * of the first, and the header's bank field says which one is in use, so
+ * the entries the header on the device points at are never overwritten. */
+#define KV_MAGIC "TSPROD2"
+#define KV_VERSION 2
+#define KV_DEFAULT_SECTORS 8
+/* Entry offsets are 16 bits */
+#define KV_MAX_SECTORS 127
+#define KV_TYPE_STRING 1
+#define KV_ENT_HDR 4
+
+struct kv_hdr {
+	char magic[8];
+	uint8_t version;
+	uint8_t sectors;	/* Data sectors in front of the header */
+	uint16_t count;		/* Entries in the index */
+	uint16_t used;		/* Bytes of the data area written so far */
+	uint8_t bank;		/* Data area in use, 1 is in front of 0 */
+	uint8_t reserved;
+	uint32_t crc;		/* Of the header sector with this field 0 */
+} __attribute__((packed));
+
+struct kv_idx {
+	uint32_t hash;		/* FNV-1a of the key */
+	uint16_t off;		/* Entry offset in the data area */
+	uint16_t len;		/* Entry length including its header */
+} __attribute__((packed));
+
+#define KV_MAX_ENTRIES ((512 - sizeof(struct kv_hdr)) / sizeof(struct kv_idx))
+
+struct prod_dev {
+	int fd;
+	const char *path;
+	int direct;		/* fd is O_DIRECT */
+	unsigned written;	/* Sectors actually written */
+	uint64_t nsect;		/* Device size in sectors */
+	int format;		/* FMT_* of the last sector */
+	uint8_t sect[512];	/* Last sector as read from the device */
+	struct kv_hdr hdr;	/* Host endian copies when format == FMT_KV */
+	struct kv_idx idx[KV_MAX_ENTRIES];
+	int disk_bank;		/* Bank of the header on the device, -1 if none */
+};
+
+/* FMT_BAD is a record whose CRC does not match */
+enum { FMT_NONE, FMT_LEGACY, FMT_KV, FMT_BAD };
+
+static uint32_t kv_hash(const char *key, size_t len)
+{
+	uint32_t h = 2166136261u;
+
+	while (len--) {
+		h ^= (uint8_t)*key++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static uint32_t crc32(const uint8_t *p, size_t len)
+{
+	uint32_t crc = 0xffffffff;
+	int i;
+
+	while (len--) {
+		crc ^= *p++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+static int sector_io(struct prod_dev *d, int wr, uint64_t sect, unsigned n,
+		     void *buf);
+
+/* O_DIRECT keeps the page cache and its readahead out of single sector
+ * accesses.  Devices or filesystems that refuse it (tmpfs, 4k logical
+ * blocks) fall back to buffered I/O. */
+static int prod_reopen(struct prod_dev *d, int direct)
+{
+	if (d->fd >= 0)
+		close(d->fd);
+	d->direct = direct;
+	d->fd = open(d->path, O_RDWR|(direct ? O_DIRECT : 0));
+	if (d->fd < 0 && direct && errno == EINVAL)
+		return prod_reopen(d, 0);
+	return d->fd < 0 ? -errno : 0;
+}
+
+static int sector_io(struct prod_dev *d, int wr, uint64_t sect, unsigned n,
+		     void *buf)
+{
+	void *bounce = buf;
+	ssize_t r;
+	int err;
+
+	if (n == 0)
+		return 0;
+	if (d->direct && ((uintptr_t)buf & 4095)) {
+		if (posix_memalign(&bounce, 4096, n * 512))
+			return -ENOMEM;
+		if (wr)
+			memcpy(bounce, buf, n * 512);
+	}
+
+	TS_PROBE3(sector_io_start, wr, sect, n);
+	if (wr)
+		r = pwrite(d->fd, bounce, n * 512, sect * 512);
+	else
+		r = pread(d->fd, bounce, n * 512, sect * 512);
+	err = errno;
+	TS_PROBE4(sector_io_done, wr, sect, n,
+		  r < 0 ? -err : r != n * 512 ? -EIO : 0);
+
+	if (bounce != buf) {
+		if (!wr && r == n * 512)
+			memcpy(buf, bounce, n * 512);
+		free(bounce);
+	}
+
+	if (r < 0 && err == EINVAL && d->direct) {
+		r = prod_reopen(d, 0);
+		return r ? r : sector_io(d, wr, sect, n, buf);
+	}
+	if (r < 0)
+		return -err;
+	if (r != n * 512)
+		return -EIO;
+	if (wr)
+		d->written += n;
+	return 0;
+}
+
+static int sector_read(struct prod_dev *d, uint64_t sect, unsigned n, void *buf)
+{
+	return sector_io(d, 0, sect, n, buf);
+}
+
+/* Callers compare against what they read first, so this only runs for
+ * content that actually changed */
+static int sector_write(struct prod_dev *d, uint64_t sect, unsigned n,
+			const void *buf)
+{
+	return sector_io(d, 1, sect, n, (void *)buf);
+}
+
+/* Writes the sectors of new that differ from old, in runs */
+static int sector_write_changed(struct prod_dev *d, uint64_t sect, unsigned n,
+				const uint8_t *old, const uint8_t *new)
+{
+	unsigned i, run;
+	int r;
+
+	for (i = 0; i < n; i += run) {
+		if (!memcmp(old + i * 512, new + i * 512, 512)) {
+			run = 1;
+			continue;
+		}
+		for (run = 1; i + run < n &&
+		     memcmp(old + (i + run) * 512, new + (i + run) * 512, 512); run++)
+			;
+		r = sector_write(d, sect + i, run, new + i * 512);
+		if (r)
+			return r;
+	}
+	return 0;
+}
+
+/* First sector of a data area */
+static uint64_t kv_bank_sect(struct prod_dev *d, int bank)
+{
+	return d->nsect - 1 - (uint64_t)d->hdr.sectors * (bank + 1);
+}
+
+static uint64_t kv_data_sect(struct prod_dev *d)
+{
+	return kv_bank_sect(d, d->hdr.bank);
+}
+
+/* Reads the last sector and, for the indexed format, unpacks its index */
+static int prod_open(struct prod_dev *d, const char *path)
+{
+	struct kv_hdr *h = (struct kv_hdr *)d->sect;
+	struct kv_idx *ix = (struct kv_idx *)(d->sect + sizeof(*h));
+	off_t sz;
+	int r, i;
+	uint32_t crc;
+
+	memset(d, 0, sizeof(*d));
+	d->fd = -1;
+	d->path = path;
+	d->disk_bank = -1;
+	r = prod_reopen(d, 1);
+	if (r)
+		return r;
+	sz = lseek(d->fd, 0, SEEK_END);
+	if (sz < 512)
+		return sz < 0 ? -errno : -ENOSPC;
+	d->nsect = sz / 512;
+
+	r = sector_read(d, d->nsect - 1, 1, d->sect);
+	if (r)
+		return r;
+
+	if (memcmp(h->magic, KV_MAGIC, sizeof(h->magic)) == 0 &&
+	    h->version == KV_VERSION) {
+		crc = le32toh(h->crc);
+		h->crc = 0;
+		d->format = crc32(d->sect, 512) == crc ? FMT_KV : FMT_BAD;
+		h->crc = htole32(crc);
+		if (d->format == FMT_BAD)
+			return 0;
+		d->hdr = *h;
+		d->hdr.count = le16toh(h->count);
+		d->hdr.used = le16toh(h->used);
+		if (d->hdr.count > KV_MAX_ENTRIES ||
+		    d->hdr.sectors > KV_MAX_SECTORS || d->hdr.bank > 1 ||
+		    (uint64_t)d->hdr.sectors * (d->hdr.bank + 1) >= d->nsect ||
+		    d->hdr.used > d->hdr.sectors * 512)
+			return -EUCLEAN;
+		d->disk_bank = d->hdr.bank;
+		for (i = 0; i < d->hdr.count; i++) {
+			d->idx[i].hash = le32toh(ix[i].hash);
+			d->idx[i].off = le16toh(ix[i].off);
+			d->idx[i].len = le16toh(ix[i].len);
+		}
+	} else if (strcmp(MAGIC_STRING, (char *)d->sect) == 0) {
+		d->format = FMT_LEGACY;
+		crc = le32toh(*(uint32_t *)&d->sect[LEGACY_CRC_OFF]);
+		if (d->sect[LEGACY_MARK_OFF - 1] == 0 &&
+		    !memcmp(&d->sect[LEGACY_MARK_OFF], LEGACY_MARK, 4) &&
+		    crc32(d->sect, LEGACY_CRC_OFF) != crc)
+			d->format = FMT_BAD;
+	} else {
+		d->format = FMT_NONE;
+	}
+
+	return 0;
+}
+
+/* Writes the header and index if kv_set() changed them.  Entries are
+ * written by kv_set() itself where the header on the device does not
+ * point, so this is the commit point. */
+static int kv_write_hdr(struct prod_dev *d)
+{
+	uint8_t buf[512];
+	struct kv_hdr *h = (struct kv_hdr *)buf;
+	struct kv_idx *ix = (struct kv_idx *)(buf + sizeof(*h));
+	int i, r;
+
+	memset(buf, 0, sizeof(buf));
+	*h = d->hdr;
+	h->count = htole16(d->hdr.count);
+	h->used = htole16(d->hdr.used);
+	for (i = 0; i < d->hdr.count; i++) {
+		ix[i].hash = htole32(d->idx[i].hash);
+		ix[i].off = htole16(d->idx[i].off);
+		ix[i].len = htole16(d->idx[i].len);
+	}
+	h->crc = 0;
+	h->crc = htole32(crc32(buf, sizeof(buf)));
+
+	if (d->format != FMT_KV || !memcmp(buf, d->sect, sizeof(buf)))
+		return 0;
+	r = sector_write(d, d->nsect - 1, 1, buf);
+	if (r == 0) {
+		memcpy(d->sect, buf, sizeof(buf));
+		d->disk_bank = d->hdr.bank;
+	}
+	return r;
+}
+
+/* Reads the sectors covering [off, off + len) of the data area into buf,
+ * which must hold them all.  Returns the offset of 'off' within buf. */
+static int kv_read_span(struct prod_dev *d, uint16_t off, uint16_t len,
+			uint8_t *buf)
+{
+	unsigned first = off / 512, last = (off + len - 1) / 512;
+	int r;
+
+	r = sector_read(d, kv_data_sect(d) + first, last - first + 1, buf);
+	return r ? r : off % 512;
+}
+
+/* Index position of key, or -ENOENT.  Reads the candidate sector(s). */
+static int kv_find(struct prod_dev *d, const char *key, uint8_t *buf, int *pos)
+{
+	size_t klen = strlen(key);
+	uint32_t h = kv_hash(key, klen);
+	int lo = 0, hi = d->hdr.count, mid, r;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (d->idx[mid].hash < h)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	/* Equal hashes sit next to each other */
+	for (; lo < d->hdr.count && d->idx[lo].hash == h; lo++) {
+		r = kv_read_span(d, d->idx[lo].off, d->idx[lo].len, buf);
+		if (r < 0)
+			return r;
+		if (buf[r + 1] == klen && memcmp(&buf[r + KV_ENT_HDR], key, klen) == 0) {
+			*pos = r;
+			return lo;
+		}
+	}
+
+	return -ENOENT;
+}
+
+/* Looks up key and returns a malloc()ed, NUL terminated copy of its value */
+static int kv_get(struct prod_dev *d, const char *key, char **val)
+{
+	uint8_t *buf;
+	int i, pos;
+	uint16_t vlen;
+
+	if (d->format == FMT_LEGACY) {
+		/* The legacy record is free text, by convention key=value lines */
+		char *line, *save, *text = strndup((char *)d->sect + sizeof(MAGIC_STRING),
+					       512 - sizeof(MAGIC_STRING));
+		size_t klen = strlen(key);
+
+		for (line = strtok_r(text, "\n", &save); line;
+		     line = strtok_r(NULL, "\n", &save)) {
+			if (strncmp(line, key, klen) == 0 && line[klen] == '=') {
+				*val = strdup(line + klen + 1);
+				free(text);
+				return 0;
+			}
+		}
+		free(text);
+		return -ENOENT;
+	}
+	if (d->format == FMT_BAD)
+		return -EBADMSG;
+	if (d->format != FMT_KV)
+		return -ENOENT;
+
+	buf = malloc(d->hdr.sectors * 512);
+	if (!buf)
+		return -ENOMEM;
+	i = kv_find(d, key, buf, &pos);
+	if (i >= 0) {
+		vlen = buf[pos + 2] | buf[pos + 3] << 8;
+		*val = strndup((char *)&buf[pos + KV_ENT_HDR + buf[pos + 1]], vlen);
+		i = *val ? 0 : -ENOMEM;
+	}
+	free(buf);
+	return i;
+}
+
+/* Creates an empty index in front of which 'sectors' data sectors live.
+ * key=value lines of a legacy record are carried over by the caller. */
+static void kv_init(struct prod_dev *d, uint8_t sectors)
+{
+	memset(&d->hdr, 0, sizeof(d->hdr));
+	memcpy(d->hdr.magic, KV_MAGIC, sizeof(d->hdr.magic));
+	d->hdr.version = KV_VERSION;
+	d->hdr.sectors = sectors;
+	d->format = FMT_KV;
+}
+
+/* Puts an entry into the index in place of position 'old' (-1 for a new
+ * key), keeping the index sorted on the hash */
+static void kv_idx_replace(struct prod_dev *d, int old, uint32_t h,
+			   uint16_t off, uint16_t len)
+{
+	int i;
+
+	if (old >= 0) {
+		memmove(&d->idx[old], &d->idx[old + 1],
+			(d->hdr.count - old - 1) * sizeof(d->idx[0]));
+		d->hdr.count--;
+	}
+	for (i = 0; i < d->hdr.count && d->idx[i].hash <= h; i++)
+		;
+	memmove(&d->idx[i + 1], &d->idx[i],
+		(d->hdr.count - i) * sizeof(d->idx[0]));
+	d->idx[i].hash = h;
+	d->idx[i].off = off;
+	d->idx[i].len = len;
+	d->hdr.count++;
+}
+
+/* Writes the live entries except index position 'skip', in index order,
+ * followed by ent, into the bank the header on the device does not use.
+ * The index only changes once that write succeeded. */
+static int kv_compact(struct prod_dev *d, int skip, const uint8_t *ent,
+		      uint16_t len, uint32_t h)
+{
+	uint8_t *old, *cur, *new;
+	uint16_t used = 0, off[KV_MAX_ENTRIES];
+	size_t sz = d->hdr.sectors * 512;
+	unsigned n;
+	int i, bank, r;
+
+	/* A compaction not committed yet is redone in its own bank */
+	bank = d->disk_bank == d->hdr.bank ? !d->hdr.bank : d->hdr.bank;
+	if ((uint64_t)d->hdr.sectors * (bank + 1) >= d->nsect)
+		return -ENOSPC;
+
+	old = malloc(sz);
+	cur = malloc(sz);
+	new = calloc(1, sz);
+	if (!old || !cur || !new) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	r = sector_read(d, kv_data_sect(d), (d->hdr.used + 511) / 512, old);
+	if (r)
+		goto out;
+	for (i = 0; i < d->hdr.count; i++) {
+		if (i == skip)
+			continue;
+		memcpy(new + used, old + d->idx[i].off, d->idx[i].len);
+		off[i] = used;
+		used += d->idx[i].len;
+	}
+	memcpy(new + used, ent, len);
+
+	/* Only sectors that differ from what the bank holds are written */
+	n = (used + len + 511) / 512;
+	r = sector_read(d, kv_bank_sect(d, bank), n, cur);
+	if (r == 0)
+		r = sector_write_changed(d, kv_bank_sect(d, bank), n, cur, new);
+	if (r)
+		goto out;
+
+	for (i = 0; i < d->hdr.count; i++)
+		if (i != skip)
+			d->idx[i].off = off[i];
+	kv_idx_replace(d, skip, h, used, len);
+	d->hdr.bank = bank;
+	d->hdr.used = used + len;
+out:
+	free(old);
+	free(cur);
+	free(new);
+	return r;
+}
+
+/* Stores key.  The entry goes where the header on the device does not
+ * point and the index in memory only changes once it is written, so a
+ * failure leaves both the device and the index as they were. */
+static int kv_set(struct prod_dev *d, const char *key, const char *val,
+		  uint8_t sectors)
+{
+	size_t klen = strlen(key), vlen = strlen(val);
+	uint16_t len = KV_ENT_HDR + klen + vlen, off;
+	uint32_t h = kv_hash(key, klen);
+	uint8_t *buf, *ent;
+	int i, j, pos, r;
+	unsigned first, last, live;
+
+	if (klen == 0 || klen > 255 || KV_ENT_HDR + klen + vlen > 0xffff)
+		return -EINVAL;
+	/* Rewrite with --write first to start over */
+	if (d->format == FMT_BAD)
+		return -EBADMSG;
 
-void usage(char **argv) {
+	if (d->format != FMT_KV) {
+		char *text = NULL, *line, *save, *eq;
+		int format = d->format;
+
+		/* Room for the data area and the bank compaction uses */
+		if (sectors == 0 || sectors > KV_MAX_SECTORS ||
+		    (uint64_t)sectors * 2 >= d->nsect)
+			return -EINVAL;
+		if (d->format == FMT_LEGACY)
+			text = strndup((char *)d->sect + sizeof(MAGIC_STRING),
+				       512 - sizeof(MAGIC_STRING));
+		kv_init(d, sectors);
+		for (line = text ? strtok_r(text, "\n", &save) : NULL; line;
+		     line = strtok_r(NULL, "\n", &save)) {
+			eq = strchr(line, '=');
+			if (!eq || eq == line)
+				continue;
+			*eq = 0;
+			r = kv_set(d, line, eq + 1, sectors);
+			if (r) {
+				/* The record on the device is untouched */
+				d->format = format;
+				free(text);
+				return r;
+			}
+		}
+		free(text);
+	}
+
+	if (len > d->hdr.sectors * 512)
+		return -ENOSPC;
+	buf = malloc(d->hdr.sectors * 512);
+	ent = malloc(len);
+	if (!buf || !ent) {
+		r = -ENOMEM;
+		goto out;
+	}
+	ent[0] = KV_TYPE_STRING;
+	ent[1] = klen;
+	ent[2] = vlen & 0xff;
+	ent[3] = vlen >> 8;
+	memcpy(&ent[KV_ENT_HDR], key, klen);
+	memcpy(&ent[KV_ENT_HDR + klen], val, vlen);
+
+	r = i = kv_find(d, key, buf, &pos);
+	if (i < 0 && i != -ENOENT)
+		goto out;
+	r = 0;
+	/* Rewriting the same value costs no write */
+	if (i >= 0 && d->idx[i].len == len && !memcmp(&buf[pos], ent, len))
+		goto out;
+	if (i < 0 && d->hdr.count == KV_MAX_ENTRIES) {
+		r = -ENOSPC;
+		goto out;
+	}
+
+	if (d->hdr.used + len > d->hdr.sectors * 512) {
+		/* Fits once everything but the old value is packed? */
+		for (live = len, j = 0; j < d->hdr.count; j++)
+			if (j != i)
+				live += d->idx[j].len;
+		if (live > d->hdr.sectors * 512)
+			r = -ENOSPC;
+		else
+			r = kv_compact(d, i, ent, len, h);
+		goto out;
+	}
+
+	/* Appended after the data in use.  Only the sectors the entry
+	 * touches are read and rewritten. */
+	off = d->hdr.used;
+	first = off / 512;
+	last = (off + len - 1) / 512;
+	r = sector_read(d, kv_data_sect(d) + first, last - first + 1, buf);
+	if (r == 0) {
+		memcpy(&buf[off % 512], ent, len);
+		r = sector_write(d, kv_data_sect(d) + first,
+				 last - first + 1, buf);
+	}
+	if (r == 0) {
+		d->hdr.used += len;
+		kv_idx_replace(d, i, h, off, len);
+	}
+out:
+	free(ent);
+	free(buf);
+	return r;
+}
+
+/* Buffered fallback writes still sit in the page cache */
+static int prod_sync(struct prod_dev *d)
+{
+	if (d->written && !d->direct && fdatasync(d->fd) < 0)
+		return -errno;
+	return 0;
+}
+
+static int prod_close(struct prod_dev *d)
+{
+	int r = prod_sync(d);
+
+	if (close(d->fd) < 0 && !r)
+		r = -errno;
+	d->fd = -1;
+	return r;
+}
+
+/* Prints every entry as key=value, one per line */
+static int kv_dump(struct prod_dev *d)
+{
+	uint8_t *buf;
+	int i, r;
+	const uint8_t *e;
+	uint16_t vlen;
+
+	buf = malloc(d->hdr.sectors * 512);
+	if (!buf)
+		return -ENOMEM;
+	r = sector_read(d, kv_data_sect(d), (d->hdr.used + 511) / 512, buf);
+	for (i = 0; r == 0 && i < d->hdr.count; i++) {
+		e = buf + d->idx[i].off;
+		vlen = e[2] | e[3] << 8;
+		printf("%.*s=%.*s\n", e[1], e + KV_ENT_HDR,
+		       vlen, e + KV_ENT_HDR + e[1]);
+	}
+	free(buf);
+	return r;
+}
+
+/* Bulk provisioning.  Each manifest line is
+ *   <device or image>,<key>=<value>[,<key>=<value>...]
+ * and a field may be double quoted to hold commas.  Targets are written
+ * and read back by a bounded pool of threads; one failing target does not
+ * stop the others. */
+#define MANIFEST_DEFAULT_JOBS 32
+
+struct target {
+	char *path;
+	char **kv;		/* "key=value" */
+	int nkv;
+	int ok;
+	unsigned written;
+	double ms;
+	char err[128];
+};
+
+struct manifest {
+	struct target *t;
+	int n;
+	int next;		/* Next target a worker picks up */
+	uint8_t sectors;
+};
+
+/* Splits one line in place on commas outside double quotes */
+static int csv_split(char *line, char **fields, int max)
+{
+	int n = 0, q = 0;
+	char *in = line, *out = line;
+
+	fields[n++] = out;
+	for (; *in && *in != '\n' && *in != '\r'; in++) {
+		if (*in == '"') {
+			q = !q;
+		} else if (*in == ',' && !q) {
+			*out++ = 0;
+			if (n == max)
+				return -1;
+			fields[n++] = out;
+		} else {
+			*out++ = *in;
+		}
+	}
+	*out = 0;
+	return n;
+}
+
+static int manifest_load(struct manifest *m, const char *file)
+{
+	FILE *f = strcmp(file, "-") ? fopen(file, "r") : stdin;
+	char *line = NULL, *fields[KV_MAX_ENTRIES + 1];
+	size_t sz = 0;
+	int n, i;
+
+	if (!f)
+		return -errno;
+	memset(m, 0, sizeof(*m));
+	/* Lines have no length limit, certificates make long ones */
+	while (getline(&line, &sz, f) >= 0) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		n = csv_split(line, fields, KV_MAX_ENTRIES + 1);
+		if (!*fields[0])
+			continue;
+		m->t = realloc(m->t, (m->n + 1) * sizeof(*m->t));
+		memset(&m->t[m->n], 0, sizeof(*m->t));
+		m->t[m->n].path = strdup(fields[0]);
+		if (n < 0) {
+			snprintf(m->t[m->n].err, sizeof(m->t[m->n].err),
+				 "too many keys");
+			n = 0;
+		}
+		m->t[m->n].kv = calloc(n + 1, sizeof(char *));
+		for (i = 1; i < n; i++)
+			m->t[m->n].kv[m->t[m->n].nkv++] = strdup(fields[i]);
+		m->n++;
+	}
+	free(line);
+	if (f != stdin)
+		fclose(f);
+	return 0;
+}
+
+static double elapsed_ms(const struct timespec *t0)
+{
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) * 1e3 + (t1.tv_nsec - t0->tv_nsec) / 1e6;
+}
+
+static void provision(struct target *t, uint8_t sectors)
+{
+	struct prod_dev d;
+	struct timespec t0;
+	char *key, *val, *got;
+	int i, r;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (t->err[0])
+		goto out;
+
+	r = prod_open(&d, t->path);
+	for (i = 0; r == 0 && i < t->nkv; i++) {
+		key = strdup(t->kv[i]);
+		val = strchr(key, '=');
+		if (!val || val == key)
+			r = -EINVAL;
+		else {
+			*val++ = 0;
+			r = kv_set(&d, key, val, sectors);
+		}
+		free(key);
+	}
+	if (r == 0)
+		r = kv_write_hdr(&d);
+	t->written = d.written;
+	if (d.fd >= 0 && prod_close(&d) < 0 && r == 0)
+		r = -EIO;
+	if (r) {
+		snprintf(t->err, sizeof(t->err), "write: %s", strerror(-r));
+		goto out;
+	}
+
+	/* Verify from a fresh open, so it comes from the device */
+	r = prod_open(&d, t->path);
+	for (i = 0; r == 0 && i < t->nkv; i++) {
+		key = strdup(t->kv[i]);
+		val = strchr(key, '=');
+		*val++ = 0;
+		r = kv_get(&d, key, &got);
+		if (r == 0) {
+			if (strcmp(got, val))
+				r = -EILSEQ;
+			free(got);
+		}
+		if (r)
+			snprintf(t->err, sizeof(t->err), "verify %s: %s", key,
+				 r == -EILSEQ ? "mismatch" : strerror(-r));
+		free(key);
+	}
+	if (d.fd >= 0)
+		prod_close(&d);
+	if (r && !t->err[0])
+		snprintf(t->err, sizeof(t->err), "verify: %s", strerror(-r));
+	t->ok = r == 0;
+out:
+	t->ms = elapsed_ms(&t0);
+}
+
+static void *provision_worker(void *arg)
+{
+	struct manifest *m = arg;
+	int i;
+
+	while ((i = __sync_fetch_and_add(&m->next, 1)) < m->n)
+		provision(&m->t[i], m->sectors);
+	return NULL;
+}
+
+/* Returns the number of targets that failed */
+static int manifest_run(const char *file, int jobs, uint8_t sectors)
+{
+	struct manifest m;
+	pthread_t *thr;
+	struct timespec t0;
+	int i, r, failed = 0;
+
+	r = manifest_load(&m, file);
+	if (r) {
+		fprintf(stderr, "%s: %s\n", file, strerror(-r));
+		return 1;
+	}
+	m.sectors = sectors;
+	if (jobs < 1)
+		jobs = 1;
+	if (jobs > m.n)
+		jobs = m.n;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	thr = calloc(jobs, sizeof(*thr));
+	for (i = 0; i < jobs; i++)
+		if (pthread_create(&thr[i], NULL, provision_worker, &m))
+			break;
+	/* Whatever could not get a thread is done here */
+	if (i == 0)
+		provision_worker(&m);
+	while (i--)
+		pthread_join(thr[i], NULL);
+	free(thr);
+
+	for (i = 0; i < m.n; i++) {
+		printf("target=%s status=%s written=%u ms=%.1f", m.t[i].path,
+		       m.t[i].ok ? "ok" : "fail", m.t[i].written, m.t[i].ms);
+		if (!m.t[i].ok)
+			printf(" error=\"%s\"", m.t[i].err);
+		printf("\n");
+		failed += !m.t[i].ok;
+	}
+	printf("targets=%d failed=%d ms=%.1f\n", m.n, failed, elapsed_ms(&t0));
+
+	return failed;
+}
+
+static void usage(char **argv) {
 	fprintf(stderr,
 		"Usage: %s [OPTIONS] ...\n"
 		"embeddedTS Production Info\n"
@@ -21,11 +846,31 @@ void usage(char **argv) {
 		"  -d, --device           Specify device to read/write\n"
 		"  -r, --read             Read info from last 512b block of typically mmcblk*boot1\n"
 		"  -w, --write            Takes string values from stdin and saves them to device\n"
+		"  -g, --get <key>        Print the value of one key\n"
+		"  -s, --set <key=value>  Store one key, converting to the indexed format\n"
+		"  -n, --sectors <n>      Data sectors used when the index is created (default %d)\n"
+		"  -m, --manifest <csv>   Provision every target in <csv> ('-' for stdin)\n"
+		"  -j, --jobs <n>         Targets provisioned at once (default %d)\n"
 		"  -h, --help             This message\n"
 		"  This stores string values in the last 512b of a given block device.\n"
 		"  returns 0/1 on --read to indicate status of valid block\n"
+		"\n"
+		"  --get and --set use an indexed key/value store in the last sectors of\n"
+		"  the device.  Each lookup reads the index plus the one sector holding\n"
+		"  the key.  --get also finds key=value lines in a legacy --write record,\n"
+		"  and the first --set carries those lines over.  Both may be repeated\n"
+		"  and run in the order given.  The store takes 2 * <n> + 1 sectors at\n"
+		"  the end of the device, the second <n> are used when it is compacted.\n"
+		"\n"
+		"  Sectors whose content would not change are not written.  Writes\n"
+		"  report written=0/1 on stderr.  Records carry a CRC, --read exits\n"
+		"  1 on a mismatch.\n"
+		"\n"
+		"  Manifest lines are <device or image>,<key>=<value>[,...].  Each\n"
+		"  target is written with --set semantics, read back to verify, and\n"
+		"  gets one result line.  Exits 1 if any target failed.\n"
 		"\n",
-		argv[0]
+		argv[0], KV_DEFAULT_SECTORS, MANIFEST_DEFAULT_JOBS
 	);
 }
 
@@ -33,17 +878,29 @@ int main(int argc, char **argv)
 {
 	int i, opt_read = 0, opt_write = 0;
 	char *device = 0;
-	int devfd;
+	struct prod_dev dev;
+	char **kv_ops;
+	int opt_set = 0, opt_jobs = MANIFEST_DEFAULT_JOBS;
+	char *manifest = NULL;
+	int nkv_ops = 0, opt_sectors = KV_DEFAULT_SECTORS, ret = 0, nset = 0;
 
 	static struct option long_options[] = {
 		{ "device", required_argument, 0, 'd' },
 		{ "read", 0, 0, 'r' },
 		{ "write", 0, 0, 'w' },
+		{ "get", required_argument, 0, 'g' },
+		{ "set", required_argument, 0, 's' },
+		{ "sectors", required_argument, 0, 'n' },
+		{ "manifest", required_argument, 0, 'm' },
+		{ "jobs", required_argument, 0, 'j' },
 		{ "help", 0, 0, 'h' },
 		{ 0, 0, 0, 0 }
 	};
 
-	while((i = getopt_long(argc, argv, "d:wrh", long_options, NULL)) != -1) {
+	/* --get/--set in command line order, prefixed with 'g' or 's' */
+	kv_ops = calloc(argc, sizeof(char *));
+
+	while((i = getopt_long(argc, argv, "d:wrg:s:n:m:j:h", long_options, NULL)) != -1) {
 		switch(i) {
 		case 'd':
 			device = strdup(optarg);
@@ -54,6 +911,31 @@ int main(int argc, char **argv)
 		case 'w':
 			opt_write = 1;
 			break;
+		case 'g':
+		case 's':
+			kv_ops[nkv_ops] = malloc(strlen(optarg) + 2);
+			kv_ops[nkv_ops][0] = i;
+			opt_set |= i == 's';
+			strcpy(kv_ops[nkv_ops++] + 1, optarg);
+			break;
+		case 'n': {
+			char *end;
+			long n = strtol(optarg, &end, 10);
+
+			if(!*optarg || *end || n < 1 || n > KV_MAX_SECTORS) {
+				fprintf(stderr, "--sectors must be 1-%d\n",
+					KV_MAX_SECTORS);
+				return 1;
+			}
+			opt_sectors = n;
+			break;
+		}
+		case 'm':
+			manifest = optarg;
+			break;
+		case 'j':
+			opt_jobs = atoi(optarg);
+			break;
 		case ':':
 			fprintf(stderr, "%s: option `-%c' requires an argument\n",
 				argv[0], optopt);
@@ -68,79 +950,126 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if(manifest)
+		return manifest_run(manifest, opt_jobs, opt_sectors) ? 1 : 0;
+
 	if(!device) {
 		fprintf(stderr, "Must specify a device\n");
 		return 1;
 	}
 
-	devfd = open(device, O_RDWR);
-	if(devfd < 0)
-	{
-		fprintf(stderr, "%s", strerror(errno));
-		return 1;
-	}
-
-	/* Skip to last 512b sector */
-	if(lseek(devfd, -512, SEEK_END) == -1)
-	{
-		fprintf(stderr, "%s", strerror(errno));
+	i = prod_open(&dev, device);
+	if(i) {
+		fprintf(stderr, "%s: %s\n", device, strerror(-i));
 		return 1;
 	}
 
 	if(opt_write) {
-		int wr;
-		char buf[512];
+		uint8_t buf[512], *end;
+		size_t max = LEGACY_MARK_OFF - sizeof(MAGIC_STRING) - 1, n;
 		bzero(buf, 512);
-		strcpy(buf, MAGIC_STRING);
+		strcpy((char *)buf, MAGIC_STRING);
 
-		for (i = strlen(MAGIC_STRING) + 1; i < 512; i++)
+		/* One extra byte tells too long from exactly full.  Data ends
+		 * at EOF or the first NUL. */
+		n = fread(buf + sizeof(MAGIC_STRING), 1, max + 1, stdin);
+		end = memchr(buf + sizeof(MAGIC_STRING), 0, n);
+		if(end)
+			n = end - (buf + sizeof(MAGIC_STRING));
+		if(n > max)
 		{
-			int dat = getchar();
-			if(dat == EOF || dat == 0)
-				break;
-
-			buf[i] = (char)dat;
-			if(i + 1 == 512)
-			{
-				fprintf(stderr, 
-					    "Max size for tsprodinfo is %zd.  Data not saved.\n",
-					    512 - strlen(MAGIC_STRING));
+			fprintf(stderr,
+				    "Max size for tsprodinfo is %zd.  Data not saved.\n",
+				    max);
+			return 1;
+		}
+		memset(buf + sizeof(MAGIC_STRING) + n, 0,
+		       LEGACY_MARK_OFF - sizeof(MAGIC_STRING) - n);
+		memcpy(buf + LEGACY_MARK_OFF, LEGACY_MARK, 4);
+		*(uint32_t *)&buf[LEGACY_CRC_OFF] = htole32(crc32(buf, LEGACY_CRC_OFF));
+
+		if(memcmp(buf, dev.sect, 512)) {
+			i = sector_write(&dev, dev.nsect - 1, 1, buf);
+			if(i) {
+				fprintf(stderr, "Write failed with: %s", strerror(-i));
 				return 1;
 			}
 		}
+		/* Re-read the format the --get/--set below work on */
+		memcpy(dev.sect, buf, 512);
+		dev.format = FMT_LEGACY;
+	}
 
-		wr = write(devfd, buf, 512);
-		if(wr != 512)
-		{
-			fprintf(stderr, "Write failed with: %s", strerror(errno));
-			return 1;
+	for (i = 0; i < nkv_ops; i++) {
+		char *arg = kv_ops[i] + 1, *val;
+		int r;
+
+		if(kv_ops[i][0] == 'g') {
+			r = kv_get(&dev, arg, &val);
+			if(r == 0) {
+				printf("%s\n", val);
+				free(val);
+			}
+		} else {
+			val = strchr(arg, '=');
+			if(!val) {
+				fprintf(stderr, "--set takes key=value\n");
+				return 1;
+			}
+			*val++ = 0;
+			r = kv_set(&dev, arg, val, opt_sectors);
+			nset += r == 0;
+		}
+		if(r == -ENOENT) {
+			fprintf(stderr, "%s: not found\n", arg);
+			ret = 1;
+		} else if(r) {
+			fprintf(stderr, "%s: %s\n", arg, strerror(-r));
+			ret = 1;
 		}
 	}
 
-	if(opt_read) {
-		int rd;
-		char buf[512];
+	/* A failed --set left the index as it was, the header only commits
+	 * the ones that succeeded */
+	if(nset) {
+		i = kv_write_hdr(&dev);
+		if(i) {
+			fprintf(stderr, "%s: %s\n", device, strerror(-i));
+			ret = 1;
+		}
+	}
+	if(opt_write || opt_set)
+		fprintf(stderr, "written=%d (%u sectors)\n", dev.written != 0,
+			dev.written);
+	i = prod_sync(&dev);
+	if(i) {
+		fprintf(stderr, "%s: %s\n", device, strerror(-i));
+		ret = 1;
+	}
 
-		rd = read(devfd, buf, 512);
-		if(rd != 512) {
-			fprintf(stderr, "%s", strerror(errno));
+	if(opt_read) {
+		if(dev.format == FMT_BAD) {
+			fprintf(stderr, "tsprodinfo CRC mismatch on this device\n");
 			return 1;
 		}
+		/* The indexed format prints as key=value lines */
+		if(dev.format == FMT_KV) {
+			i = kv_dump(&dev);
+			if(i) {
+				fprintf(stderr, "%s\n", strerror(-i));
+				return 1;
+			}
+			return ret;
+		}
 
 		/* Check for magic string */
-		if(strcmp(MAGIC_STRING, buf) != 0){
+		if(dev.format != FMT_LEGACY){
 			fprintf(stderr, "No tsprodinfo saved on this device\n");
 			return 1;
 		}
-		for (i = strlen(MAGIC_STRING)+1; i < 512; i++)
-		{
-			if(buf[i] != 0)
-				putchar(buf[i]);
-			else
-				break;
-		}
+		/* The record is NUL terminated and its CRC already checked */
+		fputs((char *)dev.sect + sizeof(MAGIC_STRING), stdout);
 	}
 
-	return 0;
+	return ret;
 }
-
@@ -0,0 +1,54 @@
+/* Multicall binary for the utilities, ./configure --enable-multicall.
+ * Each tool is built with -Dmain=<tool>_main and runs when argv[0] names
+ * it (make install links the tool names here) or when named as the first
+ * argument, 'tsutils silabs status'.  The tools open the FPGA and the I2C
+ * bus themselves on first use, so a command only maps what it touches. */
+
+#include <stdio.h>
+#include <string.h>
+
+int set_uart_baud_main(int argc, char **argv);
+int load_fpga_flash_main(int argc, char **argv);
+int fpga_peekpoke_main(int argc, char **argv);
+int silabs_main(int argc, char **argv);
+int tsprodinfo_main(int argc, char **argv);
+int tshwctl_main(int argc, char **argv);
+int tsboardstate_main(int argc, char **argv);
+
+static const struct {
+	const char *name;
+	int (*main)(int argc, char **argv);
+} tools[] = {
+	{ "set_uart_baud", set_uart_baud_main },
+	{ "load_fpga_flash", load_fpga_flash_main },
+	{ "fpga_peekpoke", fpga_peekpoke_main },
+	{ "silabs", silabs_main },
+	{ "tsprodinfo", tsprodinfo_main },
+	{ "tshwctl", tshwctl_main },
+	{ "tsboardstate", tsboardstate_main },
+};
+
+#define NTOOLS (sizeof(tools) / sizeof(tools[0]))
+
+int main(int argc, char **argv)
+{
+	const char *name = strrchr(argv[0], '/');
+	int i;
+
+	name = name ? name + 1 : argv[0];
+	for (i = 0; i < NTOOLS; i++)
+		if (strcmp(name, tools[i].name) == 0)
+			return tools[i].main(argc, argv);
+
+	if (argc > 1) {
+		for (i = 0; i < NTOOLS; i++)
+			if (strcmp(argv[1], tools[i].name) == 0)
+				return tools[i].main(argc - 1, argv + 1);
+	}
+
+	fprintf(stderr, "Usage: %s <tool> [ARGS] ...\nTools:", argv[0]);
+	for (i = 0; i < NTOOLS; i++)
+		fprintf(stderr, " %s", tools[i].name);
+	fprintf(stderr, "\n");
+	return 1;
+}
@@ -0,0 +1,418 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "set_uart_baud.c"
+
+#define MAX_SIZES 16
+/* A missing loopback shows up as a timeout instead of a hang */
+#define READ_TIMEOUT_MS 2000
+
+struct echo_args {
+	int fd;
+	volatile int stop;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int write_all(int fd, const uint8_t *buf, size_t len)
+{
+	ssize_t r;
+
+	while (len) {
+		r = write(fd, buf, len);
+		if (r < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return -1;
+		}
+		buf += r;
+		len -= r;
+	}
+	return 0;
+}
+
+/* Returns 0 once len bytes arrived, -1 on error or timeout */
+static int read_all(int fd, uint8_t *buf, size_t len)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	ssize_t r;
+
+	while (len) {
+		r = poll(&pfd, 1, READ_TIMEOUT_MS);
+		if (r == 0) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		r = read(fd, buf, len);
+		if (r < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return -1;
+		}
+		buf += r;
+		len -= r;
+	}
+	return 0;
+}
+
+/* Far end of a two port loopback: sends back whatever arrives */
+static void *echo_thread(void *arg)
+{
+	struct echo_args *e = arg;
+	struct pollfd pfd = { .fd = e->fd, .events = POLLIN };
+	uint8_t buf[4096];
+	ssize_t r;
+
+	while (!e->stop) {
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+		r = read(e->fd, buf, sizeof(buf));
+		if (r > 0 && write_all(e->fd, buf, r) < 0)
+			break;
+	}
+	return NULL;
+}
+
+struct tx_args {
+	int fd;
+	size_t len;
+};
+
+static void *tx_thread(void *arg)
+{
+	struct tx_args *t = arg;
+	uint8_t buf[4096];
+	size_t n, left = t->len;
+
+	for (n = 0; n < sizeof(buf); n++)
+		buf[n] = n;
+	while (left) {
+		n = left < sizeof(buf) ? left : sizeof(buf);
+		if (write_all(t->fd, buf, n) < 0)
+			break;
+		left -= n;
+	}
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double pct_us(const uint64_t *sorted, int n, double pct)
+{
+	int i = (int)(pct / 100 * (n - 1) + 0.5);
+
+	return sorted[i] / 1000.0;
+}
+
+static int icount(int fd, struct serial_icounter_struct *ic)
+{
+	memset(ic, 0, sizeof(*ic));
+	return ioctl(fd, TIOCGICOUNT, ic);
+}
+
+static void print_icount(const char *name, int ok,
+			 const struct serial_icounter_struct *a,
+			 const struct serial_icounter_struct *b)
+{
+	if (!ok) {
+		printf("%s_icount=unsupported\n", name);
+		return;
+	}
+	printf("%s_rx=%d\n", name, b->rx - a->rx);
+	printf("%s_tx=%d\n", name, b->tx - a->tx);
+	printf("%s_overrun=%d\n", name, b->overrun - a->overrun);
+	printf("%s_buf_overrun=%d\n", name, b->buf_overrun - a->buf_overrun);
+	printf("%s_frame=%d\n", name, b->frame - a->frame);
+	printf("%s_parity=%d\n", name, b->parity - a->parity);
+	printf("%s_brk=%d\n", name, b->brk - a->brk);
+}
+
+/* Master side of a pty pair for off target runs.  The slave end takes the
+ * place of the far UART. */
+static int open_pty(int *master, int *slave)
+{
+	struct termios tio;
+
+	*master = posix_openpt(O_RDWR|O_NOCTTY);
+	if (*master < 0)
+		return -1;
+	if (grantpt(*master) < 0 || unlockpt(*master) < 0)
+		return -1;
+	*slave = open(ptsname(*master), O_RDWR|O_NOCTTY);
+	if (*slave < 0)
+		return -1;
+	if (tcgetattr(*master, &tio) < 0)
+		return -1;
+	cfmakeraw(&tio);
+	return tcsetattr(*master, TCSANOW, &tio);
+}
+
+void usage(char **argv) {
+	fprintf(stderr,
+		"Usage: %s [OPTIONS] ...\n"
+		"embeddedTS UART throughput and latency benchmark\n"
+		"\n"
+		"  -d, --device <tty>     Port under test.  Alone, its TX must be\n"
+		"                         looped back to its RX\n"
+		"  -e, --echo <tty>       Second port wired to --device, echoes back\n"
+		"  -P, --pty              Use a pty pair instead of hardware\n"
+		"  -p, --port <num>       FPGA UART core behind --device.  Programs its\n"
+		"                         clock for --baud before the run\n"
+		"  -b, --baud <rate>      Line rate (default 115200)\n"
+		"  -s, --sizes <n,...>    Message sizes for round trips (default 1,16,64,256)\n"
+		"  -n, --count <n>        Round trips per size (default 1000)\n"
+		"  -t, --bytes <n>        Bytes for the throughput run (default 65536)\n"
+		"  -h, --help             This message\n"
+		"\n"
+		"Results are printed as key=value lines.\n",
+		argv[0]
+	);
+}
+
+int main(int argc, char **argv)
+{
+	int c, i, n;
+	char *opt_dev = NULL, *opt_echo = NULL;
+	int opt_pty = 0, opt_port = -1, opt_count = 1000;
+	uint32_t opt_baud = 115200;
+	size_t opt_bytes = 65536;
+	int sizes[MAX_SIZES] = { 1, 16, 64, 256 }, nsizes = 4;
+	int fd, efd = -1, ic_ok, mismatch = 0;
+	struct uart_lowlat ll;
+	struct baud_report rep;
+	struct serial_icounter_struct ic0, ic1, eic0, eic1;
+	struct echo_args echo;
+	struct tx_args tx;
+	pthread_t thr;
+	uint64_t *lat, t0, t1;
+	uint8_t *msg, *rx;
+
+	static struct option long_options[] = {
+		{ "device", required_argument, 0, 'd' },
+		{ "echo", required_argument, 0, 'e' },
+		{ "pty", 0, 0, 'P' },
+		{ "port", required_argument, 0, 'p' },
+		{ "baud", required_argument, 0, 'b' },
+		{ "sizes", required_argument, 0, 's' },
+		{ "count", required_argument, 0, 'n' },
+		{ "bytes", required_argument, 0, 't' },
+		{ "help", 0, 0, 'h' },
+		{ 0, 0, 0, 0 }
+	};
+
+	while((c = getopt_long(argc, argv, "d:e:Pp:b:s:n:t:h", long_options, NULL)) != -1) {
+		switch(c) {
+		case 'd':
+			opt_dev = optarg;
+			break;
+		case 'e':
+			opt_echo = optarg;
+			break;
+		case 'P':
+			opt_pty = 1;
+			break;
+		case 'p':
+			opt_port = atoi(optarg);
+			if(opt_port < 0 || opt_port > 7) {
+				fprintf(stderr, "Port must be between 0-7\n");
+				return 1;
+			}
+			break;
+		case 'b':
+			opt_baud = atoi(optarg);
+			break;
+		case 's': {
+			char *tok = strtok(optarg, ",");
+
+			for (nsizes = 0; tok && nsizes < MAX_SIZES; tok = strtok(NULL, ","))
+				sizes[nsizes++] = atoi(tok);
+			break;
+		}
+		case 'n':
+			opt_count = atoi(optarg);
+			break;
+		case 't':
+			opt_bytes = strtoul(optarg, NULL, 0);
+			break;
+		case ':':
+			fprintf(stderr, "%s: option `-%c' requires an argument\n",
+				argv[0], optopt);
+			break;
+		default:
+			fprintf(stderr, "%s: option `-%c' is invalid\n",
+				argv[0], optopt);
+		case 'h':
+			usage(argv);
+			return 1;
+		}
+	}
+
+	if (!opt_pty && !opt_dev) {
+		usage(argv);
+		return 1;
+	}
+	for (i = 0; i < nsizes; i++) {
+		if (sizes[i] < 1) {
+			fprintf(stderr, "Message sizes must be > 0\n");
+			return 1;
+		}
+	}
+	if (opt_count < 1)
+		opt_count = 1;
+
+	if (opt_pty) {
+		if (open_pty(&fd, &efd) < 0) {
+			perror("pty");
+			return 1;
+		}
+		if (uart_setup_lowlatency(efd, opt_baud, 1, 0, &ll) < 0) {
+			perror("pty");
+			return 1;
+		}
+	} else {
+		if (opt_port != -1)
+			fd = uart_open_lowlatency(opt_dev, opt_port, opt_baud,
+						  1, 0, &ll);
+		else if ((fd = open(opt_dev, O_RDWR|O_NOCTTY)) >= 0 &&
+			 uart_setup_lowlatency(fd, opt_baud, 1, 0, &ll) < 0)
+			fd = -1;
+		if (fd < 0) {
+			fprintf(stderr, "%s: %s\n", opt_dev, strerror(errno));
+			return 1;
+		}
+		if (opt_echo) {
+			efd = open(opt_echo, O_RDWR|O_NOCTTY);
+			if (efd < 0 || uart_setup_lowlatency(efd, opt_baud, 1, 0, &ll) < 0) {
+				fprintf(stderr, "%s: %s\n", opt_echo, strerror(errno));
+				return 1;
+			}
+		}
+	}
+
+	/* Configuration the numbers below were measured with */
+	printf("device=%s\n", opt_pty ? "pty" : opt_dev);
+	if (efd != -1)
+		printf("echo=%s\n", opt_pty ? "pty" : opt_echo);
+	printf("port=%d\n", opt_port);
+	printf("requested_baud=%u\n", opt_baud);
+	if (baud_analyze(opt_baud, &rep)) {
+		if (opt_port >= 0)
+			printf("fpga_reg=0x%08X\n",
+			       set_baudrate(opt_port, opt_baud));
+		printf("actual_baud=%f\n", rep.actual_baud);
+		printf("baud_ppm_error=%d\n", rep.ppm);
+		printf("max10bit_ppm=%d\n", rep.frame_ppm);
+	}
+	printf("low_latency=%d\n", ll.low_latency);
+
+	ic_ok = icount(fd, &ic0) == 0;
+	if (efd != -1)
+		icount(efd, &eic0);
+
+	/* Throughput: one direction, no echo running yet */
+	tx.fd = fd;
+	tx.len = opt_bytes;
+	rx = malloc(opt_bytes);
+	assert(rx);
+	t0 = now_ns();
+	pthread_create(&thr, NULL, tx_thread, &tx);
+	i = read_all(efd != -1 ? efd : fd, rx, opt_bytes);
+	t1 = now_ns();
+	pthread_join(thr, NULL);
+	free(rx);
+	if (i < 0) {
+		fprintf(stderr, "throughput: %s\n", strerror(errno));
+		return 1;
+	}
+	printf("throughput_bytes=%zu\n", opt_bytes);
+	printf("throughput_bps=%f\n", opt_bytes * 8 * 1e9 / (t1 - t0));
+	printf("throughput_line_pct=%f\n",
+	       opt_bytes * 10 * 1e9 / (t1 - t0) / ll.actual_baud * 100);
+
+	/* Round trips */
+	if (efd != -1) {
+		echo.fd = efd;
+		echo.stop = 0;
+		pthread_create(&thr, NULL, echo_thread, &echo);
+	}
+	lat = malloc(opt_count * sizeof(*lat));
+	assert(lat);
+	for (i = 0; i < nsizes; i++) {
+		msg = malloc(sizes[i]);
+		rx = malloc(sizes[i]);
+		assert(msg && rx);
+		for (n = 0; n < sizes[i]; n++)
+			msg[n] = n ^ 0x5a;
+
+		for (n = 0; n < opt_count; n++) {
+			t0 = now_ns();
+			if (write_all(fd, msg, sizes[i]) < 0 ||
+			    read_all(fd, rx, sizes[i]) < 0)
+				break;
+			lat[n] = now_ns() - t0;
+			if ((mismatch = memcmp(msg, rx, sizes[i]) != 0))
+				break;
+		}
+		if (n != opt_count) {
+			fprintf(stderr, "round trip of %d bytes failed: %s\n",
+				sizes[i], mismatch ? "data mismatch" : strerror(errno));
+			return 1;
+		}
+		qsort(lat, opt_count, sizeof(*lat), cmp_u64);
+		printf("rtt_%d_count=%d\n", sizes[i], opt_count);
+		printf("rtt_%d_min_us=%f\n", sizes[i], lat[0] / 1000.0);
+		printf("rtt_%d_p50_us=%f\n", sizes[i], pct_us(lat, opt_count, 50));
+		printf("rtt_%d_p90_us=%f\n", sizes[i], pct_us(lat, opt_count, 90));
+		printf("rtt_%d_p99_us=%f\n", sizes[i], pct_us(lat, opt_count, 99));
+		printf("rtt_%d_p999_us=%f\n", sizes[i], pct_us(lat, opt_count, 99.9));
+		printf("rtt_%d_max_us=%f\n", sizes[i], lat[opt_count - 1] / 1000.0);
+		free(msg);
+		free(rx);
+	}
+	free(lat);
+
+	if (efd != -1) {
+		echo.stop = 1;
+		pthread_join(thr, NULL);
+	}
+
+	icount(fd, &ic1);
+	print_icount("device", ic_ok, &ic0, &ic1);
+	if (efd != -1) {
+		ic_ok = icount(efd, &eic1) == 0;
+		print_icount("echo", ic_ok, &eic0, &eic1);
+	}
+
+	return 0;
+}